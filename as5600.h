@@ -8,6 +8,9 @@
  * Copyright 2025 Adapted by ChatGPT
  */
 
+#ifndef AS5600_H
+#define AS5600_H
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -16,10 +19,13 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <linux/i2c-dev.h>
+#include <linux/i2c.h>
 #include <math.h>
+#include "i2c_bus.h"
 
 #define AS5600_DEFAULT_ADDRESS 0x36
 #define AS5600_RW_MAX 2
+#define AS5600_SNAPSHOT_LEN (MAGNITUDE + MAGNITUDE_LEN - STATUS) // 0x0B..0x1C
 #define REG 1
 #define BYTE 8
 #define AS5600_MAX_ANGLE 4096
@@ -43,25 +49,47 @@ typedef enum {
 
 // AS5600 context
 typedef struct {
-    int fd; // file descriptor for I2C device
+    i2c_bus_t *bus; // shared I2C bus
 } as5600_t;
 
+// Output registers captured by a single read
+typedef struct {
+    uint8_t status;
+    uint16_t raw_angle;
+    uint16_t angle;
+    uint8_t agc;
+    uint16_t magnitude;
+} as5600_snapshot_t;
+
+/**
+ * Attach AS5600 to an already open shared bus.
+ */
+void as5600_init_on_bus(i2c_bus_t *bus, as5600_t *dev) {
+    dev->bus = bus;
+}
+
 /**
  * Initialize AS5600 on given I2C bus (e.g. "/dev/i2c-1").
  * Returns 0 on success, -1 on failure.
  */
 int as5600_init(const char *i2c_bus, as5600_t *dev) {
-    dev->fd = open(i2c_bus, O_RDWR);
-    if (dev->fd < 0) {
-        perror("Opening I2C bus");
-        return -1;
-    }
-    if (ioctl(dev->fd, I2C_SLAVE, AS5600_DEFAULT_ADDRESS) < 0) {
-        perror("Setting I2C_SLAVE address");
-        close(dev->fd);
-        return -1;
-    }
-    return 0;
+    dev->bus = i2c_bus_open_private(i2c_bus);
+    return dev->bus ? 0 : -1;
+}
+
+/* Release the bus opened by as5600_init(); not for a shared bus */
+void as5600_close(as5600_t *dev) {
+    i2c_bus_close_private(dev->bus);
+    dev->bus = NULL;
+}
+
+/**
+ * Register pointer write + data read joined by a repeated start: one ioctl,
+ * one bus transaction. Returns 0 on success, -1 on failure (the bus reports
+ * the error).
+ */
+int as5600_read_bytes(as5600_t *dev, uint8_t reg, uint8_t *buff, uint16_t len) {
+    return i2c_bus_read(dev->bus, AS5600_DEFAULT_ADDRESS, reg, buff, len);
 }
 
 /**
@@ -69,14 +97,11 @@ int as5600_init(const char *i2c_bus, as5600_t *dev) {
  */
 uint16_t as5600_read(as5600_t *dev, uint8_t reg, uint8_t len) {
     uint8_t buff[AS5600_RW_MAX] = {0};
-    if (write(dev->fd, &reg, 1) != 1) {
-        perror("I2C write register");
+    I2C_STATS_BEGIN(t0);
+    int err = as5600_read_bytes(dev, reg, buff, len);
+    I2C_STATS_END(I2C_STAT_AS5600_READ, t0);
+    if (err != 0)
         return 0;
-    }
-    if (read(dev->fd, buff, len) != len) {
-        perror("I2C read data");
-        return 0;
-    }
     if (len == 1)
         return buff[0];
     return (buff[0] << BYTE) | buff[1];
@@ -86,17 +111,14 @@ uint16_t as5600_read(as5600_t *dev, uint8_t reg, uint8_t len) {
  * Generic I2C write
  */
 void as5600_write(as5600_t *dev, uint8_t reg, uint16_t val, uint8_t len) {
-    uint8_t buff[REG + AS5600_RW_MAX] = {0};
-    buff[0] = reg;
+    uint8_t buff[AS5600_RW_MAX] = {0};
     if (len == 1) {
-        buff[1] = val & 0xFF;
+        buff[0] = val & 0xFF;
     } else {
-        buff[1] = (val >> BYTE) & 0xFF;
-        buff[2] = val & 0xFF;
-    }
-    if (write(dev->fd, buff, len + REG) < 0) {
-        perror("I2C write data");
+        buff[0] = (val >> BYTE) & 0xFF;
+        buff[1] = val & 0xFF;
     }
+    i2c_bus_write(dev->bus, AS5600_DEFAULT_ADDRESS, reg, buff, len);
 }
 
 // High-level API functions
@@ -115,6 +137,43 @@ int16_t as5600_read_magnitude(as5600_t *dev) { return as5600_read(dev, MAGNITUDE
 void as5600_burn_angle(as5600_t *dev) { as5600_write(dev, BURN, BURN_ANGLE, BURN_LEN); }
 void as5600_burn_setting(as5600_t *dev) { as5600_write(dev, BURN, BURN_SETTING, BURN_LEN); }
 
+/**
+ * Unpack a STATUS..MAGNITUDE register block
+ */
+void as5600_decode_snapshot(const uint8_t *buff, as5600_snapshot_t *snap) {
+#define AS5600_AT(r) (buff + (r) - STATUS)
+    snap->status = AS5600_AT(STATUS)[0];
+    snap->raw_angle = (AS5600_AT(RAW_ANGLE)[0] << BYTE) | AS5600_AT(RAW_ANGLE)[1];
+    snap->angle = (AS5600_AT(ANGLE)[0] << BYTE) | AS5600_AT(ANGLE)[1];
+    snap->agc = AS5600_AT(AGC)[0];
+    snap->magnitude = (AS5600_AT(MAGNITUDE)[0] << BYTE) | AS5600_AT(MAGNITUDE)[1];
+#undef AS5600_AT
+}
+
+/**
+ * Read STATUS..MAGNITUDE in one transaction so status, angles, AGC and
+ * magnitude all describe the same sample. Returns 0 on success, -1 on failure.
+ */
+int as5600_read_snapshot(as5600_t *dev, as5600_snapshot_t *snap) {
+    uint8_t buff[AS5600_SNAPSHOT_LEN];
+    I2C_STATS_BEGIN(t0);
+    int err = as5600_read_bytes(dev, STATUS, buff, sizeof buff);
+    I2C_STATS_END(I2C_STAT_AS5600_SNAPSHOT, t0);
+    if (err != 0)
+        return -1;
+    as5600_decode_snapshot(buff, snap);
+    return 0;
+}
+
+/**
+ * Queue the snapshot read on the shared bus; decode `buff` with
+ * as5600_decode_snapshot() after i2c_bus_flush(). Returns 0, or -1 if the
+ * batch is full.
+ */
+int as5600_queue_snapshot(as5600_t *dev, uint8_t buff[AS5600_SNAPSHOT_LEN]) {
+    return i2c_bus_queue_read(dev->bus, AS5600_DEFAULT_ADDRESS, STATUS, buff, AS5600_SNAPSHOT_LEN);
+}
+
 // Conversion helpers
 uint16_t as5600_mang_to_mpos(uint16_t zpos, uint16_t mang) {
     return (zpos + mang) % AS5600_MAX_ANGLE;
@@ -139,3 +198,74 @@ int8_t as5600_status_to_scale(uint8_t status) {
     if (status & ML) return (status & MD) ? -1 : -2;
     return 0;
 }
+
+/*
+ * Multi-turn tracking. Feed 12-bit angle samples (RAW_ANGLE, or ANGLE with
+ * the full 360° range) with their timestamps; the tracker unwraps them into
+ * an unbounded position and runs a fixed-point alpha-beta filter for
+ * velocity. Positions are in counts, AS5600_MAX_ANGLE per turn.
+ */
+#define AS5600_TRACKER_ALPHA_Q16 16384  // 0.25
+// alpha^2 / (2 - alpha), the Benedict-Bordner choice: a little underdamped
+// for a faster velocity estimate. Critical damping would be
+// (1 - sqrt(1 - alpha))^2, about 0.018 (1176 in Q16) at this alpha.
+#define AS5600_TRACKER_BETA_Q16  2341
+#define AS5600_TRACKER_MAX_DT_US 100000 // longer gaps restart the filter
+
+typedef struct {
+    int64_t position;   // unwrapped measured position
+    int64_t pos_q16;    // filtered position, Q16
+    int64_t vel_q16;    // filtered velocity in counts/s, Q16
+    uint64_t last_t_us;
+    uint16_t last_angl;
+    int32_t alpha_q16;
+    int32_t beta_q16;
+    int primed;
+} as5600_tracker_t;
+
+void as5600_tracker_init(as5600_tracker_t *trk, int32_t alpha_q16, int32_t beta_q16) {
+    memset(trk, 0, sizeof *trk);
+    trk->alpha_q16 = alpha_q16;
+    trk->beta_q16 = beta_q16;
+}
+
+void as5600_tracker_update(as5600_tracker_t *trk, uint16_t angl, uint64_t t_us) {
+    angl &= AS5600_MAX_ANGLE - 1;
+    if (!trk->primed) {
+        trk->position = angl;
+        trk->pos_q16 = (int64_t)angl << 16;
+        trk->vel_q16 = 0;
+        trk->last_angl = angl;
+        trk->last_t_us = t_us;
+        trk->primed = 1;
+        return;
+    }
+
+    // Shortest signed step on the circle; valid while the shaft turns less
+    // than half a revolution between samples.
+    int32_t step = (angl - trk->last_angl) & (AS5600_MAX_ANGLE - 1);
+    if (step >= AS5600_MAX_ANGLE / 2) step -= AS5600_MAX_ANGLE;
+    trk->position += step;
+    trk->last_angl = angl;
+
+    int64_t dt_us = (int64_t)(t_us - trk->last_t_us);
+    if (dt_us <= 0) return;
+    trk->last_t_us = t_us;
+    if (dt_us > AS5600_TRACKER_MAX_DT_US) {
+        trk->pos_q16 = trk->position * 65536;
+        trk->vel_q16 = 0;
+        return;
+    }
+
+    int64_t predicted = trk->pos_q16 + trk->vel_q16 * dt_us / 1000000;
+    int64_t residual = trk->position * 65536 - predicted;
+    trk->pos_q16 = predicted + residual * trk->alpha_q16 / 65536;
+    trk->vel_q16 += residual * trk->beta_q16 / 65536 * 1000000 / dt_us;
+}
+
+// Unwrapped position in counts, as measured
+int64_t as5600_tracker_position(const as5600_tracker_t *trk) { return trk->position; }
+// Filtered velocity in counts per second
+int32_t as5600_tracker_velocity(const as5600_tracker_t *trk) { return (int32_t)(trk->vel_q16 / 65536); }
+
+#endif
@@ -0,0 +1,151 @@
+// Driver micro-benchmarks on the simulated bus; runs on any Linux box.
+//
+//   ./bench [iterations] [latency_us] [scl_hz]
+//
+// With the default zero latency the wall time is pure driver + bus-layer
+// overhead. Give a latency (and SCL rate for wire time) to approximate a
+// real adapter. Every op also checks the simulated chip state, so a driver
+// change that breaks the register traffic fails the run.
+#include "i2c_bus.h"
+#include "i2c_sim.h"
+#include "i2cp.h"
+#include "as5600.h"
+#include "mpu6050.h"
+#include <stdint.h>
+
+// Host stand-ins for the wiringPi calls the drivers make.
+void delay(unsigned int ms) { usleep(ms * 1000); }
+unsigned long long piMicros64(void) { return i2c_bus_now_ns() / 1000; }
+int wiringPiISR(int pin, int mode, void (*fn)(void)) { (void)pin; (void)mode; (void)fn; return -1; }
+int wiringPiISRStop(int pin) { (void)pin; return 0; }
+
+static i2c_sim_t sim;
+static i2c_bus_t bus;
+static i2c_sim_pca9685_t sim_pca;
+static i2c_sim_as5600_t sim_enc;
+static i2c_sim_mpu6050_t sim_imu;
+static PCA9685 pca;
+static as5600_t enc;
+static mpu6050_t imu;
+static int failures;
+
+static void check(int ok, const char* op, long it) {
+  if (ok) return;
+  if (failures++ < 10) fprintf(stderr, "%s: simulated state mismatch at iteration %ld\n", op, it);
+}
+
+static uint16_t servo_ticks(long it, int channel) {
+  return 205 + (it * 7 + channel * 13) % 205;
+}
+
+static void op_servo1(long it) {
+  uint16_t off = servo_ticks(it, 0);
+  pca_set_pwm(&pca, 0, 0, off);
+  uint16_t on_r, off_r;
+  i2c_sim_pca9685_channel(&sim_pca, 0, &on_r, &off_r);
+  check(on_r == 0 && off_r == off, "servo x1", it);
+}
+
+static void op_servo16(long it) {
+  uint16_t on[PCA_CHANNELS] = {0}, off[PCA_CHANNELS];
+  for (int channel = 0; channel < PCA_CHANNELS; channel++) off[channel] = servo_ticks(it, channel);
+  pca_commit_frame(&pca, on, off, 0xFFFF);
+  for (int channel = 0; channel < PCA_CHANNELS; channel++) {
+    uint16_t on_r, off_r;
+    i2c_sim_pca9685_channel(&sim_pca, channel, &on_r, &off_r);
+    check(on_r == 0 && off_r == off[channel], "servo x16", it);
+  }
+}
+
+static void imu_step(long it, int16_t v[7]) {
+  for (int i = 0; i < 7; i++) v[i] = (int16_t)(it * 31 + i * 1000);
+  i2c_sim_mpu6050_sample(&sim_imu, v);
+}
+
+static void op_imu(long it) {
+  int16_t v[7];
+  mpu6050_sample_t s;
+  imu_step(it, v);
+  int err = mpu6050_read_all(&imu, &s);
+  check(!err && s.accel_raw[0] == v[0] && s.temp_raw == v[3] && s.gyro_raw[2] == v[6], "imu sample", it);
+}
+
+static void op_encoder(long it) {
+  as5600_snapshot_t snap;
+  sim_enc.raw = (it * 37) & 0xFFF;
+  int err = as5600_read_snapshot(&enc, &snap);
+  check(!err && snap.raw_angle == sim_enc.raw && snap.status == 0x20, "encoder sample", it);
+}
+
+// One control tick as the loop would run it: both sensors and a 16-servo
+// frame in a single flush.
+static void op_tick(long it) {
+  uint8_t enc_raw[AS5600_SNAPSHOT_LEN], imu_raw[MPU6050_SAMPLE_LEN];
+  uint16_t on[PCA_CHANNELS] = {0}, off[PCA_CHANNELS];
+  int16_t v[7];
+  imu_step(it, v);
+  sim_enc.raw = (it * 37) & 0xFFF;
+  for (int channel = 0; channel < PCA_CHANNELS; channel++) off[channel] = servo_ticks(it, channel);
+
+  as5600_queue_snapshot(&enc, enc_raw);
+  mpu6050_queue_read_all(&imu, imu_raw);
+  pca_queue_frame(&pca, on, off, 0xFFFF);
+  int err = i2c_bus_flush(&bus);
+
+  as5600_snapshot_t snap;
+  mpu6050_sample_t s;
+  as5600_decode_snapshot(enc_raw, &snap);
+  mpu6050_decode_sample(&imu, imu_raw, &s);
+  uint16_t on_r, off_r;
+  i2c_sim_pca9685_channel(&sim_pca, PCA_CHANNELS - 1, &on_r, &off_r);
+  check(!err && snap.raw_angle == sim_enc.raw && s.gyro_raw[0] == v[4] && off_r == off[PCA_CHANNELS - 1],
+        "full tick", it);
+}
+
+static void run(const char* name, void (*op)(long), long iterations) {
+  i2c_sim_t sim0 = sim;
+  i2c_bus_stats_t bus0 = bus.total;
+  uint64_t t0 = i2c_bus_now_ns();
+  for (long it = 0; it < iterations; it++) op(it);
+  uint64_t wall = i2c_bus_now_ns() - t0;
+  double n = iterations;
+  printf("%-16s %10.2f %10.2f %10.1f %10.1f %10.0f\n", name, (bus.total.ioctls - bus0.ioctls) / n,
+         (sim.transactions - sim0.transactions) / n, (sim.bytes - sim0.bytes) / n,
+         (bus.total.wire_ns - bus0.wire_ns) / 1e3 / n, wall / n);
+}
+
+int main(int argc, char** argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 100000;
+  uint64_t latency_us = argc > 2 ? strtoull(argv[2], NULL, 10) : 0;
+  unsigned speed_hz = argc > 3 ? atoi(argv[3]) : 0;
+
+  i2c_sim_init(&sim);
+  i2c_sim_pca9685_init(&sim_pca, 0x40);
+  i2c_sim_as5600_init(&sim_enc, AS5600_DEFAULT_ADDRESS);
+  i2c_sim_mpu6050_init(&sim_imu, MPU6050_ADDR);
+  i2c_sim_attach(&sim, &sim_pca.dev);
+  i2c_sim_attach(&sim, &sim_enc.dev);
+  i2c_sim_attach(&sim, &sim_imu.dev);
+  i2c_sim_open_bus(&bus, &sim, 0);
+
+  pca = pca_new_on_bus(&bus, 0x40);
+  pca_set_pwm_freq(&pca, 50);
+  as5600_init_on_bus(&bus, &enc);
+  if (mpu6050_init_on_bus(&bus, &imu) != 0) return 1;
+  i2c_sim_set_latency(&sim, latency_us * 1000, speed_hz);
+
+  printf("%ld iterations, %llu us latency, %s SCL\n", iterations, (unsigned long long)latency_us,
+         speed_hz ? "simulated" : "no");
+  printf("%-16s %10s %10s %10s %10s %10s\n", "op", "syscalls", "xacts", "bytes", "wire us", "wall ns");
+  run("servo x1", op_servo1, iterations);
+  run("servo x16", op_servo16, iterations);
+  run("imu sample", op_imu, iterations);
+  run("encoder sample", op_encoder, iterations);
+  run("full tick", op_tick, iterations);
+
+  if (failures) {
+    fprintf(stderr, "%d mismatches\n", failures);
+    return 1;
+  }
+  return 0;
+}
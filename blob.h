@@ -0,0 +1,392 @@
+/*
+ * Color-blob tracking on raw YUYV frames.
+ *
+ * Each row is thresholded against a YUV box (a pixel's Y and its pair's U
+ * and V must all be in range) straight into a bitmap, with the same SIMD
+ * dispatch as yuyv.h. The bitmap is cut into runs with ctz, and the runs
+ * are labeled against the runs of the row above (8-connected) with
+ * union-find. Area, coordinate sums and bounding box are accumulated per
+ * label while the frame is scanned, so one pass over the frame gives every
+ * blob; no label image is ever written.
+ */
+#ifndef BLOB_H
+#define BLOB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "yuyv.h"
+
+#define BLOB_DEFAULT_LABELS 16384
+
+typedef struct {
+    uint8_t y_min, y_max;
+    uint8_t u_min, u_max;
+    uint8_t v_min, v_max;
+} blob_range_t;
+
+typedef struct {
+    unsigned area;              // pixels
+    float cx, cy;               // centroid
+    unsigned x0, y0, x1, y1;    // bounding box, inclusive
+} blob_t;
+
+/* Sets the bits of the in-range pixels in `bits`, which must be zeroed; `pixels` is even */
+typedef void (*blob_threshold_fn)(const uint8_t *yuyv, size_t pixels, const blob_range_t *r, uint64_t *bits);
+
+static inline int blob_in(uint8_t x, uint8_t lo, uint8_t hi) {
+    return x >= lo && x <= hi;
+}
+
+static void blob_threshold_tail(const uint8_t *yuyv, size_t i, size_t pixels, const blob_range_t *r,
+                                uint64_t *bits) {
+    for (yuyv += 2 * i; i < pixels; i += 2, yuyv += 4) {
+        if (!blob_in(yuyv[1], r->u_min, r->u_max) || !blob_in(yuyv[3], r->v_min, r->v_max)) continue;
+        if (blob_in(yuyv[0], r->y_min, r->y_max)) bits[i >> 6] |= 1ull << (i & 63);
+        if (blob_in(yuyv[2], r->y_min, r->y_max)) bits[(i + 1) >> 6] |= 1ull << ((i + 1) & 63);
+    }
+}
+
+void blob_threshold_scalar(const uint8_t *yuyv, size_t pixels, const blob_range_t *r, uint64_t *bits) {
+    blob_threshold_tail(yuyv, 0, pixels, r, bits);
+}
+
+#ifdef YUYV_X86
+/*
+ * Byte-wise range test of 8 pixels with unsigned min/max against the
+ * bounds laid out as Y U Y V, then U & V ANDed into each pixel's word.
+ * An in-range pixel ends up as an all-ones int16.
+ */
+__attribute__((target("sse2")))
+static inline __m128i blob_test8_sse2(__m128i x, __m128i lo, __m128i hi) {
+    __m128i m = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(x, lo), x), _mm_cmpeq_epi8(_mm_min_epu8(x, hi), x));
+    __m128i c = _mm_and_si128(_mm_and_si128(m, _mm_srli_epi32(m, 16)), _mm_set1_epi32(0x0000FF00));
+    c = _mm_or_si128(c, _mm_slli_epi32(c, 16));
+    __m128i w = _mm_or_si128(_mm_and_si128(m, _mm_set1_epi32(0x00FF00FF)), c);
+    return _mm_cmpeq_epi16(w, _mm_set1_epi16(-1));
+}
+
+static inline int blob_pattern(uint8_t y, uint8_t u, uint8_t v) {
+    return (int)((uint32_t)v << 24 | (uint32_t)y << 16 | (uint32_t)u << 8 | y);
+}
+
+__attribute__((target("sse2")))
+void blob_threshold_sse2(const uint8_t *yuyv, size_t pixels, const blob_range_t *r, uint64_t *bits) {
+    const __m128i lo = _mm_set1_epi32(blob_pattern(r->y_min, r->u_min, r->v_min));
+    const __m128i hi = _mm_set1_epi32(blob_pattern(r->y_max, r->u_max, r->v_max));
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        __m128i a = blob_test8_sse2(_mm_loadu_si128((const __m128i *)(yuyv + 2 * i)), lo, hi);
+        __m128i b = blob_test8_sse2(_mm_loadu_si128((const __m128i *)(yuyv + 2 * i + 16)), lo, hi);
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_packs_epi16(a, b));
+        bits[i >> 6] |= (uint64_t)m << (i & 63);
+    }
+    blob_threshold_tail(yuyv, i, pixels, r, bits);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blob_test16_avx2(__m256i x, __m256i lo, __m256i hi) {
+    __m256i m = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(x, lo), x),
+                                 _mm256_cmpeq_epi8(_mm256_min_epu8(x, hi), x));
+    __m256i c = _mm256_and_si256(_mm256_and_si256(m, _mm256_srli_epi32(m, 16)), _mm256_set1_epi32(0x0000FF00));
+    c = _mm256_or_si256(c, _mm256_slli_epi32(c, 16));
+    __m256i w = _mm256_or_si256(_mm256_and_si256(m, _mm256_set1_epi32(0x00FF00FF)), c);
+    return _mm256_cmpeq_epi16(w, _mm256_set1_epi16(-1));
+}
+
+__attribute__((target("avx2")))
+void blob_threshold_avx2(const uint8_t *yuyv, size_t pixels, const blob_range_t *r, uint64_t *bits) {
+    const __m256i lo = _mm256_set1_epi32(blob_pattern(r->y_min, r->u_min, r->v_min));
+    const __m256i hi = _mm256_set1_epi32(blob_pattern(r->y_max, r->u_max, r->v_max));
+    size_t i = 0;
+    for (; i + 32 <= pixels; i += 32) {
+        __m256i a = blob_test16_avx2(_mm256_loadu_si256((const __m256i *)(yuyv + 2 * i)), lo, hi);
+        __m256i b = blob_test16_avx2(_mm256_loadu_si256((const __m256i *)(yuyv + 2 * i + 32)), lo, hi);
+        __m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+        bits[i >> 6] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(p) << (i & 63);
+    }
+    blob_threshold_tail(yuyv, i, pixels, r, bits);
+}
+#endif
+
+#ifdef YUYV_NEON
+static inline uint8x16_t blob_in_neon(uint8x16_t x, uint8_t lo, uint8_t hi) {
+    return vandq_u8(vcgeq_u8(x, vdupq_n_u8(lo)), vcleq_u8(x, vdupq_n_u8(hi)));
+}
+
+/* One bit per lane of a 0x00 / 0xFF mask, lane 0 in bit 0 */
+static inline unsigned blob_movemask_neon(uint8x16_t m) {
+    static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t t = vandq_u8(m, vld1q_u8(weights));
+    uint8x8_t s = vpadd_u8(vget_low_u8(t), vget_high_u8(t));
+    s = vpadd_u8(s, s);
+    s = vpadd_u8(s, s);
+    return vget_lane_u8(s, 0) | (unsigned)vget_lane_u8(s, 1) << 8;
+}
+
+/* 32 pixels per iteration: vld4 splits Y0/U/Y1/V, vzip puts the pixels back in order */
+void blob_threshold_neon(const uint8_t *yuyv, size_t pixels, const blob_range_t *r, uint64_t *bits) {
+    size_t i = 0;
+    for (; i + 32 <= pixels; i += 32) {
+        uint8x16x4_t px = vld4q_u8(yuyv + 2 * i);
+        uint8x16_t c = vandq_u8(blob_in_neon(px.val[1], r->u_min, r->u_max),
+                                blob_in_neon(px.val[3], r->v_min, r->v_max));
+        uint8x16x2_t z = vzipq_u8(vandq_u8(c, blob_in_neon(px.val[0], r->y_min, r->y_max)),
+                                  vandq_u8(c, blob_in_neon(px.val[2], r->y_min, r->y_max)));
+        uint64_t m = blob_movemask_neon(z.val[0]) | (uint64_t)blob_movemask_neon(z.val[1]) << 16;
+        bits[i >> 6] |= m << (i & 63);
+    }
+    blob_threshold_tail(yuyv, i, pixels, r, bits);
+}
+#endif
+
+typedef struct {
+    const char *name;
+    blob_threshold_fn fn;
+    int (*supported)(void);
+} blob_kernel_t;
+
+// Fastest first; the scalar reference always comes last.
+static const blob_kernel_t blob_kernels[] = {
+#ifdef YUYV_X86
+    { "avx2", blob_threshold_avx2, yuyv_has_avx2 },
+    { "sse2", blob_threshold_sse2, yuyv_has_sse2 },
+#endif
+#ifdef YUYV_NEON
+    { "neon", blob_threshold_neon, yuyv_has_neon },
+#endif
+    { "scalar", blob_threshold_scalar, yuyv_always },
+};
+#define BLOB_NKERNELS (sizeof blob_kernels / sizeof blob_kernels[0])
+
+/**
+ * Compare `fn` with the scalar reference on random rows of up to `pixels`
+ * pixels and a few ranges. Returns 0 if every bit matches, -1 otherwise.
+ */
+int blob_check(blob_threshold_fn fn, int rows, size_t pixels) {
+    size_t words = (pixels + 63) / 64;
+    uint8_t *src = malloc(pixels * 2);
+    uint64_t *want = malloc(words * 8), *got = malloc(words * 8);
+    int ret = src && want && got ? 0 : -1;
+    uint32_t x = 0x68E31DA4u;
+    for (int row = 0; ret == 0 && row < rows; row++) {
+        for (size_t i = 0; i < pixels * 2; i++) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            src[i] = x >> 24;
+        }
+        // Wide enough ranges that a good share of pixels passes.
+        blob_range_t r = { x & 63, 255 - (x >> 6 & 63), x >> 12 & 31, 255 - (x >> 17 & 31), x >> 22 & 31, 200 };
+        size_t n = pixels > 64 ? pixels - 2 * (row % 32) : pixels;
+        memset(want, 0, words * 8);
+        memset(got, 0, words * 8);
+        blob_threshold_scalar(src, n, &r, want);
+        fn(src, n, &r, got);
+        if (memcmp(want, got, words * 8) != 0) ret = -1;
+    }
+    free(src);
+    free(want);
+    free(got);
+    return ret;
+}
+
+typedef struct {
+    uint16_t start, end;        // inclusive
+    int label;                  // -1 once labels ran out
+} blob_run_t;
+
+typedef struct {
+    uint32_t area;
+    uint64_t sum_x, sum_y;
+    uint16_t x0, y0, x1, y1;
+} blob_acc_t;
+
+typedef struct {
+    unsigned width;
+    unsigned height;
+    blob_threshold_fn threshold;
+    const char *kernel;
+
+    uint64_t *bits;             // one row of the mask
+    blob_run_t *runs[2];        // runs of the previous and the current row
+    int *parent;                // union-find over labels
+    blob_acc_t *acc;            // per label; valid at roots
+    int max_labels;
+    int labels;
+    unsigned long overflows;    // runs dropped because max_labels ran out
+} blob_finder_t;
+
+/**
+ * Allocate the state for width x height frames, with room for
+ * `max_labels` labels (0 for the default) per frame, and pick the
+ * threshold kernel like yuyv_init(); $BLOB_KERNEL names one.
+ * Returns 0 on success, -1 on failure.
+ */
+int blob_finder_init(blob_finder_t *bf, unsigned width, unsigned height, int max_labels) {
+    memset(bf, 0, sizeof *bf);
+    if (width < 2 || width > UINT16_MAX || height > UINT16_MAX) return -1;
+    if (max_labels <= 0) max_labels = BLOB_DEFAULT_LABELS;
+    bf->width = width;
+    bf->height = height;
+    bf->max_labels = max_labels;
+    bf->bits = malloc((width + 63) / 64 * sizeof *bf->bits);
+    bf->runs[0] = malloc((width / 2 + 1) * sizeof *bf->runs[0]);
+    bf->runs[1] = malloc((width / 2 + 1) * sizeof *bf->runs[1]);
+    bf->parent = malloc(max_labels * sizeof *bf->parent);
+    bf->acc = malloc(max_labels * sizeof *bf->acc);
+    if (!bf->bits || !bf->runs[0] || !bf->runs[1] || !bf->parent || !bf->acc) {
+        perror("blob_finder_init");
+        return -1;
+    }
+
+    const char *want = getenv("BLOB_KERNEL");
+    bf->threshold = blob_threshold_scalar;
+    bf->kernel = "scalar";
+    for (size_t k = 0; k < BLOB_NKERNELS; k++) {
+        const blob_kernel_t *kern = &blob_kernels[k];
+        if (!kern->supported() || (want && strcmp(want, kern->name) != 0)) continue;
+        if (blob_check(kern->fn, 64, 1024) != 0) {
+            fprintf(stderr, "blob: %s kernel does not match the reference, skipping it\n", kern->name);
+            continue;
+        }
+        bf->threshold = kern->fn;
+        bf->kernel = kern->name;
+        break;
+    }
+    return 0;
+}
+
+void blob_finder_free(blob_finder_t *bf) {
+    free(bf->bits);
+    free(bf->runs[0]);
+    free(bf->runs[1]);
+    free(bf->parent);
+    free(bf->acc);
+    memset(bf, 0, sizeof *bf);
+}
+
+static int blob_root(blob_finder_t *bf, int l) {
+    while (bf->parent[l] != l) {
+        bf->parent[l] = bf->parent[bf->parent[l]];
+        l = bf->parent[l];
+    }
+    return l;
+}
+
+/* Join the sets of roots a and b; the smaller label stays the root */
+static int blob_union(blob_finder_t *bf, int a, int b) {
+    if (a == b) return a;
+    if (b < a) {
+        int t = a;
+        a = b;
+        b = t;
+    }
+    blob_acc_t *ra = &bf->acc[a], *rb = &bf->acc[b];
+    ra->area += rb->area;
+    ra->sum_x += rb->sum_x;
+    ra->sum_y += rb->sum_y;
+    if (rb->x0 < ra->x0) ra->x0 = rb->x0;
+    if (rb->y0 < ra->y0) ra->y0 = rb->y0;
+    if (rb->x1 > ra->x1) ra->x1 = rb->x1;
+    if (rb->y1 > ra->y1) ra->y1 = rb->y1;
+    bf->parent[b] = a;
+    return a;
+}
+
+/* First position >= x whose bit is set (flip = 0) or clear (flip = ~0) */
+static unsigned blob_next(const uint64_t *bits, unsigned words, unsigned x, uint64_t flip) {
+    unsigned k = x >> 6;
+    if (k >= words) return words * 64;
+    uint64_t w = (bits[k] ^ flip) & (~0ull << (x & 63));
+    while (!w) {
+        if (++k == words) return words * 64;
+        w = bits[k] ^ flip;
+    }
+    return k * 64 + __builtin_ctzll(w);
+}
+
+/* Label the runs of row y against the previous row's; returns the run count */
+static int blob_label_row(blob_finder_t *bf, unsigned y, const blob_run_t *prev, int nprev, blob_run_t *cur) {
+    unsigned words = (bf->width + 63) / 64;
+    int n = 0, j = 0;
+    for (unsigned x = 0;;) {
+        unsigned s = blob_next(bf->bits, words, x, 0);
+        if (s >= bf->width) break;
+        unsigned e = blob_next(bf->bits, words, s, ~0ull);
+        if (e > bf->width) e = bf->width;
+        x = e--;
+
+        // Runs above that touch [s - 1, e + 1].
+        while (j < nprev && prev[j].end + 1u < s) j++;
+        int label = -1;
+        for (int k = j; k < nprev && prev[k].start <= e + 1; k++) {
+            if (prev[k].label < 0) continue;
+            int root = blob_root(bf, prev[k].label);
+            label = label < 0 ? root : blob_union(bf, label, root);
+        }
+        blob_acc_t *a;
+        if (label < 0) {
+            if (bf->labels == bf->max_labels) {
+                bf->overflows++;
+                cur[n++] = (blob_run_t){ s, e, -1 };
+                continue;
+            }
+            label = bf->labels++;
+            bf->parent[label] = label;
+            a = &bf->acc[label];
+            *a = (blob_acc_t){ 0, 0, 0, s, y, e, y };
+        } else {
+            a = &bf->acc[label];
+            if (s < a->x0) a->x0 = s;
+            if (e > a->x1) a->x1 = e;
+            a->y1 = y;
+        }
+        unsigned len = e - s + 1;
+        a->area += len;
+        a->sum_x += (uint64_t)(s + e) * len / 2;
+        a->sum_y += (uint64_t)y * len;
+        cur[n++] = (blob_run_t){ s, e, label };
+    }
+    return n;
+}
+
+/**
+ * Find the blobs of pixels within `range` in a YUYV frame with `stride`
+ * bytes per row. Blobs of at least `min_area` pixels go to `out`, largest
+ * first, up to `max_out` of them.
+ * Returns the number written.
+ */
+int blob_find(blob_finder_t *bf, const uint8_t *yuyv, size_t stride, const blob_range_t *range, unsigned min_area,
+              blob_t *out, int max_out) {
+    size_t words = (bf->width + 63) / 64;
+    int nprev = 0;
+    bf->labels = 0;
+    for (unsigned y = 0; y < bf->height; y++) {
+        memset(bf->bits, 0, words * sizeof *bf->bits);
+        bf->threshold(yuyv + y * stride, bf->width & ~1u, range, bf->bits);
+        blob_run_t *prev = bf->runs[(y & 1) ^ 1], *cur = bf->runs[y & 1];
+        nprev = blob_label_row(bf, y, prev, nprev, cur);
+    }
+
+    int n = 0;
+    for (int l = 0; l < bf->labels; l++) {
+        const blob_acc_t *a = &bf->acc[l];
+        if (bf->parent[l] != l || a->area < min_area) continue;
+        // Insertion into the top max_out by area.
+        int i = n < max_out ? n++ : max_out;
+        while (i > 0 && out[i - 1].area < a->area) {
+            if (i < max_out) out[i] = out[i - 1];
+            i--;
+        }
+        if (i < max_out) {
+            out[i] = (blob_t){ a->area, (float)a->sum_x / a->area, (float)a->sum_y / a->area, a->x0, a->y0,
+                               a->x1, a->y1 };
+        }
+    }
+    return n;
+}
+
+#endif
@@ -0,0 +1,606 @@
+/*
+ * V4L2 capture thread with zero-copy, latest-frame-wins handoff.
+ *
+ * The device is opened in YUYV or MJPEG, whichever gives the requested
+ * size at the higher frame rate (on USB 2.0, large YUYV frames run out of
+ * bandwidth); MJPEG frames are handed on compressed, see mjpeg.h.
+ *
+ * One thread owns the device and waits for frames with poll() and a
+ * timeout. Consumers get read-only views straight into the driver's
+ * buffers (mmap'd, or our own page-aligned pool in USERPTR mode), not
+ * copies. Every view holds a reference, and a buffer goes back to the
+ * driver only when the last reference is released: the releasing thread
+ * sets the buffer's bit in an atomic pending mask and kicks an eventfd,
+ * and the capture thread re-queues it.
+ *
+ * Each consumer has a lock-free mailbox. The capture thread swaps the
+ * newest frame into it, and the consumer swaps it out when it is ready
+ * for another frame, so neither side ever waits. A frame replaced before
+ * the consumer took it counts as dropped and is released at once; a take
+ * that finds nothing new counts as stale. Consumers with nothing else to
+ * do can block in frame_mailbox_wait() instead of polling. A consumer
+ * holds at most two buffers (one waiting, one in use), so size the queue
+ * as roughly 2 * consumers + 2.
+ *
+ * Another frame source can stand in for the device by filling in the
+ * frames and a thread function instead of calling capture_open(); see
+ * framerec.h for replay from a recording.
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#define CAPTURE_DEFAULT_BUFFERS 4
+#define CAPTURE_MAX_BUFFERS     32  // bits of the pending mask
+#define CAPTURE_MAX_CONSUMERS   4
+#define CAPTURE_TIMEOUT_MS      1000
+
+struct capture;
+
+/* A view of one driver buffer; valid while the consumer holds it */
+typedef struct {
+    const uint8_t *data;
+    size_t bytes;               // valid bytes in data
+    unsigned width;
+    unsigned height;
+    unsigned stride;            // bytes per row, >= 2 * width; 0 for MJPEG
+    uint32_t seq;               // V4L2 sequence number
+    uint64_t t_ns;              // V4L2 timestamp (CLOCK_MONOTONIC)
+
+    struct capture *owner;
+    int index;
+    atomic_int refs;
+    size_t length;              // mapping / allocation size
+} capture_frame_t;
+
+static inline const uint8_t *capture_frame_row(const capture_frame_t *f, unsigned y) {
+    return f->data + (size_t)y * f->stride;
+}
+
+#define FRAME_MAILBOX_EMPTY (-1)
+
+typedef struct {
+    struct capture *cap;
+    atomic_int middle;          // newest untaken buffer, or FRAME_MAILBOX_EMPTY
+    int front;                  // buffer the consumer holds, or FRAME_MAILBOX_EMPTY
+    int wake_fd;                // eventfd kicked on publish, -1 unless waited on
+    atomic_ulong published;
+    atomic_ulong dropped;       // replaced before being taken
+    atomic_ulong stale;         // takes that found no new frame
+} frame_mailbox_t;
+
+typedef struct capture {
+    int fd;
+    int wake_fd;                // eventfd: released buffers are pending
+    unsigned memory;            // V4L2_MEMORY_MMAP or V4L2_MEMORY_USERPTR; 0 if the source owns them
+    uint32_t fourcc;            // V4L2_PIX_FMT_YUYV or V4L2_PIX_FMT_MJPEG
+    unsigned width;
+    unsigned height;
+    unsigned stride;            // 0 for MJPEG
+    size_t frame_bytes;         // most a frame can take
+    struct v4l2_fract interval; // frame interval the driver runs at, 0/0 if it does not say
+    capture_frame_t frames[CAPTURE_MAX_BUFFERS];
+    int nbuffers;
+    int timeout_ms;
+    atomic_uint pending;        // released buffers to re-queue, one bit each
+
+    frame_mailbox_t *consumers[CAPTURE_MAX_CONSUMERS];
+    int nconsumers;
+
+    pthread_t thread;
+    void *(*source_main)(void *);   // thread body for other sources, NULL for V4L2
+    void *source;
+    atomic_int running;
+    atomic_int finished;        // the thread stopped on its own: error or end of input
+    atomic_ulong frames_in;
+    atomic_ulong timeouts;      // polls that saw no frame within timeout_ms
+    atomic_ulong errors;        // failed ioctls and corrupt or empty frames
+} capture_t;
+
+static int capture_xioctl(int fd, unsigned long req, void *arg) {
+    int r;
+    while ((r = ioctl(fd, req, arg)) == -1 && errno == EINTR) {}
+    return r;
+}
+
+static int capture_queue(capture_t *cap, int index) {
+    struct v4l2_buffer buf = {0};
+    buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = cap->memory;
+    buf.index  = index;
+    if (cap->memory == V4L2_MEMORY_USERPTR) {
+        buf.m.userptr = (unsigned long)cap->frames[index].data;
+        buf.length = cap->frames[index].length;
+    }
+    if (capture_xioctl(cap->fd, VIDIOC_QBUF, &buf) == -1) {
+        perror("QBUF");
+        atomic_fetch_add_explicit(&cap->errors, 1, memory_order_relaxed);
+        return -1;
+    }
+    return 0;
+}
+
+/* Drop one reference; the last one hands the buffer back to the capture thread */
+void capture_frame_release(const capture_frame_t *frame) {
+    capture_frame_t *f = (capture_frame_t *)frame;
+    if (atomic_fetch_sub_explicit(&f->refs, 1, memory_order_acq_rel) != 1) return;
+    capture_t *cap = f->owner;
+    atomic_fetch_or_explicit(&cap->pending, 1u << f->index, memory_order_release);
+    uint64_t one = 1;
+    if (write(cap->wake_fd, &one, sizeof one) < 0) perror("capture wake");
+}
+
+/**
+ * Point *frame at the newest frame, releasing the one taken before.
+ * Returns 1 if it is new since the last call; 0 if it is the previous one
+ * again, or NULL if none was taken yet or it was released.
+ */
+int frame_mailbox_take(frame_mailbox_t *mb, const capture_frame_t **frame) {
+    int fresh = 0;
+    if (atomic_load_explicit(&mb->middle, memory_order_relaxed) != FRAME_MAILBOX_EMPTY) {
+        int idx = atomic_exchange_explicit(&mb->middle, FRAME_MAILBOX_EMPTY, memory_order_acq_rel);
+        if (idx != FRAME_MAILBOX_EMPTY) {
+            if (mb->front != FRAME_MAILBOX_EMPTY) capture_frame_release(&mb->cap->frames[mb->front]);
+            mb->front = idx;
+            fresh = 1;
+        }
+    }
+    if (!fresh) atomic_fetch_add_explicit(&mb->stale, 1, memory_order_relaxed);
+    *frame = mb->front == FRAME_MAILBOX_EMPTY ? NULL : &mb->cap->frames[mb->front];
+    return fresh;
+}
+
+/* Give the frame taken last back early, e.g. right after copying out of it */
+void frame_mailbox_release(frame_mailbox_t *mb) {
+    if (mb->front == FRAME_MAILBOX_EMPTY) return;
+    capture_frame_release(&mb->cap->frames[mb->front]);
+    mb->front = FRAME_MAILBOX_EMPTY;
+}
+
+/**
+ * Block until a frame is waiting or `timeout_ms` passes (-1: forever).
+ * Returns 1 if frame_mailbox_take() will get a new frame, 0 otherwise.
+ */
+int frame_mailbox_wait(frame_mailbox_t *mb, int timeout_ms) {
+    if (atomic_load_explicit(&mb->middle, memory_order_acquire) != FRAME_MAILBOX_EMPTY) return 1;
+    if (mb->wake_fd < 0) return 0;
+    struct pollfd pfd = { .fd = mb->wake_fd, .events = POLLIN };
+    if (poll(&pfd, 1, timeout_ms) > 0) {
+        uint64_t n;
+        if (read(mb->wake_fd, &n, sizeof n) < 0 && errno != EAGAIN) perror("frame_mailbox_wait");
+    }
+    return atomic_load_explicit(&mb->middle, memory_order_acquire) != FRAME_MAILBOX_EMPTY;
+}
+
+static void frame_mailbox_publish(frame_mailbox_t *mb, capture_frame_t *f) {
+    atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+    int old = atomic_exchange_explicit(&mb->middle, f->index, memory_order_acq_rel);
+    atomic_fetch_add_explicit(&mb->published, 1, memory_order_relaxed);
+    if (mb->wake_fd >= 0) {
+        uint64_t one = 1;
+        if (write(mb->wake_fd, &one, sizeof one) < 0) perror("frame_mailbox wake");
+    }
+    if (old != FRAME_MAILBOX_EMPTY) {
+        atomic_fetch_add_explicit(&mb->dropped, 1, memory_order_relaxed);
+        capture_frame_release(&mb->cap->frames[old]);
+    }
+}
+
+/* A format the device offers: pixel format, size and fastest frame rate */
+typedef struct {
+    uint32_t fourcc;
+    unsigned width;
+    unsigned height;
+    struct v4l2_fract interval; // shortest frame interval, 0/0 if the driver does not say
+} capture_mode_t;
+
+// Pixel formats the pipeline takes; on a tie the first wins, as it needs no decode.
+static const uint32_t capture_fourccs[] = { V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_MJPEG };
+#define CAPTURE_NFOURCCS (sizeof capture_fourccs / sizeof capture_fourccs[0])
+
+static int capture_fourcc_rank(uint32_t fourcc) {
+    for (size_t i = 0; i < CAPTURE_NFOURCCS; i++) {
+        if (capture_fourccs[i] == fourcc) return (int)i;
+    }
+    return -1;
+}
+
+/* Whether interval a is shorter than b; an unknown (0/0) interval is the longest */
+static int capture_faster(struct v4l2_fract a, struct v4l2_fract b) {
+    if (!a.denominator) return 0;
+    if (!b.denominator) return 1;
+    return (uint64_t)a.numerator * b.denominator < (uint64_t)b.numerator * a.denominator;
+}
+
+static unsigned capture_step(unsigned v, unsigned min, unsigned max, unsigned step) {
+    if (v < min) v = min;
+    if (v > max) v = max;
+    return step > 1 ? min + (v - min) / step * step : v;
+}
+
+static struct v4l2_fract capture_fastest(int fd, uint32_t fourcc, unsigned width, unsigned height) {
+    struct v4l2_fract best = { 0, 0 };
+    struct v4l2_frmivalenum iv = {0};
+    iv.pixel_format = fourcc;
+    iv.width = width;
+    iv.height = height;
+    for (; capture_xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &iv) == 0; iv.index++) {
+        // Stepwise and continuous ranges come as a single entry.
+        struct v4l2_fract f = iv.type == V4L2_FRMIVAL_TYPE_DISCRETE ? iv.discrete : iv.stepwise.min;
+        if (capture_faster(f, best)) best = f;
+        if (iv.type != V4L2_FRMIVAL_TYPE_DISCRETE) break;
+    }
+    return best;
+}
+
+/**
+ * Call fn for every size of every pixel format the device offers; of a
+ * stepwise size range, only the size nearest width x height.
+ */
+static void capture_each_mode(int fd, unsigned width, unsigned height,
+                              void (*fn)(void *ctx, const capture_mode_t *mode), void *ctx) {
+    struct v4l2_fmtdesc desc = {0};
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    for (; capture_xioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++) {
+        struct v4l2_frmsizeenum size = {0};
+        size.pixel_format = desc.pixelformat;
+        for (; capture_xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++) {
+            capture_mode_t m = { desc.pixelformat, size.discrete.width, size.discrete.height, { 0, 0 } };
+            if (size.type != V4L2_FRMSIZE_TYPE_DISCRETE) {
+                const struct v4l2_frmsize_stepwise *sw = &size.stepwise;
+                m.width = capture_step(width, sw->min_width, sw->max_width, sw->step_width);
+                m.height = capture_step(height, sw->min_height, sw->max_height, sw->step_height);
+            }
+            m.interval = capture_fastest(fd, m.fourcc, m.width, m.height);
+            fn(ctx, &m);
+            if (size.type != V4L2_FRMSIZE_TYPE_DISCRETE) break;
+        }
+    }
+}
+
+typedef struct {
+    uint32_t fourcc;            // 0: any the pipeline takes
+    unsigned width;
+    unsigned height;
+    capture_mode_t best;
+    int found;
+} capture_choice_t;
+
+static unsigned capture_distance(const capture_choice_t *c, const capture_mode_t *m) {
+    unsigned dw = m->width > c->width ? m->width - c->width : c->width - m->width;
+    unsigned dh = m->height > c->height ? m->height - c->height : c->height - m->height;
+    return dw + dh;
+}
+
+static void capture_consider(void *ctx, const capture_mode_t *m) {
+    capture_choice_t *c = ctx;
+    int rank = capture_fourcc_rank(m->fourcc);
+    if (rank < 0 || (c->fourcc && m->fourcc != c->fourcc)) return;
+    if (c->found) {
+        const capture_mode_t *b = &c->best;
+        unsigned d = capture_distance(c, m), db = capture_distance(c, b);
+        if (d != db) {
+            if (d > db) return;
+        } else if (capture_faster(b->interval, m->interval)) {
+            return;
+        } else if (!capture_faster(m->interval, b->interval) && rank >= capture_fourcc_rank(b->fourcc)) {
+            return;
+        }
+    }
+    c->best = *m;
+    c->found = 1;
+}
+
+/**
+ * Pick the mode of the open device `fd` for width x height: the nearest
+ * size, then the highest frame rate, then YUYV over MJPEG. With `fourcc`
+ * set, only that pixel format. Returns 0 on success, -1 if the driver
+ * lists nothing usable.
+ */
+int capture_choose_mode(int fd, uint32_t fourcc, unsigned width, unsigned height, capture_mode_t *mode) {
+    capture_choice_t c = { fourcc, width, height, {0}, 0 };
+    capture_each_mode(fd, width, height, capture_consider, &c);
+    if (!c.found) return -1;
+    *mode = c.best;
+    return 0;
+}
+
+static void capture_print_mode(void *ctx, const capture_mode_t *m) {
+    FILE *out = ctx;
+    fprintf(out, "  %.4s %4ux%-4u", (const char *)&m->fourcc, m->width, m->height);
+    if (m->interval.numerator) fprintf(out, " %5.1f fps", (double)m->interval.denominator / m->interval.numerator);
+    fputs(capture_fourcc_rank(m->fourcc) < 0 ? " (not supported)\n" : "\n", out);
+}
+
+/* Print every mode `device` offers. Returns 0, or -1 if it does not open. */
+int capture_list_modes(const char *device, unsigned width, unsigned height, FILE *out) {
+    int fd = open(device, O_RDWR | O_NONBLOCK);
+    if (fd < 0) { perror("Open device"); return -1; }
+    fprintf(out, "%s:\n", device);
+    capture_each_mode(fd, width, height, capture_print_mode, out);
+    close(fd);
+    return 0;
+}
+
+static void capture_free_buffers(capture_t *cap) {
+    for (int i = 0; i < cap->nbuffers; ++i) {
+        void *p = (void *)cap->frames[i].data;
+        if (cap->memory == V4L2_MEMORY_MMAP) munmap(p, cap->frames[i].length);
+        else if (cap->memory == V4L2_MEMORY_USERPTR) free(p);
+    }
+    cap->nbuffers = 0;
+}
+
+/**
+ * Open `device`, negotiate the mode capture_choose_mode() picks for width x
+ * height and `fourcc` (YUYV, MJPEG, or 0 for either) at its highest frame
+ * rate (the driver may adjust it; see cap->fourcc / width / height /
+ * stride), set up `nbuffers` buffers (0 for the default) of the given
+ * memory type and start streaming.
+ * Returns 0 on success, -1 on failure.
+ */
+int capture_open(capture_t *cap, const char *device, unsigned width, unsigned height, uint32_t fourcc,
+                 int nbuffers, unsigned memory) {
+    memset(cap, 0, sizeof *cap);
+    cap->timeout_ms = CAPTURE_TIMEOUT_MS;
+    cap->memory = memory;
+    cap->wake_fd = -1;
+    if (nbuffers <= 0) nbuffers = CAPTURE_DEFAULT_BUFFERS;
+    if (nbuffers > CAPTURE_MAX_BUFFERS) nbuffers = CAPTURE_MAX_BUFFERS;
+
+    cap->fd = open(device, O_RDWR | O_NONBLOCK);
+    if (cap->fd < 0) { perror("Open device"); return -1; }
+    cap->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cap->wake_fd < 0) {
+        perror("eventfd");
+        goto fail;
+    }
+
+    struct v4l2_capability caps = {0};
+    if (capture_xioctl(cap->fd, VIDIOC_QUERYCAP, &caps) == -1) {
+        perror("QueryCap");
+        goto fail;
+    }
+
+    // Drivers that list nothing get asked for the size as given.
+    capture_mode_t mode = { fourcc ? fourcc : V4L2_PIX_FMT_YUYV, width, height, { 0, 0 } };
+    capture_choose_mode(cap->fd, fourcc, width, height, &mode);
+
+    struct v4l2_format fmt = {0};
+    fmt.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width       = mode.width;
+    fmt.fmt.pix.height      = mode.height;
+    fmt.fmt.pix.pixelformat = mode.fourcc;
+    fmt.fmt.pix.field       = V4L2_FIELD_NONE;
+    if (capture_xioctl(cap->fd, VIDIOC_S_FMT, &fmt) == -1) {
+        perror("SetFmt");
+        goto fail;
+    }
+    cap->fourcc = fmt.fmt.pix.pixelformat;
+    if (capture_fourcc_rank(cap->fourcc) < 0) {
+        fprintf(stderr, "%s: no YUYV or MJPEG, got %.4s\n", device, (const char *)&cap->fourcc);
+        goto fail;
+    }
+    cap->width = fmt.fmt.pix.width;
+    cap->height = fmt.fmt.pix.height;
+    if (cap->fourcc == V4L2_PIX_FMT_YUYV) {
+        cap->stride = fmt.fmt.pix.bytesperline ? fmt.fmt.pix.bytesperline : cap->width * 2;
+        cap->frame_bytes = fmt.fmt.pix.sizeimage ? fmt.fmt.pix.sizeimage : (size_t)cap->stride * cap->height;
+    } else {
+        // A JPEG at sane quality is well under 2 bytes per pixel.
+        cap->frame_bytes = fmt.fmt.pix.sizeimage ? fmt.fmt.pix.sizeimage : (size_t)cap->width * cap->height * 2;
+    }
+
+    // Many drivers default to their slowest rate; ask for the fastest listed.
+    struct v4l2_streamparm parm = {0};
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parm.parm.capture.timeperframe = mode.interval;
+    if (mode.interval.denominator && capture_xioctl(cap->fd, VIDIOC_S_PARM, &parm) == 0)
+        cap->interval = parm.parm.capture.timeperframe;
+    else if (capture_xioctl(cap->fd, VIDIOC_G_PARM, &parm) == 0)
+        cap->interval = parm.parm.capture.timeperframe;
+
+    struct v4l2_requestbuffers req = {0};
+    req.count  = nbuffers;
+    req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = memory;
+    if (capture_xioctl(cap->fd, VIDIOC_REQBUFS, &req) == -1) {
+        perror("ReqBufs");
+        goto fail;
+    }
+    if (req.count > CAPTURE_MAX_BUFFERS) req.count = CAPTURE_MAX_BUFFERS;
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for (unsigned i = 0; i < req.count; ++i) {
+        capture_frame_t *f = &cap->frames[i];
+        f->owner = cap;
+        f->index = i;
+        f->width = cap->width;
+        f->height = cap->height;
+        f->stride = cap->stride;
+        if (memory == V4L2_MEMORY_MMAP) {
+            struct v4l2_buffer buf = {0};
+            buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            buf.memory = V4L2_MEMORY_MMAP;
+            buf.index  = i;
+            if (capture_xioctl(cap->fd, VIDIOC_QUERYBUF, &buf) == -1) {
+                perror("QueryBuf");
+                goto fail;
+            }
+            void *p = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, cap->fd, buf.m.offset);
+            if (p == MAP_FAILED) {
+                perror("MMAP");
+                goto fail;
+            }
+            f->data = p;
+            f->length = buf.length;
+        } else {
+            f->length = (cap->frame_bytes + page - 1) & ~(page - 1);
+            f->data = aligned_alloc(page, f->length);
+            if (!f->data) {
+                perror("Allocating capture buffer");
+                goto fail;
+            }
+        }
+        cap->nbuffers++;
+        if (capture_queue(cap, i) != 0) goto fail;
+    }
+
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (capture_xioctl(cap->fd, VIDIOC_STREAMON, &type) == -1) {
+        perror("StreamOn");
+        goto fail;
+    }
+    return 0;
+
+fail:
+    capture_free_buffers(cap);
+    if (cap->wake_fd >= 0) close(cap->wake_fd);
+    close(cap->fd);
+    cap->fd = -1;
+    return -1;
+}
+
+/**
+ * Register a consumer before capture_start(). With `waitable` set the
+ * consumer may block in frame_mailbox_wait(), at the cost of one eventfd
+ * write per frame. Returns 0, or -1 on failure.
+ */
+int capture_add_consumer(capture_t *cap, frame_mailbox_t *mb, int waitable) {
+    if (cap->nconsumers == CAPTURE_MAX_CONSUMERS) return -1;
+    memset(mb, 0, sizeof *mb);
+    mb->cap = cap;
+    atomic_init(&mb->middle, FRAME_MAILBOX_EMPTY);
+    mb->front = FRAME_MAILBOX_EMPTY;
+    mb->wake_fd = waitable ? eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) : -1;
+    if (waitable && mb->wake_fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+    cap->consumers[cap->nconsumers++] = mb;
+    return 0;
+}
+
+static void capture_requeue_pending(capture_t *cap) {
+    uint64_t n;
+    if (read(cap->wake_fd, &n, sizeof n) < 0 && errno != EAGAIN) perror("capture wake");
+    unsigned pending = atomic_exchange_explicit(&cap->pending, 0, memory_order_acquire);
+    while (pending) {
+        int i = __builtin_ctz(pending);
+        pending &= pending - 1;
+        capture_queue(cap, i);
+    }
+}
+
+static int capture_dequeue(capture_t *cap) {
+    struct v4l2_buffer buf = {0};
+    buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = cap->memory;
+    if (capture_xioctl(cap->fd, VIDIOC_DQBUF, &buf) == -1) {
+        if (errno == EAGAIN) return 0;
+        perror("DQBUF");
+        atomic_fetch_add_explicit(&cap->errors, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    // A corrupt or empty frame goes straight back to the driver.
+    if ((buf.flags & V4L2_BUF_FLAG_ERROR) || buf.bytesused == 0) {
+        atomic_fetch_add_explicit(&cap->errors, 1, memory_order_relaxed);
+        capture_queue(cap, buf.index);
+        return 0;
+    }
+
+    capture_frame_t *f = &cap->frames[buf.index];
+    f->bytes = buf.bytesused < f->length ? buf.bytesused : f->length;
+    f->seq = buf.sequence;
+    f->t_ns = (uint64_t)buf.timestamp.tv_sec * 1000000000ull + (uint64_t)buf.timestamp.tv_usec * 1000;
+    // Our own reference keeps the buffer alive until every mailbox has it.
+    atomic_store_explicit(&f->refs, 1, memory_order_relaxed);
+    for (int i = 0; i < cap->nconsumers; i++) frame_mailbox_publish(cap->consumers[i], f);
+    atomic_fetch_add_explicit(&cap->frames_in, 1, memory_order_relaxed);
+    capture_frame_release(f);
+    return 0;
+}
+
+static void *capture_main(void *arg) {
+    capture_t *cap = arg;
+    struct pollfd pfd[2] = {
+        { .fd = cap->fd, .events = POLLIN },
+        { .fd = cap->wake_fd, .events = POLLIN },
+    };
+    while (atomic_load_explicit(&cap->running, memory_order_acquire)) {
+        int n = poll(pfd, 2, cap->timeout_ms);
+        if (n == 0) {
+            atomic_fetch_add_explicit(&cap->timeouts, 1, memory_order_relaxed);
+            continue;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            atomic_fetch_add_explicit(&cap->errors, 1, memory_order_relaxed);
+            break;
+        }
+        if (pfd[1].revents & POLLIN) capture_requeue_pending(cap);
+        if ((pfd[0].revents & POLLIN) && capture_dequeue(cap) != 0) break;
+    }
+    atomic_store(&cap->finished, 1);
+    return NULL;
+}
+
+/* Returns 0 on success, -1 on failure */
+int capture_start(capture_t *cap) {
+    atomic_store(&cap->running, 1);
+    int err = pthread_create(&cap->thread, NULL, cap->source_main ? cap->source_main : capture_main, cap);
+    if (err != 0) {
+        atomic_store(&cap->running, 0);
+        errno = err;
+        perror("pthread_create");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stop the thread (within one poll timeout) and release the device.
+ * Consumers must be done with their frames.
+ */
+void capture_close(capture_t *cap) {
+    if (atomic_exchange(&cap->running, 0)) pthread_join(cap->thread, NULL);
+    if (cap->fd >= 0) {
+        int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        capture_xioctl(cap->fd, VIDIOC_STREAMOFF, &type);
+        close(cap->fd);
+    }
+    capture_free_buffers(cap);
+    for (int i = 0; i < cap->nconsumers; i++) {
+        if (cap->consumers[i]->wake_fd >= 0) close(cap->consumers[i]->wake_fd);
+    }
+    close(cap->wake_fd);
+    cap->fd = -1;
+}
+
+void capture_print_stats(capture_t *cap, FILE *out) {
+    fprintf(out, "capture: %lu frames, %lu timeouts, %lu errors\n", atomic_load(&cap->frames_in),
+            atomic_load(&cap->timeouts), atomic_load(&cap->errors));
+    for (int i = 0; i < cap->nconsumers; i++) {
+        frame_mailbox_t *mb = cap->consumers[i];
+        fprintf(out, "  consumer %d: %lu published, %lu dropped, %lu stale\n", i, atomic_load(&mb->published),
+                atomic_load(&mb->dropped), atomic_load(&mb->stale));
+    }
+}
+
+#endif
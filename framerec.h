@@ -0,0 +1,488 @@
+/*
+ * Raw frame recording and replay.
+ *
+ * A recording is an append-only file in host byte order:
+ *
+ *   framerec_header_t                               64 bytes
+ *   per frame: framerec_frame_t + frame bytes       padded to 64 bytes
+ *   framerec_index_t[count]                         one per frame
+ *   framerec_trailer_t                              points at the index
+ *
+ * The recorder is a capture consumer with its own thread. It copies each
+ * frame it takes, as the camera sent it (YUYV, or MJPEG still compressed),
+ * into a large staging buffer and hands it back at once,
+ * and the buffer goes to disk in multi-megabyte sequential writes, so the
+ * capture thread never waits on the disk. A frame replaced before the
+ * recorder got to it shows up as dropped in its mailbox stats. The index
+ * and trailer are written on close; a file without them (the recorder was
+ * killed) is still readable, the reader rebuilds the index by walking the
+ * frame headers.
+ *
+ * Replay mmaps the file and drives a capture_t in place of the device:
+ * frames are views straight into the mapping, so the rest of the pipeline
+ * cannot tell the difference. Frames are published at their recorded
+ * pace (optionally sped up), or at max speed in lockstep with the
+ * consumers, each frame once the previous one is released, so none are
+ * dropped and the consumers' throughput can be measured on any machine.
+ */
+#ifndef FRAMEREC_H
+#define FRAMEREC_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "capture.h"
+
+#define FRAMEREC_MAGIC          "YUYVREC"
+#define FRAMEREC_INDEX_MAGIC    "YUYVIDX"
+#define FRAMEREC_FRAME_MAGIC    0x4D415246u     // "FRAM"
+#define FRAMEREC_VERSION        1
+#define FRAMEREC_ALIGN          64
+#define FRAMEREC_WRITE_BYTES    (8u << 20)      // staging buffer, written out when full
+
+typedef struct {
+    char magic[8];              // FRAMEREC_MAGIC
+    uint32_t version;
+    uint32_t header_bytes;      // sizeof(framerec_header_t)
+    uint32_t fourcc;            // V4L2 pixel format of the frames
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;            // bytes per row
+    uint8_t reserved[32];
+} framerec_header_t;
+
+typedef struct {
+    uint32_t magic;             // FRAMEREC_FRAME_MAGIC
+    uint32_t seq;               // V4L2 sequence number
+    uint64_t t_ns;              // V4L2 timestamp (CLOCK_MONOTONIC)
+    uint64_t bytes;             // frame bytes that follow
+    uint64_t reserved;
+} framerec_frame_t;
+
+typedef struct {
+    uint64_t offset;            // of the framerec_frame_t
+    uint64_t t_ns;
+    uint32_t seq;
+    uint32_t reserved;
+    uint64_t bytes;
+} framerec_index_t;
+
+typedef struct {
+    char magic[8];              // FRAMEREC_INDEX_MAGIC
+    uint64_t index_offset;
+    uint64_t count;
+    uint64_t reserved;
+} framerec_trailer_t;
+
+static size_t framerec_pad(size_t n) {
+    return (n + FRAMEREC_ALIGN - 1) & ~(size_t)(FRAMEREC_ALIGN - 1);
+}
+
+/* write() all of it, or fail */
+static int framerec_write_all(int fd, const void *data, size_t n) {
+    const uint8_t *p = data;
+    while (n) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    uint8_t *buf;               // staging, FRAMEREC_WRITE_BYTES
+    size_t used;
+    uint64_t offset;            // file offset of buf[0]
+    framerec_index_t *index;
+    size_t count;
+    size_t index_alloc;
+    int failed;
+} framerec_writer_t;
+
+/* Flush the staging buffer; returns 0, or -1 once a write has failed */
+int framerec_writer_flush(framerec_writer_t *w) {
+    if (w->failed) return -1;
+    if (w->used && framerec_write_all(w->fd, w->buf, w->used) != 0) {
+        perror("framerec write");
+        w->failed = 1;
+        return -1;
+    }
+    w->offset += w->used;
+    w->used = 0;
+    return 0;
+}
+
+static int framerec_writer_put(framerec_writer_t *w, const void *data, size_t n) {
+    if (!n) return 0;
+    if (w->used + n > FRAMEREC_WRITE_BYTES && framerec_writer_flush(w) != 0) return -1;
+    if (n > FRAMEREC_WRITE_BYTES) {
+        // Bigger than the whole buffer: straight to the file.
+        if (framerec_write_all(w->fd, data, n) != 0) {
+            perror("framerec write");
+            w->failed = 1;
+            return -1;
+        }
+        w->offset += n;
+        return 0;
+    }
+    memcpy(w->buf + w->used, data, n);
+    w->used += n;
+    return 0;
+}
+
+/**
+ * Create (or truncate) `path` for width x height frames of `fourcc` with
+ * `stride` bytes per row. Returns 0 on success, -1 on failure.
+ */
+int framerec_writer_open(framerec_writer_t *w, const char *path, uint32_t fourcc, unsigned width,
+                         unsigned height, unsigned stride) {
+    memset(w, 0, sizeof *w);
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0) {
+        perror(path);
+        return -1;
+    }
+    w->buf = malloc(FRAMEREC_WRITE_BYTES);
+    if (!w->buf) {
+        perror("framerec staging buffer");
+        close(w->fd);
+        return -1;
+    }
+    framerec_header_t h = { FRAMEREC_MAGIC, FRAMEREC_VERSION, sizeof h, fourcc, width, height, stride, {0} };
+    return framerec_writer_put(w, &h, sizeof h);
+}
+
+/* Append one frame; returns 0, or -1 on failure */
+int framerec_writer_add(framerec_writer_t *w, const uint8_t *data, size_t bytes, uint32_t seq, uint64_t t_ns) {
+    static const uint8_t zeros[FRAMEREC_ALIGN];
+    if (w->count == w->index_alloc) {
+        size_t n = w->index_alloc ? w->index_alloc * 2 : 1024;
+        framerec_index_t *index = realloc(w->index, n * sizeof *index);
+        if (!index) return -1;
+        w->index = index;
+        w->index_alloc = n;
+    }
+    uint64_t offset = w->offset + w->used;
+    framerec_frame_t fh = { FRAMEREC_FRAME_MAGIC, seq, t_ns, bytes, 0 };
+    size_t pad = framerec_pad(sizeof fh + bytes) - sizeof fh - bytes;
+    if (framerec_writer_put(w, &fh, sizeof fh) != 0 || framerec_writer_put(w, data, bytes) != 0 ||
+        framerec_writer_put(w, zeros, pad) != 0) {
+        return -1;
+    }
+    w->index[w->count++] = (framerec_index_t){ offset, t_ns, seq, 0, bytes };
+    return 0;
+}
+
+/* Write the index and trailer and close; returns 0, or -1 if anything failed */
+int framerec_writer_close(framerec_writer_t *w) {
+    framerec_trailer_t t = { FRAMEREC_INDEX_MAGIC, w->offset + w->used, w->count, 0 };
+    int err = framerec_writer_put(w, w->index, w->count * sizeof *w->index);
+    if (!err) err = framerec_writer_put(w, &t, sizeof t);
+    if (!err) err = framerec_writer_flush(w);
+    if (close(w->fd) != 0) err = -1;
+    free(w->buf);
+    free(w->index);
+    w->buf = NULL;
+    w->index = NULL;
+    return err ? -1 : 0;
+}
+
+typedef struct {
+    framerec_writer_t writer;
+    frame_mailbox_t mailbox;
+    pthread_t thread;
+    atomic_int running;
+    unsigned long frames;
+    uint64_t bytes;
+} framerec_recorder_t;
+
+static void *framerec_recorder_main(void *arg) {
+    framerec_recorder_t *rec = arg;
+    while (atomic_load_explicit(&rec->running, memory_order_acquire)) {
+        const capture_frame_t *f;
+        if (!frame_mailbox_wait(&rec->mailbox, 100) || !frame_mailbox_take(&rec->mailbox, &f)) continue;
+        int err = framerec_writer_add(&rec->writer, f->data, f->bytes, f->seq, f->t_ns);
+        frame_mailbox_release(&rec->mailbox);
+        if (err) break;
+        rec->frames++;
+        rec->bytes += f->bytes;
+    }
+    return NULL;
+}
+
+/**
+ * Record every frame `cap` delivers (that the disk keeps up with) to
+ * `path`. Call before capture_start(). Returns 0 on success, -1 on failure.
+ */
+int framerec_recorder_start(framerec_recorder_t *rec, capture_t *cap, const char *path) {
+    memset(rec, 0, sizeof *rec);
+    if (framerec_writer_open(&rec->writer, path, cap->fourcc, cap->width, cap->height, cap->stride) != 0)
+        return -1;
+    if (capture_add_consumer(cap, &rec->mailbox, 1) != 0) {
+        framerec_writer_close(&rec->writer);
+        return -1;
+    }
+    atomic_store(&rec->running, 1);
+    int err = pthread_create(&rec->thread, NULL, framerec_recorder_main, rec);
+    if (err != 0) {
+        atomic_store(&rec->running, 0);
+        errno = err;
+        perror("pthread_create");
+        framerec_writer_close(&rec->writer);
+        return -1;
+    }
+    return 0;
+}
+
+/* Stop recording and finish the file; returns 0, or -1 if it is incomplete */
+int framerec_recorder_stop(framerec_recorder_t *rec) {
+    if (atomic_exchange(&rec->running, 0)) pthread_join(rec->thread, NULL);
+    frame_mailbox_release(&rec->mailbox);
+    return framerec_writer_close(&rec->writer);
+}
+
+typedef struct {
+    int fd;
+    const uint8_t *map;
+    size_t size;
+    framerec_header_t header;
+    const framerec_index_t *index;
+    size_t count;
+    framerec_index_t *rebuilt;  // index built by scanning, when the file has none
+} framerec_reader_t;
+
+static const framerec_frame_t *framerec_frame_at(const framerec_reader_t *r, uint64_t offset) {
+    if (offset > r->size || r->size - offset < sizeof(framerec_frame_t)) return NULL;
+    const framerec_frame_t *fh = (const framerec_frame_t *)(r->map + offset);
+    if (fh->magic != FRAMEREC_FRAME_MAGIC || fh->bytes > r->size - offset - sizeof *fh) return NULL;
+    return fh;
+}
+
+/* Walk the frame headers of a file that was not closed properly */
+static int framerec_reader_scan(framerec_reader_t *r) {
+    size_t alloc = 0;
+    uint64_t offset = r->header.header_bytes;
+    const framerec_frame_t *fh;
+    while ((fh = framerec_frame_at(r, offset))) {
+        if (r->count == alloc) {
+            alloc = alloc ? alloc * 2 : 1024;
+            framerec_index_t *index = realloc(r->rebuilt, alloc * sizeof *index);
+            if (!index) return -1;
+            r->rebuilt = index;
+        }
+        r->rebuilt[r->count++] = (framerec_index_t){ offset, fh->t_ns, fh->seq, 0, fh->bytes };
+        offset += framerec_pad(sizeof *fh + fh->bytes);
+    }
+    r->index = r->rebuilt;
+    return 0;
+}
+
+/**
+ * Map the recording at `path` and load its index.
+ * Returns 0 on success, -1 on failure.
+ */
+int framerec_reader_open(framerec_reader_t *r, const char *path) {
+    memset(r, 0, sizeof *r);
+    r->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (r->fd < 0) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(r->fd, &st) != 0 || (size_t)st.st_size < sizeof r->header) {
+        fprintf(stderr, "%s: not a recording\n", path);
+        close(r->fd);
+        return -1;
+    }
+    r->size = (size_t)st.st_size;
+    void *map = mmap(NULL, r->size, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("framerec mmap");
+        close(r->fd);
+        return -1;
+    }
+    r->map = map;
+    madvise(map, r->size, MADV_SEQUENTIAL);
+    memcpy(&r->header, r->map, sizeof r->header);
+    if (memcmp(r->header.magic, FRAMEREC_MAGIC, sizeof r->header.magic) != 0 ||
+        r->header.version != FRAMEREC_VERSION || r->header.header_bytes < sizeof r->header) {
+        fprintf(stderr, "%s: not a recording, or an unsupported version\n", path);
+        munmap(map, r->size);
+        close(r->fd);
+        return -1;
+    }
+
+    framerec_trailer_t t;
+    memcpy(&t, r->map + r->size - sizeof t, sizeof t);
+    int indexed = r->size >= r->header.header_bytes + sizeof t &&
+                  memcmp(t.magic, FRAMEREC_INDEX_MAGIC, sizeof t.magic) == 0 &&
+                  t.index_offset % sizeof(uint64_t) == 0 && t.index_offset <= r->size - sizeof t &&
+                  t.count <= (r->size - sizeof t - t.index_offset) / sizeof(framerec_index_t);
+    if (indexed) {
+        r->index = (const framerec_index_t *)(r->map + t.index_offset);
+        r->count = t.count;
+        for (size_t i = 0; i < r->count; i++) {
+            if (!framerec_frame_at(r, r->index[i].offset)) indexed = 0;
+        }
+    }
+    if (!indexed) {
+        r->count = 0;
+        fprintf(stderr, "%s: no valid index, scanning frames\n", path);
+        if (framerec_reader_scan(r) != 0) {
+            perror("framerec index");
+            munmap(map, r->size);
+            close(r->fd);
+            free(r->rebuilt);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Frame i's bytes, in the mapping */
+static inline const uint8_t *framerec_reader_frame(const framerec_reader_t *r, size_t i) {
+    return r->map + r->index[i].offset + sizeof(framerec_frame_t);
+}
+
+void framerec_reader_close(framerec_reader_t *r) {
+    munmap((void *)r->map, r->size);
+    close(r->fd);
+    free(r->rebuilt);
+    memset(r, 0, sizeof *r);
+}
+
+typedef struct {
+    const framerec_reader_t *reader;
+    double speed;               // 1 = as recorded, 2 = twice as fast, 0 = max in lockstep
+    int loop;
+    unsigned long loops;
+} framerec_replay_t;
+
+static uint64_t framerec_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Wait for a released buffer or until `deadline` (0: one poll timeout) */
+static void framerec_replay_wait(capture_t *cap, uint64_t deadline) {
+    struct pollfd pfd = { .fd = cap->wake_fd, .events = POLLIN };
+    uint64_t ns = (uint64_t)cap->timeout_ms * 1000000;
+    if (deadline) {
+        uint64_t now = framerec_now_ns();
+        ns = deadline > now ? deadline - now : 0;
+    }
+    struct timespec ts = { (time_t)(ns / 1000000000), (long)(ns % 1000000000) };
+    if (ppoll(&pfd, 1, &ts, NULL) > 0) {
+        uint64_t n;
+        if (read(cap->wake_fd, &n, sizeof n) < 0 && errno != EAGAIN) perror("replay wake");
+    }
+}
+
+static void *framerec_replay_main(void *arg) {
+    capture_t *cap = arg;
+    framerec_replay_t *rp = cap->source;
+    const framerec_reader_t *r = rp->reader;
+    unsigned free_mask = cap->nbuffers == CAPTURE_MAX_BUFFERS ? ~0u : (1u << cap->nbuffers) - 1;
+    int last = -1;              // buffer published last
+    uint64_t t0 = framerec_now_ns();
+    size_t i = 0;
+    while (atomic_load_explicit(&cap->running, memory_order_acquire)) {
+        if (i == r->count) {
+            if (!rp->loop || !r->count) break;
+            i = 0;
+            t0 = framerec_now_ns();
+            rp->loops++;
+        }
+        free_mask |= atomic_exchange_explicit(&cap->pending, 0, memory_order_acquire);
+        // At max speed the previous frame must be back first, so nothing is dropped.
+        if (!free_mask || (rp->speed <= 0 && last >= 0 && !(free_mask & 1u << last))) {
+            framerec_replay_wait(cap, 0);
+            continue;
+        }
+        if (rp->speed > 0) {
+            uint64_t due = t0 + (uint64_t)((r->index[i].t_ns - r->index[0].t_ns) / rp->speed);
+            if (framerec_now_ns() < due) {
+                framerec_replay_wait(cap, due);
+                continue;
+            }
+        }
+
+        int b = __builtin_ctz(free_mask);
+        free_mask &= free_mask - 1;
+        capture_frame_t *f = &cap->frames[b];
+        f->data = framerec_reader_frame(r, i);
+        f->bytes = r->index[i].bytes;
+        f->length = r->index[i].bytes;
+        f->seq = r->index[i].seq;
+        // Stamped on publish, so latency is measured against replay time.
+        f->t_ns = framerec_now_ns();
+        atomic_store_explicit(&f->refs, 1, memory_order_relaxed);
+        for (int c = 0; c < cap->nconsumers; c++) frame_mailbox_publish(cap->consumers[c], f);
+        atomic_fetch_add_explicit(&cap->frames_in, 1, memory_order_relaxed);
+        capture_frame_release(f);
+        last = b;
+        i++;
+    }
+    atomic_store(&cap->finished, 1);
+    return NULL;
+}
+
+/**
+ * Set `cap` up to replay `r` with `nbuffers` buffers (0 for the default);
+ * add consumers and capture_start() as for a camera. `rp` holds the speed
+ * and loop settings and must outlive the capture.
+ * Returns 0 on success, -1 on failure.
+ */
+int framerec_replay_open(capture_t *cap, framerec_replay_t *rp, int nbuffers) {
+    const framerec_reader_t *r = rp->reader;
+    if (capture_fourcc_rank(r->header.fourcc) < 0) {
+        fprintf(stderr, "replay: recording is neither YUYV nor MJPEG\n");
+        return -1;
+    }
+    memset(cap, 0, sizeof *cap);
+    cap->fd = -1;
+    cap->timeout_ms = CAPTURE_TIMEOUT_MS;
+    cap->fourcc = r->header.fourcc;
+    cap->width = r->header.width;
+    cap->height = r->header.height;
+    cap->stride = r->header.stride;
+    cap->frame_bytes = (size_t)cap->stride * cap->height;
+    cap->source_main = framerec_replay_main;
+    cap->source = rp;
+    cap->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cap->wake_fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+    if (nbuffers <= 0) nbuffers = CAPTURE_DEFAULT_BUFFERS;
+    if (nbuffers > CAPTURE_MAX_BUFFERS) nbuffers = CAPTURE_MAX_BUFFERS;
+    for (int i = 0; i < nbuffers; i++) {
+        capture_frame_t *f = &cap->frames[i];
+        f->owner = cap;
+        f->index = i;
+        f->width = cap->width;
+        f->height = cap->height;
+        f->stride = cap->stride;
+    }
+    cap->nbuffers = nbuffers;
+    return 0;
+}
+
+#endif
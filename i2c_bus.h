@@ -0,0 +1,248 @@
+/*
+ * Shared I2C bus for the PCA9685, AS5600 and MPU6050 drivers.
+ *
+ * All transfers go through I2C_RDWR with an explicit slave address, so one
+ * open fd serves every device. Messages can be queued for several devices
+ * and sent with a single ioctl: the kernel joins them with repeated starts
+ * and only issues a STOP at the end.
+ *
+ * A bus can also be bound to another transfer backend (see i2c_sim.h), in
+ * which case flushes never reach the kernel.
+ */
+#ifndef I2C_BUS_H
+#define I2C_BUS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "i2c_stats.h"
+
+#define I2C_BUS_DEFAULT_HZ 100000
+#define I2C_BUS_MAX_MSGS   I2C_RDWR_IOCTL_MAX_MSGS
+#define I2C_BUS_SCRATCH    512 // register pointers and write payloads of one batch
+
+typedef struct {
+    unsigned long ioctls;
+    unsigned long msgs;
+    unsigned long bytes;    // payload bytes, both directions
+    unsigned long errors;
+    uint64_t busy_ns;       // wall time spent in the ioctl
+    uint64_t wire_ns;       // estimated time the bus itself was driven
+} i2c_bus_stats_t;
+
+/*
+ * Performs one combined transfer, I2C_RDWR style. Returns the number of
+ * messages transferred, or -1 with errno set.
+ */
+typedef int (*i2c_bus_transfer_fn)(void *ctx, struct i2c_msg *msgs, int nmsgs);
+
+typedef struct {
+    int fd;
+    unsigned speed_hz;      // SCL rate, only used for wire_ns
+    i2c_bus_transfer_fn transfer;   // NULL: I2C_RDWR on fd
+    void *backend;                  // transfer context
+
+    struct i2c_msg msgs[I2C_BUS_MAX_MSGS];
+    int nmsgs;
+    uint8_t scratch[I2C_BUS_SCRATCH];
+    int scratch_used;
+
+    i2c_bus_stats_t tick;   // since the last i2c_bus_tick()
+    i2c_bus_stats_t total;
+} i2c_bus_t;
+
+/**
+ * Open an I2C adapter (e.g. "/dev/i2c-1"). `speed_hz` is the configured SCL
+ * rate; pass 0 for the 100 kHz default. Returns 0 on success, -1 on failure.
+ */
+int i2c_bus_open(i2c_bus_t *bus, const char *device, unsigned speed_hz) {
+    memset(bus, 0, sizeof *bus);
+    bus->speed_hz = speed_hz ? speed_hz : I2C_BUS_DEFAULT_HZ;
+    bus->fd = open(device, O_RDWR);
+    if (bus->fd < 0) {
+        perror("Opening I2C bus");
+        return -1;
+    }
+    return 0;
+}
+
+/* Bind a bus to a non-kernel backend; it is never backed by an fd */
+void i2c_bus_open_backend(i2c_bus_t *bus, i2c_bus_transfer_fn transfer, void *ctx, unsigned speed_hz) {
+    memset(bus, 0, sizeof *bus);
+    bus->fd = -1;
+    bus->speed_hz = speed_hz ? speed_hz : I2C_BUS_DEFAULT_HZ;
+    bus->transfer = transfer;
+    bus->backend = ctx;
+}
+
+void i2c_bus_close(i2c_bus_t *bus) {
+    if (bus->fd >= 0) close(bus->fd);
+    bus->fd = -1;
+}
+
+/* Opens a bus owned by a single driver, for the path-based *_init calls */
+i2c_bus_t *i2c_bus_open_private(const char *device) {
+    i2c_bus_t *bus = malloc(sizeof *bus);
+    if (!bus) {
+        perror("Allocating I2C bus");
+        return NULL;
+    }
+    if (i2c_bus_open(bus, device, 0) != 0) {
+        free(bus);
+        return NULL;
+    }
+    return bus;
+}
+
+/* Close and free a bus from i2c_bus_open_private() */
+void i2c_bus_close_private(i2c_bus_t *bus) {
+    if (!bus) return;
+    i2c_bus_close(bus);
+    free(bus);
+}
+
+static int i2c_bus_push(i2c_bus_t *bus, uint16_t addr, uint16_t flags, uint8_t *buf, uint16_t len) {
+    if (bus->nmsgs == I2C_BUS_MAX_MSGS) {
+        fprintf(stderr, "i2c_bus: batch is full\n");
+        return -1;
+    }
+    bus->msgs[bus->nmsgs++] = (struct i2c_msg){ .addr = addr, .flags = flags, .len = len, .buf = buf };
+    return 0;
+}
+
+static uint8_t *i2c_bus_scratch(i2c_bus_t *bus, int len) {
+    if (bus->scratch_used + len > I2C_BUS_SCRATCH) {
+        fprintf(stderr, "i2c_bus: batch scratch is full\n");
+        return NULL;
+    }
+    uint8_t *p = bus->scratch + bus->scratch_used;
+    bus->scratch_used += len;
+    return p;
+}
+
+/**
+ * Whether `msgs` more messages using `scratch` bytes of register pointers
+ * and write payload fit in the batch without a flush.
+ */
+int i2c_bus_room(const i2c_bus_t *bus, int msgs, int scratch) {
+    return bus->nmsgs + msgs <= I2C_BUS_MAX_MSGS && bus->scratch_used + scratch <= I2C_BUS_SCRATCH;
+}
+
+/**
+ * Queue a write of `len` bytes to consecutive registers from `reg`. The
+ * data is copied, so `data` may go out of scope before the flush.
+ * Returns 0 on success, -1 if the batch is full.
+ */
+int i2c_bus_queue_write(i2c_bus_t *bus, uint8_t addr, uint8_t reg, const uint8_t *data, uint16_t len) {
+    uint8_t *p = i2c_bus_scratch(bus, len + 1);
+    if (!p) return -1;
+    p[0] = reg;
+    memcpy(p + 1, data, len);
+    return i2c_bus_push(bus, addr, 0, p, len + 1);
+}
+
+/**
+ * Queue a repeated-start read of `len` bytes from `reg`. `buf` is filled in
+ * by the next i2c_bus_flush() and has to stay valid until then.
+ * Returns 0 on success, -1 if the batch is full.
+ */
+int i2c_bus_queue_read(i2c_bus_t *bus, uint8_t addr, uint8_t reg, uint8_t *buf, uint16_t len) {
+    if (bus->nmsgs + 2 > I2C_BUS_MAX_MSGS) {
+        fprintf(stderr, "i2c_bus: batch is full\n");
+        return -1;
+    }
+    uint8_t *p = i2c_bus_scratch(bus, 1);
+    if (!p) return -1;
+    *p = reg;
+    i2c_bus_push(bus, addr, 0, p, 1);
+    return i2c_bus_push(bus, addr, I2C_M_RD, buf, len);
+}
+
+static uint64_t i2c_bus_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void i2c_bus_account(i2c_bus_stats_t *st, int nmsgs, unsigned long bytes, uint64_t busy_ns,
+                            uint64_t wire_ns, int failed) {
+    st->ioctls++;
+    st->msgs += nmsgs;
+    st->bytes += bytes;
+    st->busy_ns += busy_ns;
+    st->wire_ns += wire_ns;
+    if (failed) st->errors++;
+}
+
+/**
+ * Send everything queued since the last flush in one I2C_RDWR ioctl.
+ * The batch is cleared either way. Returns 0 on success, -1 on failure.
+ */
+int i2c_bus_flush(i2c_bus_t *bus) {
+    if (bus->nmsgs == 0) return 0;
+
+    // Start + address byte per message, 9 clocks per byte, stop at the end.
+    unsigned long bytes = 0, bits = 1;
+    for (int i = 0; i < bus->nmsgs; i++) {
+        bytes += bus->msgs[i].len;
+        bits += 1 + 9 * (1 + bus->msgs[i].len);
+    }
+
+    struct i2c_rdwr_ioctl_data xfer = { .msgs = bus->msgs, .nmsgs = bus->nmsgs };
+    uint64_t t0 = i2c_bus_now_ns();
+    int sent = bus->transfer ? bus->transfer(bus->backend, bus->msgs, bus->nmsgs) : ioctl(bus->fd, I2C_RDWR, &xfer);
+    int failed = sent != bus->nmsgs;
+    uint64_t busy_ns = i2c_bus_now_ns() - t0;
+    if (failed) perror("I2C_RDWR");
+#ifdef I2C_STATS
+    i2c_stats_record(I2C_STAT_XFER, busy_ns);
+    // A register read is two messages but one transaction for the device.
+    for (int i = 0; i < bus->nmsgs; i++) {
+        const struct i2c_msg *m = &bus->msgs[i];
+        int rd_half = (m->flags & I2C_M_RD) && i > 0 && bus->msgs[i - 1].addr == m->addr &&
+                      !(bus->msgs[i - 1].flags & I2C_M_RD);
+        i2c_stats_device(m->addr, !rd_half, m->len, failed);
+    }
+#endif
+
+    uint64_t wire_ns = (uint64_t)bits * 1000000000ull / bus->speed_hz;
+    i2c_bus_account(&bus->tick, bus->nmsgs, bytes, busy_ns, wire_ns, failed);
+    i2c_bus_account(&bus->total, bus->nmsgs, bytes, busy_ns, wire_ns, failed);
+    bus->nmsgs = 0;
+    bus->scratch_used = 0;
+    return failed ? -1 : 0;
+}
+
+/* Immediate variants: queue, then flush together with anything pending */
+int i2c_bus_read(i2c_bus_t *bus, uint8_t addr, uint8_t reg, uint8_t *buf, uint16_t len) {
+    if (i2c_bus_queue_read(bus, addr, reg, buf, len) != 0) return -1;
+    return i2c_bus_flush(bus);
+}
+
+int i2c_bus_write(i2c_bus_t *bus, uint8_t addr, uint8_t reg, const uint8_t *data, uint16_t len) {
+    if (i2c_bus_queue_write(bus, addr, reg, data, len) != 0) return -1;
+    return i2c_bus_flush(bus);
+}
+
+/**
+ * Hand out the statistics gathered since the previous call and start a new
+ * tick. Call once per control tick.
+ */
+void i2c_bus_tick(i2c_bus_t *bus, i2c_bus_stats_t *out) {
+    if (out) *out = bus->tick;
+    memset(&bus->tick, 0, sizeof bus->tick);
+}
+
+/* Fraction of `period_ns` the bus was driven, from the wire-time estimate */
+double i2c_bus_occupancy(const i2c_bus_stats_t *st, uint64_t period_ns) {
+    return period_ns ? (double)st->wire_ns / (double)period_ns : 0.0;
+}
+
+#endif
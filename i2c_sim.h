@@ -0,0 +1,349 @@
+/*
+ * In-process I2C bus simulator.
+ *
+ * Register-level models of the PCA9685, AS5600 and MPU6050 behind the
+ * i2c_bus_t transfer hook, so the drivers run unmodified on a machine with
+ * no I2C adapter. Messages are interpreted the way the chips do: the first
+ * written byte sets the register pointer, and following bytes are written
+ * or read from the pointer, which advances by the chip's own rules. A
+ * missing address NACKs and fails the whole transfer like I2C_RDWR does.
+ *
+ * An optional fixed latency per transfer plus a per-byte wire time makes
+ * flushes block roughly the way a real adapter does.
+ */
+#ifndef I2C_SIM_H
+#define I2C_SIM_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "i2c_bus.h"
+
+#define I2C_SIM_MAX_DEVS 8
+
+typedef struct i2c_sim_dev i2c_sim_dev_t;
+
+struct i2c_sim_dev {
+    uint8_t addr;
+    uint8_t ptr;                // register pointer
+    uint8_t regs[256];
+    uint8_t (*read)(i2c_sim_dev_t *dev, uint8_t reg);
+    void (*write)(i2c_sim_dev_t *dev, uint8_t reg, uint8_t val);
+    uint8_t (*next)(i2c_sim_dev_t *dev, uint8_t reg);   // pointer after an access
+};
+
+typedef struct {
+    i2c_sim_dev_t *devs[I2C_SIM_MAX_DEVS];
+    int ndevs;
+    uint64_t latency_ns;        // per transfer call
+    uint64_t byte_ns;           // per address or data byte on the wire
+
+    unsigned long transfers;    // I2C_RDWR calls
+    unsigned long transactions; // START..STOP/Sr sequences, a register read counting once
+    unsigned long msgs;
+    unsigned long bytes;        // payload bytes, both directions
+    unsigned long nacks;
+} i2c_sim_t;
+
+void i2c_sim_init(i2c_sim_t *sim) {
+    memset(sim, 0, sizeof *sim);
+}
+
+/* Returns 0, or -1 if the bus is full or the address is taken */
+int i2c_sim_attach(i2c_sim_t *sim, i2c_sim_dev_t *dev) {
+    if (sim->ndevs == I2C_SIM_MAX_DEVS) return -1;
+    for (int i = 0; i < sim->ndevs; i++)
+        if (sim->devs[i]->addr == dev->addr) return -1;
+    sim->devs[sim->ndevs++] = dev;
+    return 0;
+}
+
+/**
+ * Make transfers block for `latency_ns` plus the wire time of every byte at
+ * `speed_hz` (9 clocks per byte). Pass zeros to measure driver overhead only.
+ */
+void i2c_sim_set_latency(i2c_sim_t *sim, uint64_t latency_ns, unsigned speed_hz) {
+    sim->latency_ns = latency_ns;
+    sim->byte_ns = speed_hz ? 9000000000ull / speed_hz : 0;
+}
+
+static i2c_sim_dev_t *i2c_sim_find(i2c_sim_t *sim, uint16_t addr) {
+    for (int i = 0; i < sim->ndevs; i++)
+        if (sim->devs[i]->addr == addr) return sim->devs[i];
+    return NULL;
+}
+
+/* i2c_bus_transfer_fn */
+int i2c_sim_transfer(void *ctx, struct i2c_msg *msgs, int nmsgs) {
+    i2c_sim_t *sim = ctx;
+    unsigned long wire_bytes = 0;
+    int done = 0;
+    sim->transfers++;
+    for (; done < nmsgs; done++) {
+        struct i2c_msg *m = &msgs[done];
+        i2c_sim_dev_t *dev = i2c_sim_find(sim, m->addr);
+        int rd_half = done > 0 && (m->flags & I2C_M_RD) && msgs[done - 1].addr == m->addr &&
+                      !(msgs[done - 1].flags & I2C_M_RD);
+        sim->transactions += !rd_half;
+        wire_bytes += 1 + m->len;
+        if (!dev) {
+            sim->nacks++;
+            break;
+        }
+        sim->msgs++;
+        sim->bytes += m->len;
+        if (m->flags & I2C_M_RD) {
+            for (int i = 0; i < m->len; i++) {
+                m->buf[i] = dev->read(dev, dev->ptr);
+                dev->ptr = dev->next(dev, dev->ptr);
+            }
+        } else if (m->len > 0) {
+            dev->ptr = m->buf[0];
+            for (int i = 1; i < m->len; i++) {
+                dev->write(dev, dev->ptr, m->buf[i]);
+                dev->ptr = dev->next(dev, dev->ptr);
+            }
+        }
+    }
+
+    uint64_t ns = sim->latency_ns + wire_bytes * sim->byte_ns;
+    if (ns) {
+        struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+        while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR) {}
+    }
+    if (done < nmsgs) {
+        errno = ENXIO;
+        return -1;
+    }
+    return nmsgs;
+}
+
+/* Route a bus to the simulator */
+void i2c_sim_open_bus(i2c_bus_t *bus, i2c_sim_t *sim, unsigned speed_hz) {
+    i2c_bus_open_backend(bus, i2c_sim_transfer, sim, speed_hz);
+}
+
+static uint8_t i2c_sim_plain_next(i2c_sim_dev_t *dev, uint8_t reg) { (void)dev; return reg + 1; }
+
+/*
+ * PCA9685: MODE1.AI gates pointer auto-increment, which wraps from the last
+ * LED register back to MODE1. ALL_LED_* writes fan out to every channel
+ * and read back as zero. PRESCALE is only writable while SLEEP is set.
+ */
+#define I2C_SIM_PCA_LAST_LED 0x45
+
+typedef struct {
+    i2c_sim_dev_t dev;
+} i2c_sim_pca9685_t;
+
+static uint8_t i2c_sim_pca_read(i2c_sim_dev_t *dev, uint8_t reg) {
+    if (reg >= 0xFA && reg <= 0xFD) return 0;
+    return dev->regs[reg];
+}
+
+static void i2c_sim_pca_write(i2c_sim_dev_t *dev, uint8_t reg, uint8_t val) {
+    if (reg == 0x00) {
+        uint8_t restart = dev->regs[0] & 0x80;
+        if (val & 0x80) restart = 0;                            // writing 1 clears RESTART
+        else if ((val & 0x10) && !(dev->regs[0] & 0x10)) restart = 0x80;
+        dev->regs[0] = (val & 0x7F) | restart;
+    } else if (reg == 0xFE) {
+        if (dev->regs[0] & 0x10) dev->regs[0xFE] = val < 3 ? 3 : val;
+    } else if (reg >= 0xFA && reg <= 0xFD) {
+        for (int ch = 0; ch < 16; ch++) dev->regs[0x06 + 4 * ch + (reg - 0xFA)] = val;
+    } else if (reg <= I2C_SIM_PCA_LAST_LED) {
+        dev->regs[reg] = val;
+    }
+}
+
+static uint8_t i2c_sim_pca_next(i2c_sim_dev_t *dev, uint8_t reg) {
+    if (!(dev->regs[0] & 0x20)) return reg;
+    if (reg == I2C_SIM_PCA_LAST_LED) return 0x00;
+    return reg + 1;
+}
+
+void i2c_sim_pca9685_init(i2c_sim_pca9685_t *pca, uint8_t addr) {
+    i2c_sim_dev_t *dev = &pca->dev;
+    memset(pca, 0, sizeof *pca);
+    dev->addr = addr;
+    dev->read = i2c_sim_pca_read;
+    dev->write = i2c_sim_pca_write;
+    dev->next = i2c_sim_pca_next;
+    // Power-on state: asleep, all-call on, every output full off.
+    dev->regs[0x00] = 0x11;
+    dev->regs[0x01] = 0x04;
+    dev->regs[0x02] = 0xE2;
+    dev->regs[0x03] = 0xE4;
+    dev->regs[0x04] = 0xE8;
+    dev->regs[0x05] = 0xE0;
+    for (int ch = 0; ch < 16; ch++) dev->regs[0x06 + 4 * ch + 3] = 0x10;
+    dev->regs[0xFE] = 0x1E;
+}
+
+void i2c_sim_pca9685_channel(const i2c_sim_pca9685_t *pca, int ch, uint16_t *on, uint16_t *off) {
+    const uint8_t *led = pca->dev.regs + 0x06 + 4 * ch;
+    *on = led[0] | (led[1] << 8);
+    *off = led[2] | (led[3] << 8);
+}
+
+/*
+ * AS5600: the output registers are computed from `raw` (0..4095) at read
+ * time, ANGLE scaled over ZPOS..MPOS (or MANG) like the chip does.
+ */
+typedef struct {
+    i2c_sim_dev_t dev;
+    uint16_t raw;
+} i2c_sim_as5600_t;
+
+static uint16_t i2c_sim_as5600_word(const i2c_sim_dev_t *dev, uint8_t reg) {
+    return ((dev->regs[reg] & 0x0F) << 8) | dev->regs[reg + 1];
+}
+
+static uint16_t i2c_sim_as5600_angle(i2c_sim_as5600_t *enc) {
+    uint16_t zpos = i2c_sim_as5600_word(&enc->dev, 0x01);
+    uint16_t mpos = i2c_sim_as5600_word(&enc->dev, 0x03);
+    uint16_t mang = i2c_sim_as5600_word(&enc->dev, 0x05);
+    uint32_t range = mpos ? (uint32_t)((mpos - zpos) & 0xFFF) : mang;
+    uint32_t pos = (enc->raw - zpos) & 0xFFF;
+    if (!range) return pos;
+    uint32_t angle = pos * 4096 / range;
+    return angle > 4095 ? 4095 : angle;
+}
+
+static uint8_t i2c_sim_as5600_read(i2c_sim_dev_t *dev, uint8_t reg) {
+    i2c_sim_as5600_t *enc = (i2c_sim_as5600_t *)dev;
+    switch (reg) {
+    case 0x0C: return (enc->raw >> 8) & 0x0F;
+    case 0x0D: return enc->raw & 0xFF;
+    case 0x0E: return i2c_sim_as5600_angle(enc) >> 8;
+    case 0x0F: return i2c_sim_as5600_angle(enc) & 0xFF;
+    default: return dev->regs[reg];
+    }
+}
+
+static void i2c_sim_as5600_write(i2c_sim_dev_t *dev, uint8_t reg, uint8_t val) {
+    if (reg >= 0x01 && reg <= 0x08) {
+        dev->regs[reg] = val;
+    } else if (reg == 0xFF && val == 0x80 && dev->regs[0x00] < 3) {
+        dev->regs[0x00]++;  // BURN_ANGLE uses one of three ZMCO slots
+    }
+}
+
+void i2c_sim_as5600_init(i2c_sim_as5600_t *enc, uint8_t addr) {
+    i2c_sim_dev_t *dev = &enc->dev;
+    memset(enc, 0, sizeof *enc);
+    dev->addr = addr;
+    dev->read = i2c_sim_as5600_read;
+    dev->write = i2c_sim_as5600_write;
+    dev->next = i2c_sim_plain_next;
+    dev->regs[0x0B] = 0x20;     // STATUS: magnet detected
+    dev->regs[0x1A] = 0x80;     // AGC mid-range
+    dev->regs[0x1B] = 0x08;     // MAGNITUDE 0x0800
+}
+
+/*
+ * MPU6050: writing a sample updates the output registers and, with
+ * USER_CTRL.FIFO_EN set, appends the sources selected in FIFO_EN to the
+ * 1024-byte FIFO, which overwrites the oldest bytes and flags
+ * INT_STATUS.FIFO_OFLOW when full. FIFO_R_W pops without moving the
+ * pointer; FIFO_COUNT reports the fill level.
+ */
+#define I2C_SIM_MPU_FIFO 1024
+
+typedef struct {
+    i2c_sim_dev_t dev;
+    uint8_t fifo[I2C_SIM_MPU_FIFO];
+    int fifo_head;              // oldest byte
+    int fifo_count;
+} i2c_sim_mpu6050_t;
+
+static void i2c_sim_mpu_reset(i2c_sim_mpu6050_t *mpu) {
+    memset(mpu->dev.regs, 0, sizeof mpu->dev.regs);
+    mpu->dev.regs[0x6B] = 0x40; // PWR_MGMT_1: asleep
+    mpu->dev.regs[0x75] = 0x68; // WHO_AM_I
+    mpu->fifo_head = mpu->fifo_count = 0;
+}
+
+static uint8_t i2c_sim_mpu_read(i2c_sim_dev_t *dev, uint8_t reg) {
+    i2c_sim_mpu6050_t *mpu = (i2c_sim_mpu6050_t *)dev;
+    switch (reg) {
+    case 0x3A: {                // INT_STATUS clears on read
+        uint8_t v = dev->regs[reg];
+        dev->regs[reg] = 0;
+        return v;
+    }
+    case 0x72: return mpu->fifo_count >> 8;
+    case 0x73: return mpu->fifo_count & 0xFF;
+    case 0x74: {
+        if (!mpu->fifo_count) return 0;
+        uint8_t v = mpu->fifo[mpu->fifo_head];
+        mpu->fifo_head = (mpu->fifo_head + 1) % I2C_SIM_MPU_FIFO;
+        mpu->fifo_count--;
+        return v;
+    }
+    default: return dev->regs[reg];
+    }
+}
+
+static void i2c_sim_mpu_write(i2c_sim_dev_t *dev, uint8_t reg, uint8_t val) {
+    i2c_sim_mpu6050_t *mpu = (i2c_sim_mpu6050_t *)dev;
+    if (reg == 0x6B && (val & 0x80)) {
+        i2c_sim_mpu_reset(mpu);
+    } else if (reg == 0x6A) {
+        if (val & 0x04) mpu->fifo_head = mpu->fifo_count = 0;
+        dev->regs[reg] = val & ~0x07;   // reset bits self-clear
+    } else if (reg >= 0x72 && reg <= 0x75) {
+        // FIFO count is read-only, FIFO_R_W writes are not modeled.
+    } else if (reg < 0x3A || reg > 0x60) {
+        dev->regs[reg] = val;           // everything but the output block
+    }
+}
+
+static uint8_t i2c_sim_mpu_next(i2c_sim_dev_t *dev, uint8_t reg) {
+    (void)dev;
+    return reg == 0x74 ? reg : reg + 1;
+}
+
+void i2c_sim_mpu6050_init(i2c_sim_mpu6050_t *mpu, uint8_t addr) {
+    memset(mpu, 0, sizeof *mpu);
+    mpu->dev.addr = addr;
+    mpu->dev.read = i2c_sim_mpu_read;
+    mpu->dev.write = i2c_sim_mpu_write;
+    mpu->dev.next = i2c_sim_mpu_next;
+    i2c_sim_mpu_reset(mpu);
+}
+
+static void i2c_sim_mpu_fifo_push(i2c_sim_mpu6050_t *mpu, const uint8_t *data, int len) {
+    for (int i = 0; i < len; i++) {
+        if (mpu->fifo_count == I2C_SIM_MPU_FIFO) {
+            mpu->fifo_head = (mpu->fifo_head + 1) % I2C_SIM_MPU_FIFO;
+            mpu->fifo_count--;
+            mpu->dev.regs[0x3A] |= 0x10;
+        }
+        mpu->fifo[(mpu->fifo_head + mpu->fifo_count++) % I2C_SIM_MPU_FIFO] = data[i];
+    }
+}
+
+/**
+ * Latch a new sample: accel x/y/z, temperature, gyro x/y/z in raw LSB.
+ * Ignored while the chip sleeps.
+ */
+void i2c_sim_mpu6050_sample(i2c_sim_mpu6050_t *mpu, const int16_t v[7]) {
+    uint8_t *out = mpu->dev.regs + 0x3B;
+    if (mpu->dev.regs[0x6B] & 0x40) return;
+    for (int i = 0; i < 7; i++) {
+        out[2 * i] = (uint16_t)v[i] >> 8;
+        out[2 * i + 1] = v[i] & 0xFF;
+    }
+    mpu->dev.regs[0x3A] |= 0x01;        // DATA_RDY
+
+    uint8_t en = mpu->dev.regs[0x23];
+    if (!(mpu->dev.regs[0x6A] & 0x40)) return;
+    if (en & 0x08) i2c_sim_mpu_fifo_push(mpu, out, 6);
+    if (en & 0x80) i2c_sim_mpu_fifo_push(mpu, out + 6, 2);
+    for (int axis = 0; axis < 3; axis++)
+        if (en & (0x40 >> axis)) i2c_sim_mpu_fifo_push(mpu, out + 8 + 2 * axis, 2);
+}
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * Optional instrumentation for the I2C layer.
+ *
+ * Build with -DI2C_STATS to enable. Every bus ioctl and the main driver calls
+ * are timed with CLOCK_MONOTONIC into log-linear latency histograms (four
+ * buckets per power of two), and transactions, bytes and errors are counted
+ * per slave address. Each thread records into its own block, so the hot path
+ * never shares a cache line or takes a lock. i2c_stats_snapshot() sums all
+ * blocks at any time. i2c_stats_dump() prints the totals, and
+ * i2c_stats_dump_at_exit() schedules that dump for exit.
+ *
+ * Without I2C_STATS the recording macros expand to nothing and the
+ * reporting calls are empty.
+ */
+#ifndef I2C_STATS_H
+#define I2C_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+    I2C_STAT_XFER,              // one I2C_RDWR ioctl on the shared bus
+    I2C_STAT_SMBUS,             // one legacy I2CP_* SMBus access
+    I2C_STAT_PCA_SET_PWM,
+    I2C_STAT_PCA_COMMIT_FRAME,
+    I2C_STAT_AS5600_READ,
+    I2C_STAT_AS5600_SNAPSHOT,
+    I2C_STAT_MPU_READ_WORD,
+    I2C_STAT_MPU_READ_ALL,
+    I2C_STAT_MPU_FIFO_DRAIN,
+    I2C_STAT_OPS
+} i2c_stat_op_t;
+
+#define I2C_STATS_BUCKETS   252 // covers the full 64-bit nanosecond range
+#define I2C_STATS_ADDRS     128
+
+typedef struct {
+    uint64_t count[I2C_STAT_OPS];
+    uint64_t sum_ns[I2C_STAT_OPS];
+    uint64_t max_ns[I2C_STAT_OPS];
+    uint64_t hist[I2C_STAT_OPS][I2C_STATS_BUCKETS];
+    uint64_t transactions[I2C_STATS_ADDRS];
+    uint64_t bytes[I2C_STATS_ADDRS];
+    uint64_t errors[I2C_STATS_ADDRS];
+} i2c_stats_snapshot_t;
+
+#ifdef I2C_STATS
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct i2c_stats_block {
+    struct i2c_stats_block *next;
+    // Single writer (the owning thread); readers use relaxed loads.
+    _Atomic uint64_t count[I2C_STAT_OPS];
+    _Atomic uint64_t sum_ns[I2C_STAT_OPS];
+    _Atomic uint64_t max_ns[I2C_STAT_OPS];
+    _Atomic uint64_t hist[I2C_STAT_OPS][I2C_STATS_BUCKETS];
+    _Atomic uint64_t transactions[I2C_STATS_ADDRS];
+    _Atomic uint64_t bytes[I2C_STATS_ADDRS];
+    _Atomic uint64_t errors[I2C_STATS_ADDRS];
+} i2c_stats_block_t;
+
+static const char *const i2c_stat_names[I2C_STAT_OPS] = {
+    "bus xfer", "smbus", "pca_set_pwm", "pca_commit_frame", "as5600_read",
+    "as5600_snapshot", "mpu_read_word", "mpu_read_all", "mpu_fifo_drain",
+};
+
+static _Atomic(i2c_stats_block_t *) i2c_stats_blocks;
+static _Thread_local i2c_stats_block_t *i2c_stats_local;
+
+static inline uint64_t i2c_stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Blocks are registered once per thread and kept after it exits */
+static i2c_stats_block_t *i2c_stats_block(void) {
+    i2c_stats_block_t *b = i2c_stats_local;
+    if (b) return b;
+    b = calloc(1, sizeof *b);
+    if (!b) abort();
+    b->next = atomic_load(&i2c_stats_blocks);
+    while (!atomic_compare_exchange_weak(&i2c_stats_blocks, &b->next, b)) {}
+    return i2c_stats_local = b;
+}
+
+static inline void i2c_stats_bump(_Atomic uint64_t *c, uint64_t v) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static inline int i2c_stats_bucket(uint64_t ns) {
+    if (ns < 4) return (int)ns;
+    int e = 63 - __builtin_clzll(ns);
+    return 4 * (e - 1) + (int)((ns >> (e - 2)) & 3);
+}
+
+static inline uint64_t i2c_stats_bucket_floor(int b) {
+    if (b < 4) return b;
+    return (uint64_t)(4 + b % 4) << (b / 4 - 1);
+}
+
+static inline void i2c_stats_record(i2c_stat_op_t op, uint64_t ns) {
+    i2c_stats_block_t *b = i2c_stats_block();
+    i2c_stats_bump(&b->count[op], 1);
+    i2c_stats_bump(&b->sum_ns[op], ns);
+    i2c_stats_bump(&b->hist[op][i2c_stats_bucket(ns)], 1);
+    if (ns > atomic_load_explicit(&b->max_ns[op], memory_order_relaxed))
+        atomic_store_explicit(&b->max_ns[op], ns, memory_order_relaxed);
+}
+
+static inline void i2c_stats_device(uint8_t addr, unsigned transactions, unsigned bytes, int failed) {
+    i2c_stats_block_t *b = i2c_stats_block();
+    addr &= I2C_STATS_ADDRS - 1;
+    i2c_stats_bump(&b->transactions[addr], transactions);
+    i2c_stats_bump(&b->bytes[addr], bytes);
+    if (failed) i2c_stats_bump(&b->errors[addr], transactions);
+}
+
+void i2c_stats_snapshot(i2c_stats_snapshot_t *out) {
+    memset(out, 0, sizeof *out);
+    for (i2c_stats_block_t *b = atomic_load(&i2c_stats_blocks); b; b = b->next) {
+        for (int op = 0; op < I2C_STAT_OPS; op++) {
+            out->count[op] += atomic_load_explicit(&b->count[op], memory_order_relaxed);
+            out->sum_ns[op] += atomic_load_explicit(&b->sum_ns[op], memory_order_relaxed);
+            uint64_t max = atomic_load_explicit(&b->max_ns[op], memory_order_relaxed);
+            if (max > out->max_ns[op]) out->max_ns[op] = max;
+            for (int i = 0; i < I2C_STATS_BUCKETS; i++)
+                out->hist[op][i] += atomic_load_explicit(&b->hist[op][i], memory_order_relaxed);
+        }
+        for (int a = 0; a < I2C_STATS_ADDRS; a++) {
+            out->transactions[a] += atomic_load_explicit(&b->transactions[a], memory_order_relaxed);
+            out->bytes[a] += atomic_load_explicit(&b->bytes[a], memory_order_relaxed);
+            out->errors[a] += atomic_load_explicit(&b->errors[a], memory_order_relaxed);
+        }
+    }
+}
+
+/* Lower edge of the bucket holding the `q` quantile (0..1) of an op */
+uint64_t i2c_stats_quantile(const i2c_stats_snapshot_t *s, i2c_stat_op_t op, double q) {
+    uint64_t target = (uint64_t)(q * s->count[op]), seen = 0;
+    for (int i = 0; i < I2C_STATS_BUCKETS; i++) {
+        seen += s->hist[op][i];
+        if (seen > target) return i2c_stats_bucket_floor(i);
+    }
+    return s->max_ns[op];
+}
+
+void i2c_stats_dump(FILE *out) {
+    static i2c_stats_snapshot_t s;
+    i2c_stats_snapshot(&s);
+    fprintf(out, "%-18s %10s %9s %9s %9s %9s\n", "op", "count", "mean us", "p50 us", "p99 us", "max us");
+    for (int op = 0; op < I2C_STAT_OPS; op++) {
+        if (!s.count[op]) continue;
+        fprintf(out, "%-18s %10llu %9.1f %9.1f %9.1f %9.1f\n", i2c_stat_names[op],
+                (unsigned long long)s.count[op], s.sum_ns[op] / 1e3 / s.count[op],
+                i2c_stats_quantile(&s, op, 0.5) / 1e3, i2c_stats_quantile(&s, op, 0.99) / 1e3,
+                s.max_ns[op] / 1e3);
+    }
+    fprintf(out, "%-18s %10s %10s %9s\n", "device", "xfers", "bytes", "errors");
+    for (int a = 0; a < I2C_STATS_ADDRS; a++) {
+        if (!s.transactions[a]) continue;
+        fprintf(out, "0x%02x %13s %10llu %10llu %9llu\n", a, "", (unsigned long long)s.transactions[a],
+                (unsigned long long)s.bytes[a], (unsigned long long)s.errors[a]);
+    }
+}
+
+static void i2c_stats_atexit(void) { i2c_stats_dump(stderr); }
+
+void i2c_stats_dump_at_exit(void) { atexit(i2c_stats_atexit); }
+
+#define I2C_STATS_BEGIN(t)              uint64_t t = i2c_stats_now_ns()
+#define I2C_STATS_END(op, t)            i2c_stats_record((op), i2c_stats_now_ns() - (t))
+
+#else
+
+static inline void i2c_stats_snapshot(i2c_stats_snapshot_t *out) { (void)out; }
+static inline void i2c_stats_dump(FILE *out) { (void)out; }
+static inline void i2c_stats_dump_at_exit(void) {}
+
+#define I2C_STATS_BEGIN(t)              do {} while (0)
+#define I2C_STATS_END(op, t)            do {} while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,318 @@
+/*
+ * Asynchronous executor for a shared i2c_bus_t.
+ *
+ * One high-priority thread owns the bus. Other threads submit requests into
+ * lock-free queues, one per priority class, and get completion through a
+ * callback (run on the worker thread) and/or an atomic flag. The worker always
+ * drains higher classes first and caps how many bytes one ioctl may carry,
+ * so a servo write waits for at most one in-flight batch regardless of
+ * telemetry load.
+ *
+ * Once the worker is started, nothing else may touch the bus.
+ */
+#ifndef I2C_WORKER_H
+#define I2C_WORKER_H
+
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "i2c_bus.h"
+#include "wiringPi.h"
+
+#define I2C_WORKER_QUEUE       64   // per class, power of two
+#define I2C_WORKER_INLINE      64   // write payload copied into the request
+#define I2C_WORKER_BATCH_BYTES 96   // payload budget of one ioctl
+#define I2C_WORKER_PRIORITY    60   // piHiPri() level of the worker thread
+
+typedef enum {
+    I2C_PRIO_ACTUATION,     // servo frames
+    I2C_PRIO_CONTROL,       // sensors feeding the control loop
+    I2C_PRIO_TELEMETRY,     // everything else
+    I2C_PRIO_COUNT
+} i2c_prio_t;
+
+typedef enum {
+    I2C_OP_READ,            // `len` bytes from `reg` into `buf`
+    I2C_OP_WRITE,           // `len` bytes from `data` to `reg`
+    I2C_OP_CUSTOM,          // `issue` queues driver transfers itself
+} i2c_op_t;
+
+typedef struct {
+    uint8_t op;
+    uint8_t msgs;                           // I2C_OP_CUSTOM: most messages `issue` queues
+    uint8_t addr;
+    uint8_t reg;
+    uint16_t len;                           // I2C_OP_CUSTOM: most write payload bytes
+    uint8_t *buf;                           // I2C_OP_READ destination
+    uint8_t data[I2C_WORKER_INLINE];        // I2C_OP_WRITE payload
+    // I2C_OP_CUSTOM: runs on the worker thread, e.g. pca_queue_frame(). Any
+    // driver state it touches belongs to the worker until completion. It
+    // must only queue, never flush, and return 0, or -1 if the batch had no
+    // room; whatever it queued before failing is taken back.
+    int (*issue)(i2c_bus_t *bus, void *ctx);
+    // Completion: status is 0 on success, -1 on a bus error. `flag` is set
+    // before `done` runs, and neither is touched afterwards.
+    void (*done)(void *ctx, int status);
+    void *ctx;
+    atomic_int *flag;                       // set to 1 / -1 on completion
+    uint64_t submit_ns;
+} i2c_req_t;
+
+typedef struct {
+    atomic_size_t seq;
+    i2c_req_t req;
+} i2c_cell_t;
+
+// Bounded multi-producer queue (Vyukov); the worker is the only consumer.
+typedef struct {
+    alignas(64) atomic_size_t head;
+    alignas(64) size_t tail;
+    alignas(64) i2c_cell_t cells[I2C_WORKER_QUEUE];
+} i2c_queue_t;
+
+typedef struct {
+    unsigned long submitted;
+    unsigned long completed;
+    unsigned long rejected;     // queue was full
+    uint64_t max_latency_ns;    // submit to completion
+} i2c_class_stats_t;
+
+typedef struct {
+    i2c_bus_t *bus;
+    i2c_queue_t queues[I2C_PRIO_COUNT];
+    sem_t wake;
+    atomic_int idle;            // worker is (about to be) asleep on `wake`
+    atomic_int running;
+    pthread_t thread;
+    atomic_ulong submitted[I2C_PRIO_COUNT];
+    atomic_ulong rejected[I2C_PRIO_COUNT];
+    // Written by the worker only.
+    atomic_ulong completed[I2C_PRIO_COUNT];
+    _Atomic uint64_t max_latency_ns[I2C_PRIO_COUNT];
+} i2c_worker_t;
+
+static void i2c_queue_init(i2c_queue_t *q) {
+    atomic_init(&q->head, 0);
+    q->tail = 0;
+    for (size_t i = 0; i < I2C_WORKER_QUEUE; i++) atomic_init(&q->cells[i].seq, i);
+}
+
+static int i2c_queue_push(i2c_queue_t *q, const i2c_req_t *req) {
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    for (;;) {
+        i2c_cell_t *cell = &q->cells[pos & (I2C_WORKER_QUEUE - 1)];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->req = *req;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return 0;
+            }
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+}
+
+static const i2c_req_t *i2c_queue_peek(i2c_queue_t *q) {
+    i2c_cell_t *cell = &q->cells[q->tail & (I2C_WORKER_QUEUE - 1)];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    return seq == q->tail + 1 ? &cell->req : NULL;
+}
+
+static void i2c_queue_pop(i2c_queue_t *q) {
+    i2c_cell_t *cell = &q->cells[q->tail & (I2C_WORKER_QUEUE - 1)];
+    atomic_store_explicit(&cell->seq, q->tail + I2C_WORKER_QUEUE, memory_order_release);
+    q->tail++;
+}
+
+static void i2c_worker_complete(i2c_worker_t *w, int prio, const i2c_req_t *req, int status, uint64_t now) {
+    if (req->flag) atomic_store_explicit(req->flag, status ? -1 : 1, memory_order_release);
+    if (req->done) req->done(req->ctx, status);
+    atomic_store_explicit(&w->completed[prio], w->completed[prio] + 1, memory_order_relaxed);
+    uint64_t latency = now - req->submit_ns;
+    if (latency > w->max_latency_ns[prio])
+        atomic_store_explicit(&w->max_latency_ns[prio], latency, memory_order_relaxed);
+}
+
+static int i2c_worker_pending(i2c_worker_t *w) {
+    for (int prio = 0; prio < I2C_PRIO_COUNT; prio++)
+        if (i2c_queue_peek(&w->queues[prio])) return 1;
+    return 0;
+}
+
+/* Whether the batch being built still has room for all of `req` */
+static int i2c_worker_fits(const i2c_worker_t *w, const i2c_req_t *req) {
+    switch (req->op) {
+    case I2C_OP_READ:  return i2c_bus_room(w->bus, 2, 1);
+    case I2C_OP_WRITE: return i2c_bus_room(w->bus, 1, req->len + 1);
+    default:           return i2c_bus_room(w->bus, req->msgs, req->len + req->msgs);
+    }
+}
+
+/* Queue `req` on the bus; on failure the batch is left as it was */
+static int i2c_worker_issue(i2c_worker_t *w, const i2c_req_t *req) {
+    int nmsgs = w->bus->nmsgs, scratch_used = w->bus->scratch_used, err;
+    switch (req->op) {
+    case I2C_OP_READ:  err = i2c_bus_queue_read(w->bus, req->addr, req->reg, req->buf, req->len); break;
+    case I2C_OP_WRITE: err = i2c_bus_queue_write(w->bus, req->addr, req->reg, req->data, req->len); break;
+    default:           err = req->issue(w->bus, req->ctx); break;
+    }
+    if (err != 0) {
+        w->bus->nmsgs = nmsgs;
+        w->bus->scratch_used = scratch_used;
+    }
+    return err;
+}
+
+static void *i2c_worker_main(void *arg) {
+    i2c_worker_t *w = arg;
+    piHiPri(I2C_WORKER_PRIORITY);
+
+    i2c_req_t batch[I2C_BUS_MAX_MSGS / 2];
+    int batch_prio[I2C_BUS_MAX_MSGS / 2];
+
+    while (atomic_load_explicit(&w->running, memory_order_acquire)) {
+        // Highest class first; lower classes only fill what is left of the
+        // byte budget, but a batch always takes at least one request. A
+        // request the message table has no room for waits for the next
+        // batch, and so does everything behind it; only one that does not
+        // fit even an empty batch fails.
+        int n = 0, bytes = 0, full = 0;
+        for (int prio = 0; prio < I2C_PRIO_COUNT && !full; prio++) {
+            const i2c_req_t *req;
+            while (n < (int)(sizeof batch / sizeof batch[0]) && (req = i2c_queue_peek(&w->queues[prio]))) {
+                if (n > 0 && (bytes + req->len > I2C_WORKER_BATCH_BYTES || !i2c_worker_fits(w, req))) {
+                    full = 1;
+                    break;
+                }
+                batch[n] = *req;
+                if (i2c_worker_issue(w, &batch[n]) != 0) {
+                    if (n > 0) {
+                        full = 1;
+                        break;
+                    }
+                    i2c_queue_pop(&w->queues[prio]);
+                    i2c_worker_complete(w, prio, &batch[n], -1, i2c_bus_now_ns());
+                    continue;
+                }
+                i2c_queue_pop(&w->queues[prio]);
+                batch_prio[n++] = prio;
+                bytes += batch[n - 1].len;
+            }
+        }
+
+        if (n == 0) {
+            // Announce the sleep, then look once more: a request pushed
+            // before the flag was visible is caught here, one pushed after
+            // it makes its submitter post the single wake-up.
+            atomic_store(&w->idle, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (i2c_worker_pending(w)) atomic_store(&w->idle, 0);
+            else sem_wait(&w->wake);
+            continue;
+        }
+
+        int status = i2c_bus_flush(w->bus);
+        uint64_t now = i2c_bus_now_ns();
+        for (int i = 0; i < n; i++) i2c_worker_complete(w, batch_prio[i], &batch[i], status, now);
+    }
+
+    // Stopped: fail whatever is still queued so no waiter blocks forever.
+    uint64_t now = i2c_bus_now_ns();
+    for (int prio = 0; prio < I2C_PRIO_COUNT; prio++) {
+        const i2c_req_t *req;
+        while ((req = i2c_queue_peek(&w->queues[prio]))) {
+            i2c_req_t left = *req;
+            i2c_queue_pop(&w->queues[prio]);
+            i2c_worker_complete(w, prio, &left, -1, now);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start the worker thread on `bus`. Returns 0 on success, -1 on failure.
+ */
+int i2c_worker_start(i2c_worker_t *w, i2c_bus_t *bus) {
+    memset(w, 0, sizeof *w);
+    w->bus = bus;
+    for (int prio = 0; prio < I2C_PRIO_COUNT; prio++) i2c_queue_init(&w->queues[prio]);
+    if (sem_init(&w->wake, 0, 0) != 0) {
+        perror("sem_init");
+        return -1;
+    }
+    atomic_store(&w->running, 1);
+    if (pthread_create(&w->thread, NULL, i2c_worker_main, w) != 0) {
+        perror("pthread_create");
+        sem_destroy(&w->wake);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Stop the worker after the batch in flight. Requests still queued complete
+ * with status -1; later submits are rejected. Stop the submitting threads
+ * first, as a submit racing the stop itself may go unanswered.
+ */
+void i2c_worker_stop(i2c_worker_t *w) {
+    atomic_store(&w->running, 0);
+    sem_post(&w->wake);
+    pthread_join(w->thread, NULL);
+    sem_destroy(&w->wake);
+}
+
+/**
+ * Enqueue a request; never blocks. The request is copied, but a read's
+ * `buf` and a custom request's `ctx` must stay valid until completion.
+ * Returns 0 on success, -1 if that class's queue is full or the worker is
+ * stopped.
+ */
+int i2c_worker_submit(i2c_worker_t *w, i2c_prio_t prio, const i2c_req_t *req) {
+    if (!atomic_load_explicit(&w->running, memory_order_acquire)) {
+        atomic_fetch_add_explicit(&w->rejected[prio], 1, memory_order_relaxed);
+        return -1;
+    }
+    i2c_req_t copy = *req;
+    copy.submit_ns = i2c_bus_now_ns();
+    if (copy.flag) atomic_store_explicit(copy.flag, 0, memory_order_relaxed);
+    if (i2c_queue_push(&w->queues[prio], &copy) != 0) {
+        atomic_fetch_add_explicit(&w->rejected[prio], 1, memory_order_relaxed);
+        return -1;
+    }
+    atomic_fetch_add_explicit(&w->submitted[prio], 1, memory_order_relaxed);
+    // Only the submit that finds the worker idle wakes it.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&w->idle, 0)) sem_post(&w->wake);
+    return 0;
+}
+
+int i2c_worker_read(i2c_worker_t *w, i2c_prio_t prio, uint8_t addr, uint8_t reg, uint8_t *buf, uint16_t len,
+                    atomic_int *flag) {
+    i2c_req_t req = { .op = I2C_OP_READ, .addr = addr, .reg = reg, .len = len, .buf = buf, .flag = flag };
+    return i2c_worker_submit(w, prio, &req);
+}
+
+int i2c_worker_write(i2c_worker_t *w, i2c_prio_t prio, uint8_t addr, uint8_t reg, const uint8_t *data,
+                     uint16_t len, atomic_int *flag) {
+    if (len > I2C_WORKER_INLINE) return -1;
+    i2c_req_t req = { .op = I2C_OP_WRITE, .addr = addr, .reg = reg, .len = len, .flag = flag };
+    memcpy(req.data, data, len);
+    return i2c_worker_submit(w, prio, &req);
+}
+
+/* Per-class counters; the completion side may be one batch behind */
+void i2c_worker_stats(i2c_worker_t *w, i2c_prio_t prio, i2c_class_stats_t *out) {
+    out->submitted = atomic_load_explicit(&w->submitted[prio], memory_order_relaxed);
+    out->rejected = atomic_load_explicit(&w->rejected[prio], memory_order_relaxed);
+    out->completed = atomic_load_explicit(&w->completed[prio], memory_order_relaxed);
+    out->max_latency_ns = atomic_load_explicit(&w->max_latency_ns[prio], memory_order_relaxed);
+}
+
+#endif
@@ -1,13 +1,18 @@
+#ifndef I2CP_H
+#define I2CP_H
+
 #include <linux/i2c-dev.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <linux/i2c.h>
 #include <i2c/smbus.h>
 #include <math.h>
 #include "wiringPi.h"
+#include "i2c_bus.h"
 
 static const uint8_t MODE1              = 0x00;
 static const uint8_t MODE2              = 0x01;
@@ -24,8 +29,11 @@ static const uint8_t ALL_LED_ON_H       = 0xFB;
 static const uint8_t ALL_LED_OFF_L      = 0xFC;
 static const uint8_t ALL_LED_OFF_H      = 0xFD;
 
+#define PCA_CHANNELS 16
+
 // Bits:
 static const uint8_t RESTART            = 0x80;
+static const uint8_t AI                 = 0x20; // register auto-increment
 static const uint8_t SLEEP              = 0x10;
 static const uint8_t ALLCALL            = 0x01;
 static const uint8_t INVRT              = 0x10;
@@ -56,7 +64,9 @@ int I2CP_init(const char* device, const uint8_t address) {
 void I2CP_write_register_data(int bus_fd, const uint8_t address, const uint8_t value) {
   union i2c_smbus_data data;
   data.byte = value;
+  I2C_STATS_BEGIN(t0);
   int err = i2c_smbus_access(bus_fd, I2C_SMBUS_WRITE, address, I2C_SMBUS_BYTE_DATA, &data);
+  I2C_STATS_END(I2C_STAT_SMBUS, t0);
   if (err) {
     perror("write_register_data");
     exit(1);
@@ -65,7 +75,9 @@ void I2CP_write_register_data(int bus_fd, const uint8_t address, const uint8_t v
 
 uint8_t I2CP_read_register_data(int bus_fd, const uint8_t address) {
   union i2c_smbus_data data;
+  I2C_STATS_BEGIN(t0);
   int err = i2c_smbus_access(bus_fd, I2C_SMBUS_READ, address, I2C_SMBUS_BYTE_DATA, &data);
+  I2C_STATS_END(I2C_STAT_SMBUS, t0);
   if (err) {
     perror("read_register_data");
     exit(1);
@@ -73,28 +85,286 @@ uint8_t I2CP_read_register_data(int bus_fd, const uint8_t address) {
   return data.byte & 0xFF;
 }
 
+#define PCA_MAX_TICKS    4095
+#define PCA_ANGLE_STEPS  181 // whole degrees, 0..180
+
+// Per-channel servo calibration. The tick values are rebuilt whenever the
+// PWM frequency or the pulse limits change, so the setters below only do
+// integer clamps, multiplies and table lookups.
+typedef struct {
+  uint16_t min_us;
+  uint16_t max_us;
+  uint16_t max_pulse_us; // max_us clipped to the PWM period
+  uint16_t min_ticks;
+  uint16_t max_ticks;
+  uint16_t angle_ticks[PCA_ANGLE_STEPS];
+} pca_servo_cal_t;
+
+// Shadow-valid bits for the non-LED registers.
+#define PCA_SHADOW_MODE1    0x01
+#define PCA_SHADOW_MODE2    0x02
+#define PCA_SHADOW_PRESCALE 0x04
+
 typedef struct {
   double frequency;
-  int i2CP_bus_fd;
+  i2c_bus_t* bus;
+  uint8_t address;
+
+  // Output ticks per microsecond of pulse width, Q16 fixed point.
+  uint32_t ticks_per_us_q16;
+  pca_servo_cal_t cal[PCA_CHANNELS];
+
+  // Last values written to the chip. Only registers whose bit is set in
+  // led_valid / reg_valid are trusted; everything else is written through.
+  uint8_t shadow_led[PCA_CHANNELS * 4];
+  uint8_t shadow_mode1;
+  uint8_t shadow_mode2;
+  uint8_t shadow_prescale;
+  uint16_t led_valid;
+  uint8_t reg_valid;
+
+  // Transactions and register bytes sent vs. suppressed by the shadow.
+  unsigned long writes_sent;
+  unsigned long writes_skipped;
+  unsigned long bytes_sent;
+  unsigned long bytes_skipped;
 } PCA9685 ;
 
-void pca_set_pwm(PCA9685 pca, int channel, uint16_t on, uint16_t off) {
-  const int channel_off = 4 * channel;
-  I2CP_write_register_data(pca.i2CP_bus_fd, ALL_LED_ON_L+channel_off, on & 0xFF);
-  I2CP_write_register_data(pca.i2CP_bus_fd, ALL_LED_ON_H+channel_off, on >> 8);
-  I2CP_write_register_data(pca.i2CP_bus_fd, ALL_LED_OFF_L+channel_off, off & 0xFF);
-  I2CP_write_register_data(pca.i2CP_bus_fd, ALL_LED_OFF_H+channel_off, off >> 8);
+// ON_L, ON_H, OFF_L, OFF_H as laid out in the LEDn register block.
+static void pca_pack_pwm(uint8_t* out, uint16_t on, uint16_t off) {
+  out[0] = on & 0xFF;
+  out[1] = on >> 8;
+  out[2] = off & 0xFF;
+  out[3] = off >> 8;
+}
+
+static void pca_flush_bus(PCA9685* pca) {
+  if (i2c_bus_flush(pca->bus) != 0) exit(1);
+}
+
+// Queues a register write on the shared bus; it goes out with the next
+// flush, possibly in the same ioctl as other devices' transfers.
+static void pca_queue(PCA9685* pca, uint8_t reg, const uint8_t* values, int len) {
+  if (i2c_bus_queue_write(pca->bus, pca->address, reg, values, len) == 0) return;
+  pca_flush_bus(pca);
+  if (i2c_bus_queue_write(pca->bus, pca->address, reg, values, len) != 0) exit(1);
+}
+
+static uint8_t pca_read(PCA9685* pca, uint8_t reg) {
+  uint8_t value;
+  if (i2c_bus_read(pca->bus, pca->address, reg, &value, 1) != 0) exit(1);
+  return value;
 }
 
-void pca_set_all_pwm(PCA9685 pca, uint16_t on, uint16_t off) {
-  I2CP_write_register_data(pca.i2CP_bus_fd, ALL_LED_ON_L, on & 0xFF);
-  I2CP_write_register_data(pca.i2CP_bus_fd, ALL_LED_ON_H, on >> 8);
-  I2CP_write_register_data(pca.i2CP_bus_fd, ALL_LED_OFF_L, off & 0xFF);
-  I2CP_write_register_data(pca.i2CP_bus_fd, ALL_LED_OFF_H, off >> 8);
+static void pca_send_leds(PCA9685* pca, int first, int len) {
+  pca_queue(pca, LED0_ON_L + first, pca->shadow_led + first, len);
+  pca->writes_sent++;
+  pca->bytes_sent += len;
+}
+
+// Brings LED registers [first, first + len) (byte offsets from LED0_ON_L) to
+// `values`, sending only the spans that differ from the shadow. Unchanged gaps
+// of up to two bytes are sent anyway, as a new transaction costs more.
+static void pca_write_leds(PCA9685* pca, int first, const uint8_t* values, int len) {
+  int span_start = -1, span_end = -1;
+  int sent = 0;
+  for (int i = 0; i < len; i++) {
+    int reg = first + i;
+    int valid = pca->led_valid & (1u << (reg / 4));
+    if (valid && pca->shadow_led[reg] == values[i]) continue;
+    pca->shadow_led[reg] = values[i];
+    if (span_start >= 0 && reg - span_end > 3) {
+      pca_send_leds(pca, span_start, span_end - span_start + 1);
+      sent += span_end - span_start + 1;
+      span_start = -1;
+    }
+    if (span_start < 0) span_start = reg;
+    span_end = reg;
+  }
+  if (span_start >= 0) {
+    pca_send_leds(pca, span_start, span_end - span_start + 1);
+    sent += span_end - span_start + 1;
+  }
+  for (int reg = first; reg < first + len; reg += 4) pca->led_valid |= 1u << (reg / 4);
+  if (!sent) pca->writes_skipped++;
+  if (sent < len) pca->bytes_skipped += len - sent;
+}
+
+static void pca_write_reg(PCA9685* pca, uint8_t reg, uint8_t value, uint8_t* shadow, uint8_t valid_bit) {
+  if ((pca->reg_valid & valid_bit) && *shadow == value) {
+    pca->writes_skipped++;
+    pca->bytes_skipped++;
+    return;
+  }
+  pca_queue(pca, reg, &value, 1);
+  pca_flush_bus(pca);
+  *shadow = value;
+  pca->reg_valid |= valid_bit;
+  pca->writes_sent++;
+  pca->bytes_sent++;
+}
+
+static uint8_t pca_read_mode1(PCA9685* pca) {
+  if (!(pca->reg_valid & PCA_SHADOW_MODE1)) {
+    pca->shadow_mode1 = pca_read(pca, MODE1) & ~RESTART;
+    pca->reg_valid |= PCA_SHADOW_MODE1;
+  }
+  return pca->shadow_mode1;
+}
+
+// PRESCALE only latches while the oscillator sleeps; RESTART then resumes
+// the outputs where they were.
+static void pca_write_prescale(PCA9685* pca, uint8_t prescale) {
+  uint8_t oldmode = pca_read_mode1(pca);
+  uint8_t newmode = (oldmode & 0x7F) | SLEEP;
+
+  pca_write_reg(pca, MODE1, newmode, &pca->shadow_mode1, PCA_SHADOW_MODE1);
+  pca_write_reg(pca, PRESCALE, prescale, &pca->shadow_prescale, PCA_SHADOW_PRESCALE);
+  pca_write_reg(pca, MODE1, oldmode, &pca->shadow_mode1, PCA_SHADOW_MODE1);
+  delay(5);
+  uint8_t restart = oldmode | RESTART;
+  pca_queue(pca, MODE1, &restart, 1);
+  pca_flush_bus(pca);
+  pca->writes_sent++;
+  pca->bytes_sent++;
+}
+
+void pca_set_pwm(PCA9685* pca, int channel, uint16_t on, uint16_t off) {
+  I2C_STATS_BEGIN(t0);
+  uint8_t regs[4];
+  pca_pack_pwm(regs, on, off);
+  pca_write_leds(pca, 4 * channel, regs, 4);
+  pca_flush_bus(pca);
+  I2C_STATS_END(I2C_STAT_PCA_SET_PWM, t0);
+}
+
+void pca_set_all_pwm(PCA9685* pca, uint16_t on, uint16_t off) {
+  uint8_t regs[4];
+  pca_pack_pwm(regs, on, off);
+  int unchanged = pca->led_valid == 0xFFFF;
+  for (int channel = 0; unchanged && channel < PCA_CHANNELS; channel++) {
+    unchanged = memcmp(pca->shadow_led + 4 * channel, regs, 4) == 0;
+  }
+  if (unchanged) {
+    pca->writes_skipped++;
+    pca->bytes_skipped += 4;
+    return;
+  }
+  pca_queue(pca, ALL_LED_ON_L, regs, 4);
+  pca_flush_bus(pca);
+  pca->writes_sent++;
+  pca->bytes_sent += 4;
+  for (int channel = 0; channel < PCA_CHANNELS; channel++) {
+    memcpy(pca->shadow_led + 4 * channel, regs, 4);
+  }
+  pca->led_valid = 0xFFFF;
+}
+
+// Most a frame can queue: one burst per channel, when every other one is
+// unchanged. The budget an i2c_worker custom request declares for it.
+#define PCA_FRAME_MAX_MSGS  PCA_CHANNELS
+#define PCA_FRAME_MAX_BYTES (PCA_CHANNELS * 4)
+
+// Queues every channel selected in `mask` (bit n = channel n) on the bus
+// without sending it, so the frame can share an ioctl with sensor reads.
+// Consecutive channels share one auto-increment burst. Never flushes:
+// returns -1 with nothing queued if the batch might not hold the frame.
+int pca_queue_frame(PCA9685* pca, const uint16_t on[PCA_CHANNELS], const uint16_t off[PCA_CHANNELS], uint16_t mask) {
+  if (!i2c_bus_room(pca->bus, PCA_FRAME_MAX_MSGS, PCA_FRAME_MAX_BYTES + PCA_FRAME_MAX_MSGS)) return -1;
+  uint8_t regs[PCA_CHANNELS * 4];
+  int channel = 0;
+  while (channel < PCA_CHANNELS) {
+    if (!(mask & (1u << channel))) {
+      channel++;
+      continue;
+    }
+    int first = channel;
+    while (channel < PCA_CHANNELS && (mask & (1u << channel))) {
+      pca_pack_pwm(regs + 4 * channel, on[channel], off[channel]);
+      channel++;
+    }
+    pca_write_leds(pca, 4 * first, regs + 4 * first, 4 * (channel - first));
+  }
+  return 0;
+}
+
+// Writes a whole servo frame at once, see pca_queue_frame.
+void pca_commit_frame(PCA9685* pca, const uint16_t on[PCA_CHANNELS], const uint16_t off[PCA_CHANNELS], uint16_t mask) {
+  I2C_STATS_BEGIN(t0);
+  if (pca_queue_frame(pca, on, off, mask) != 0) {
+    pca_flush_bus(pca);
+    pca_queue_frame(pca, on, off, mask);
+  }
+  pca_flush_bus(pca);
+  I2C_STATS_END(I2C_STAT_PCA_COMMIT_FRAME, t0);
+}
+
+// Forgets the shadow so the next write of each register goes out
+// unconditionally, e.g. after a bus error or a chip reset.
+void pca_invalidate(PCA9685* pca) {
+  pca->led_valid = 0;
+  pca->reg_valid = 0;
+}
+
+// Rewrites every shadowed register to the chip to resync it.
+void pca_flush(PCA9685* pca) {
+  uint16_t led_valid = pca->led_valid;
+  uint8_t reg_valid = pca->reg_valid;
+  pca_invalidate(pca);
+  if (reg_valid & PCA_SHADOW_MODE2) {
+    pca_write_reg(pca, MODE2, pca->shadow_mode2, &pca->shadow_mode2, PCA_SHADOW_MODE2);
+  }
+  if (reg_valid & PCA_SHADOW_MODE1) {
+    pca_write_reg(pca, MODE1, pca->shadow_mode1, &pca->shadow_mode1, PCA_SHADOW_MODE1);
+  }
+  if (reg_valid & PCA_SHADOW_PRESCALE) {
+    pca_write_prescale(pca, pca->shadow_prescale);
+  }
+  for (int channel = 0; channel < PCA_CHANNELS; channel++) {
+    if (led_valid & (1u << channel)) {
+      pca_send_leds(pca, 4 * channel, 4);
+      pca->led_valid |= 1u << channel;
+    }
+  }
+  pca_flush_bus(pca);
+}
+
+static uint16_t pca_cal_us_to_ticks(const PCA9685* pca, uint32_t us) {
+  return (us * pca->ticks_per_us_q16 + 0x8000) >> 16;
+}
+
+static void pca_build_cal(PCA9685* pca, int channel) {
+  pca_servo_cal_t* cal = &pca->cal[channel];
+  uint32_t max_us = cal->max_us;
+  if (pca->ticks_per_us_q16) {
+    // Longest pulse that still fits in the period without going full-on.
+    uint32_t period_us = ((uint32_t)PCA_MAX_TICKS << 16) / pca->ticks_per_us_q16;
+    if (max_us > period_us) max_us = period_us;
+  }
+  uint32_t min_us = cal->min_us < max_us ? cal->min_us : max_us;
+  cal->max_pulse_us = max_us;
+  cal->min_ticks = pca_cal_us_to_ticks(pca, min_us);
+  cal->max_ticks = pca_cal_us_to_ticks(pca, max_us);
+  uint32_t span = cal->max_ticks - cal->min_ticks;
+  for (int deg = 0; deg < PCA_ANGLE_STEPS; deg++) {
+    cal->angle_ticks[deg] = cal->min_ticks + (span * deg + (PCA_ANGLE_STEPS - 1) / 2) / (PCA_ANGLE_STEPS - 1);
+  }
+}
+
+// Limits the pulse width of one channel; 0 degrees maps to min_us and 180
+// degrees to max_us. Channels default to the full PWM period.
+void pca_set_servo_limits(PCA9685* pca, int channel, uint16_t min_us, uint16_t max_us) {
+  pca->cal[channel].min_us = min_us;
+  pca->cal[channel].max_us = max_us;
+  pca_build_cal(pca, channel);
 }
 
 void pca_set_pwm_freq(PCA9685* pca, const double freq_hz) {
   pca->frequency = freq_hz;
+  pca->ticks_per_us_q16 = (uint32_t)round(4096.0 * freq_hz * 65536.0 / 1e6);
+  for (int channel = 0; channel < PCA_CHANNELS; channel++) {
+    pca_build_cal(pca, channel);
+  }
 
   double prescaleval = 2.5e7; //    # 25MHz
   prescaleval /= 4096.0; //       # 12-bit
@@ -103,34 +373,68 @@ void pca_set_pwm_freq(PCA9685* pca, const double freq_hz) {
 
   int prescale = (int)round(prescaleval);
 
-  uint8_t oldmode = I2CP_read_register_data(pca->i2CP_bus_fd, MODE1);
+  pca_write_prescale(pca, prescale);
+}
 
-  uint8_t newmode = (oldmode & 0x7F) | SLEEP;
+uint16_t pca_us_to_ticks(const PCA9685* pca, int channel, uint32_t us) {
+  const pca_servo_cal_t* cal = &pca->cal[channel];
+  uint16_t ticks = pca_cal_us_to_ticks(pca, us < cal->max_pulse_us ? us : cal->max_pulse_us);
+  if (ticks < cal->min_ticks) return cal->min_ticks;
+  if (ticks > cal->max_ticks) return cal->max_ticks;
+  return ticks;
+}
 
-  I2CP_write_register_data(pca->i2CP_bus_fd, MODE1, newmode);
-  I2CP_write_register_data(pca->i2CP_bus_fd, PRESCALE, prescale);
-  I2CP_write_register_data(pca->i2CP_bus_fd, MODE1, oldmode);
-  delay(5);
-  I2CP_write_register_data(pca->i2CP_bus_fd, MODE1, oldmode | RESTART);
+uint16_t pca_angle_to_ticks(const PCA9685* pca, int channel, unsigned deg) {
+  return pca->cal[channel].angle_ticks[deg < PCA_ANGLE_STEPS ? deg : PCA_ANGLE_STEPS - 1];
 }
 
-void pca_set_pwm_ms(PCA9685 pca, int channel, double ms) {
-  double period_ms = 1000.0 / pca.frequency;
-  double bits_per_ms = 4096 / period_ms;
-  double bits = ms * bits_per_ms;
-  pca_set_pwm(pca, channel, 0, bits);
+void pca_set_pwm_us(PCA9685* pca, int channel, uint32_t us) {
+  pca_set_pwm(pca, channel, 0, pca_us_to_ticks(pca, channel, us));
 }
 
-PCA9685 pca_new(const char* device, int address) {
-  PCA9685 pca;
-  pca.i2CP_bus_fd = I2CP_init(device, address);
-  pca_set_all_pwm(pca, 0, 0);
-  I2CP_write_register_data(pca.i2CP_bus_fd, MODE2, OUTDRV);
-  I2CP_write_register_data(pca.i2CP_bus_fd, MODE1, ALLCALL);
+void pca_set_servo_angle(PCA9685* pca, int channel, unsigned deg) {
+  pca_set_pwm(pca, channel, 0, pca_angle_to_ticks(pca, channel, deg));
+}
+
+// Clamped in floating point first: out-of-range and NaN doubles must never
+// reach the integer conversion.
+void pca_set_pwm_ms(PCA9685* pca, int channel, double ms) {
+  double max_ms = pca->cal[channel].max_pulse_us / 1000.0;
+  if (!(ms > 0)) ms = 0;
+  if (ms > max_ms) ms = max_ms;
+  pca_set_pwm_us(pca, channel, (uint32_t)(ms * 1000.0 + 0.5));
+}
+
+PCA9685 pca_new_on_bus(i2c_bus_t* bus, int address) {
+  PCA9685 pca = {0};
+  pca.bus = bus;
+  pca.address = address;
+  for (int channel = 0; channel < PCA_CHANNELS; channel++) {
+    pca.cal[channel].max_us = UINT16_MAX;
+  }
+  // Auto-increment has to be on before the first block write.
+  pca_write_reg(&pca, MODE1, SLEEP | AI, &pca.shadow_mode1, PCA_SHADOW_MODE1);
+  pca_set_all_pwm(&pca, 0, 0);
+  pca_write_reg(&pca, MODE2, OUTDRV, &pca.shadow_mode2, PCA_SHADOW_MODE2);
+  pca_write_reg(&pca, MODE1, ALLCALL | AI, &pca.shadow_mode1, PCA_SHADOW_MODE1);
   delay(5);
-  uint8_t val = I2CP_read_register_data(pca.i2CP_bus_fd, MODE1);
+  uint8_t val = pca_read_mode1(&pca);
   val &= ~SLEEP;
-  I2CP_write_register_data(pca.i2CP_bus_fd, MODE1, val);
+  pca_write_reg(&pca, MODE1, val, &pca.shadow_mode1, PCA_SHADOW_MODE1);
   delay(5);
   return pca;
 }
+
+PCA9685 pca_new(const char* device, int address) {
+  i2c_bus_t* bus = i2c_bus_open_private(device);
+  if (!bus) exit(1);
+  return pca_new_on_bus(bus, address);
+}
+
+// Releases the bus opened by pca_new(); not for a shared bus.
+void pca_close(PCA9685* pca) {
+  i2c_bus_close_private(pca->bus);
+  pca->bus = NULL;
+}
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Fixed-rate control loop scheduler.
+ *
+ * Tasks run at integer divisions of one base tick. The loop sleeps until
+ * each tick's absolute CLOCK_MONOTONIC deadline with clock_nanosleep, so
+ * the CPU idles between ticks and errors do not accumulate. Tasks with the
+ * same rate are spread over different ticks. Ticks that are missed because
+ * work ran long are skipped and counted, not replayed.
+ */
+#ifndef LOOP_SCHED_H
+#define LOOP_SCHED_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define LOOP_SCHED_MAX_TASKS 16
+
+typedef struct {
+    const char *name;
+    void (*fn)(void *ctx);
+    void *ctx;
+    unsigned divider;           // runs every `divider` base ticks
+    unsigned phase;             // ... on ticks where tick % divider == phase
+
+    unsigned long runs;
+    unsigned long overruns;     // finished after the next tick's deadline
+    uint64_t exec_max_ns;
+    uint64_t exec_sum_ns;
+} loop_task_t;
+
+typedef struct {
+    unsigned base_hz;
+    uint64_t period_ns;
+    loop_task_t tasks[LOOP_SCHED_MAX_TASKS];
+    int ntasks;
+    atomic_int running;
+
+    uint64_t tick;
+    unsigned long missed_ticks;
+    // Wake-up latency: how late the loop woke after each deadline.
+    uint64_t lat_min_ns;
+    uint64_t lat_max_ns;
+    uint64_t lat_sum_ns;
+    unsigned long lat_count;
+} loop_sched_t;
+
+static uint64_t loop_sched_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void loop_sched_init(loop_sched_t *s, unsigned base_hz) {
+    memset(s, 0, sizeof *s);
+    s->base_hz = base_hz;
+    s->period_ns = 1000000000ull / base_hz;
+    s->lat_min_ns = UINT64_MAX;
+}
+
+/**
+ * Register `fn` to run at `hz`, which has to divide the base rate.
+ * Returns 0 on success, -1 otherwise.
+ */
+int loop_sched_add(loop_sched_t *s, const char *name, unsigned hz, void (*fn)(void *), void *ctx) {
+    if (s->ntasks == LOOP_SCHED_MAX_TASKS || hz == 0 || hz > s->base_hz || s->base_hz % hz != 0) {
+        fprintf(stderr, "loop_sched: cannot run %s at %u Hz on a %u Hz base\n", name, hz, s->base_hz);
+        return -1;
+    }
+    loop_task_t *t = &s->tasks[s->ntasks];
+    memset(t, 0, sizeof *t);
+    t->name = name;
+    t->fn = fn;
+    t->ctx = ctx;
+    t->divider = s->base_hz / hz;
+    // Stagger equal-rate tasks so they do not all land on tick 0.
+    unsigned same = 0;
+    for (int i = 0; i < s->ntasks; i++) same += s->tasks[i].divider == t->divider;
+    t->phase = same % t->divider;
+    s->ntasks++;
+    return 0;
+}
+
+/* Run until loop_sched_stop(); safe to call the latter from a signal handler */
+void loop_sched_run(loop_sched_t *s) {
+    atomic_store(&s->running, 1);
+    uint64_t deadline = loop_sched_now_ns();
+    while (atomic_load_explicit(&s->running, memory_order_relaxed)) {
+        for (int i = 0; i < s->ntasks; i++) {
+            loop_task_t *t = &s->tasks[i];
+            if (s->tick % t->divider != t->phase) continue;
+            uint64_t start = loop_sched_now_ns();
+            t->fn(t->ctx);
+            uint64_t end = loop_sched_now_ns();
+            uint64_t exec = end - start;
+            t->runs++;
+            t->exec_sum_ns += exec;
+            if (exec > t->exec_max_ns) t->exec_max_ns = exec;
+            if (end > deadline + s->period_ns) t->overruns++;
+        }
+
+        s->tick++;
+        deadline += s->period_ns;
+        uint64_t now = loop_sched_now_ns();
+        if (now > deadline) {
+            // Skip whole ticks rather than bursting to catch up.
+            uint64_t missed = (now - deadline) / s->period_ns;
+            s->missed_ticks += missed;
+            s->tick += missed;
+            deadline += missed * s->period_ns;
+        }
+
+        struct timespec ts = { .tv_sec = deadline / 1000000000ull, .tv_nsec = deadline % 1000000000ull };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+            if (!atomic_load_explicit(&s->running, memory_order_relaxed)) return;
+        }
+
+        uint64_t lat = loop_sched_now_ns() - deadline;
+        if (lat < s->lat_min_ns) s->lat_min_ns = lat;
+        if (lat > s->lat_max_ns) s->lat_max_ns = lat;
+        s->lat_sum_ns += lat;
+        s->lat_count++;
+    }
+}
+
+void loop_sched_stop(loop_sched_t *s) {
+    atomic_store(&s->running, 0);
+}
+
+void loop_sched_print_stats(const loop_sched_t *s, FILE *out) {
+    fprintf(out, "base %u Hz, %llu ticks, %lu missed\n", s->base_hz, (unsigned long long)s->tick, s->missed_ticks);
+    if (s->lat_count) {
+        fprintf(out, "wake latency us: min %.1f mean %.1f max %.1f (jitter %.1f)\n",
+                s->lat_min_ns / 1e3, s->lat_sum_ns / 1e3 / s->lat_count, s->lat_max_ns / 1e3,
+                (s->lat_max_ns - s->lat_min_ns) / 1e3);
+    }
+    for (int i = 0; i < s->ntasks; i++) {
+        const loop_task_t *t = &s->tasks[i];
+        fprintf(out, "  %-12s %5u Hz  runs %lu  overruns %lu  exec us mean %.1f max %.1f\n", t->name,
+                s->base_hz / t->divider, t->runs, t->overruns, t->runs ? t->exec_sum_ns / 1e3 / t->runs : 0.0,
+                t->exec_max_ns / 1e3);
+    }
+}
+
+#endif
@@ -1,34 +1,51 @@
 #include "wiringPi.h"
+#include "i2c_bus.h"
 #include "i2cp.h"
 #include "as5600.h"
 #include <stdint.h>
 #include "mpu6050.h"
+#include "loop_sched.h"
+#include <signal.h>
+
+static loop_sched_t sched;
+
+static void on_signal(int sig) {
+  (void)sig;
+  loop_sched_stop(&sched);
+}
+
+static void servo_task(void* ctx) {
+  PCA9685* pca = ctx;
+  pca_set_pwm_ms(pca, 0, 10);
+}
 
 int main() {
   wiringPiSetupGpio();
-  PCA9685 pca = pca_new("/dev/i2c-1", 0x40);
+  i2c_stats_dump_at_exit();
+  i2c_bus_t bus;
+  if (i2c_bus_open(&bus, "/dev/i2c-1", 0) != 0) {
+    exit(1);
+  }
+  PCA9685 pca = pca_new_on_bus(&bus, 0x40);
   pca_set_pwm_freq(&pca, 50);
 
   // as5600_t sensor;
-  // if (as5600_init("/dev/i2c-1", &sensor) != 0) {
-  //   perror("as5600 init");
-  //   exit(1);
-  // }
+  // as5600_init_on_bus(&bus, &sensor);
   //
   // mpu6050_t accels;
-  // if (mpu6050_init("/dev/i2c-1", &accels) != 0) {
+  // if (mpu6050_init_on_bus(&bus, &accels) != 0) {
   //   perror("mpu6050 init");
   //   exit(1);
   // }
 
-  while (1) {
-    pca_set_pwm_ms(pca, 0, 10);
+  // The base rate is the GCD of the task rates; a faster base only wakes
+  // the loop for ticks where nothing runs.
+  loop_sched_init(&sched, 50);
+  loop_sched_add(&sched, "servo", 50, servo_task, &pca);
 
-    // uint16_t angle = as5600_read_angl(&sensor);
-    // printf("%d\n", (int)angle);
-    //
-    // float ax, ay, az;
-    // mpu6050_get_gyro(&accels, &ax, &ay, &az);
-    // printf("%f %f %f\n", ax, ay, az);
-  }
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  loop_sched_run(&sched);
+  loop_sched_print_stats(&sched, stdout);
+  return 0;
 }
@@ -0,0 +1,199 @@
+/*
+ * MJPEG frame decoding with libjpeg-turbo.
+ *
+ * A frame is decoded straight into what its consumer wants rather than to
+ * RGB first: grayscale leaves the chroma out of the inverse DCT entirely,
+ * RGB goes through the merged upsampler, and a whole YUYV frame is packed
+ * from the raw Y, Cb and Cr planes with no upsampling or color conversion
+ * at all. Downscaling by 2 or 4 happens in the inverse DCT
+ * (scale_denom), so the dropped detail is never computed, and for a region
+ * jpeg_crop_scanline() / jpeg_skip_scanlines() skip the inverse DCT and
+ * color conversion outside it. The Huffman data is still decoded for the
+ * whole frame, so those two save less than scaling does.
+ *
+ * UVC cameras leave the standard Huffman tables out of their frames;
+ * libjpeg-turbo fills them in. A corrupt frame fails its decode instead of
+ * taking the process down, and recoverable damage is only counted.
+ */
+#ifndef MJPEG_H
+#define MJPEG_H
+
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+#include <jerror.h>
+#include "yuyv.h"
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+    unsigned long warnings;
+    char message[JMSG_LENGTH_MAX];  // the last error
+} mjpeg_error_t;
+
+typedef struct {
+    struct jpeg_decompress_struct cinfo;
+    mjpeg_error_t err;
+    uint8_t *row;               // one decoded row, when it cannot go straight to the output
+    size_t row_bytes;
+    unsigned long frames;
+    unsigned long failed;       // frames that did not decode
+} mjpeg_decoder_t;
+
+static void mjpeg_error_exit(j_common_ptr c) {
+    mjpeg_error_t *err = (mjpeg_error_t *)c->err;
+    c->err->format_message(c, err->message);
+    longjmp(err->jump, 1);
+}
+
+/* Warnings are corrupt data the decoder got past; count them, do not print */
+static void mjpeg_emit_message(j_common_ptr c, int level) {
+    if (level < 0) ((mjpeg_error_t *)c->err)->warnings++;
+}
+
+void mjpeg_init(mjpeg_decoder_t *d) {
+    memset(d, 0, sizeof *d);
+    d->cinfo.err = jpeg_std_error(&d->err.pub);
+    d->err.pub.error_exit = mjpeg_error_exit;
+    d->err.pub.emit_message = mjpeg_emit_message;
+    jpeg_create_decompress(&d->cinfo);
+}
+
+void mjpeg_free(mjpeg_decoder_t *d) {
+    jpeg_destroy_decompress(&d->cinfo);
+    free(d->row);
+    d->row = NULL;
+}
+
+static void mjpeg_reserve(mjpeg_decoder_t *d, size_t bytes) {
+    if (bytes <= d->row_bytes) return;
+    free(d->row);
+    d->row = malloc(bytes);
+    d->row_bytes = d->row ? bytes : 0;
+    if (!d->row) ERREXIT(&d->cinfo, JERR_OUT_OF_MEMORY);
+}
+
+/* YCbCr with the chroma halved across, and maybe down: 4:2:2 or 4:2:0 */
+static int mjpeg_planes_yuyv(const struct jpeg_decompress_struct *c) {
+    const jpeg_component_info *k = c->comp_info;
+    return c->jpeg_color_space == JCS_YCbCr && c->num_components == 3 && k[0].h_samp_factor == 2 &&
+           k[0].v_samp_factor <= 2 && k[1].h_samp_factor == 1 && k[1].v_samp_factor == 1 &&
+           k[2].h_samp_factor == 1 && k[2].v_samp_factor == 1;
+}
+
+/* The whole frame as YUYV, read as planes one iMCU row at a time */
+static void mjpeg_read_planes(mjpeg_decoder_t *d, uint8_t *out, size_t out_row) {
+    struct jpeg_decompress_struct *c = &d->cinfo;
+    int lines = c->max_v_samp_factor * DCTSIZE;
+    size_t y_w = c->comp_info[0].width_in_blocks * DCTSIZE;
+    size_t c_w = c->comp_info[1].width_in_blocks * DCTSIZE;
+    mjpeg_reserve(d, lines * y_w + 2 * DCTSIZE * c_w);
+    JSAMPROW y_rows[2 * DCTSIZE], cb_rows[DCTSIZE], cr_rows[DCTSIZE];
+    JSAMPARRAY planes[3] = { y_rows, cb_rows, cr_rows };
+    for (int r = 0; r < lines; r++) y_rows[r] = d->row + r * y_w;
+    for (int r = 0; r < DCTSIZE; r++) {
+        cb_rows[r] = d->row + lines * y_w + r * c_w;
+        cr_rows[r] = cb_rows[r] + DCTSIZE * c_w;
+    }
+
+    size_t pairs = c->output_width / 2;
+    for (JDIMENSION y0 = 0; y0 < c->output_height; y0 += lines) {
+        jpeg_read_raw_data(c, planes, lines);
+        for (int r = 0; r < lines && y0 + r < c->output_height; r++) {
+            const uint8_t *py = y_rows[r], *pu = cb_rows[r * DCTSIZE / lines], *pv = cr_rows[r * DCTSIZE / lines];
+            uint8_t *o = out + (y0 + r) * out_row;
+            for (size_t i = 0; i < pairs; i++, o += 4) {
+                o[0] = py[2 * i];
+                o[1] = pu[i];
+                o[2] = py[2 * i + 1];
+                o[3] = pv[i];
+            }
+        }
+    }
+}
+
+/* Pack a YCbCr row of `pixels` (even) pixels as YUYV, chroma from each pair's first pixel */
+static void mjpeg_pack_yuyv(const uint8_t *ycc, uint8_t *out, size_t pixels) {
+    for (size_t i = 0; i < pixels; i += 2, ycc += 6, out += 4) {
+        out[0] = ycc[0];
+        out[1] = ycc[1];
+        out[2] = ycc[3];
+        out[3] = ycc[2];
+    }
+}
+
+/**
+ * Decode the `bytes` of JPEG at `jpeg`, which must be width x height, and
+ * write `rect` of it scaled down by `scale` (1, 2 or 4) to `out` as gray,
+ * YUYV or RGB, packed like yuyv_extract_rows() writes it. `rect` must pass
+ * yuyv_extract_valid(). Scaled output comes from the DCT rather than a box
+ * filter, so it differs from the YUYV path's by a little.
+ * Returns 0 on success, -1 if the frame is corrupt or the wrong size.
+ */
+int mjpeg_decode(mjpeg_decoder_t *d, const uint8_t *jpeg, size_t bytes, unsigned width, unsigned height,
+                 const yuyv_rect_t *rect, unsigned scale, yuyv_format_t format, uint8_t *out) {
+    struct jpeg_decompress_struct *c = &d->cinfo;
+    size_t out_w = rect->width / scale;
+    size_t out_row = out_w * format;
+    unsigned rows = rect->height / scale;
+    d->frames++;
+    if (setjmp(d->err.jump)) {
+        jpeg_abort_decompress(c);
+        d->failed++;
+        return -1;
+    }
+
+    jpeg_mem_src(c, jpeg, bytes);
+    jpeg_read_header(c, TRUE);
+    if (c->image_width != width || c->image_height != height) {
+        snprintf(d->err.message, sizeof d->err.message, "frame is %ux%u, not %ux%u", c->image_width,
+                 c->image_height, width, height);
+        jpeg_abort_decompress(c);
+        d->failed++;
+        return -1;
+    }
+    c->out_color_space = format == YUYV_GRAY ? JCS_GRAYSCALE : format == YUYV_RGB ? JCS_RGB : JCS_YCbCr;
+    c->scale_num = 1;
+    c->scale_denom = scale;
+    // Replicated chroma: cheaper, and exactly what YUYV holds anyway.
+    c->do_fancy_upsampling = FALSE;
+    c->dct_method = JDCT_ISLOW;
+    c->raw_data_out = format == YUYV_YUV && scale == 1 && rect->width == width && rect->height == height &&
+                      mjpeg_planes_yuyv(c);
+    jpeg_start_decompress(c);
+    if (c->raw_data_out) {
+        mjpeg_read_planes(d, out, out_row);
+        jpeg_abort_decompress(c);
+        return 0;
+    }
+
+    // The crop starts on an iMCU boundary and may come out wider than asked.
+    JDIMENSION x = rect->x / scale, crop_x = x, crop_w = out_w;
+    if (crop_w < c->output_width) jpeg_crop_scanline(c, &crop_x, &crop_w);
+    if (rect->y) jpeg_skip_scanlines(c, rect->y / scale);
+    size_t skip = (size_t)(x - crop_x) * c->output_components;
+    int direct = format != YUYV_YUV && skip == 0 && crop_w == out_w;
+    if (!direct) mjpeg_reserve(d, (size_t)crop_w * c->output_components);
+
+    for (unsigned y = 0; y < rows; y++) {
+        uint8_t *o = out + y * out_row;
+        JSAMPROW dst = direct ? o : d->row;
+        jpeg_read_scanlines(c, &dst, 1);
+        if (direct) continue;
+        if (format == YUYV_YUV) mjpeg_pack_yuyv(d->row + skip, o, out_w);
+        else memcpy(o, d->row + skip, out_row);
+    }
+    // Rows below the region are never decoded.
+    jpeg_abort_decompress(c);
+    return 0;
+}
+
+void mjpeg_print_stats(const mjpeg_decoder_t *d, FILE *out) {
+    fprintf(out, "mjpeg: %lu frames, %lu failed, %lu warnings\n", d->frames, d->failed, d->err.warnings);
+    if (d->failed) fprintf(out, "  last error: %s\n", d->err.message);
+}
+
+#endif
@@ -5,6 +5,9 @@
  * MIT License
  */
 
+#ifndef MPU6050_H
+#define MPU6050_H
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -12,7 +15,14 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <linux/i2c-dev.h>
+#include <linux/i2c.h>
 #include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include "wiringPi.h"
+#include "i2c_bus.h"
 
 #define MPU6050_ADDR             0x68
 #define I2C_BUFFER_MAX           2
@@ -22,6 +32,13 @@
 #define ACCEL_CONFIG             0x1C  // Accelerometer config
 #define GYRO_CONFIG              0x1B  // Gyroscope config
 #define MPU_CONFIG               0x1A  // DLPF config
+#define SMPLRT_DIV               0x19  // Sample rate divider
+#define FIFO_EN                  0x23  // FIFO source select
+#define USER_CTRL                0x6A  // FIFO enable / reset
+#define INT_PIN_CFG              0x37  // INT pin level / latch
+#define INT_ENABLE               0x38
+#define FIFO_COUNTH              0x72
+#define FIFO_R_W                 0x74
 
 #define ACCEL_XOUT_H             0x3B
 #define ACCEL_YOUT_H             0x3D
@@ -30,6 +47,16 @@
 #define GYRO_XOUT_H              0x43
 #define GYRO_YOUT_H              0x45
 #define GYRO_ZOUT_H              0x47
+#define MPU6050_SAMPLE_LEN       14    // ACCEL_XOUT_H .. GYRO_ZOUT_L
+
+// FIFO
+#define MPU6050_FIFO_SIZE        1024
+#define FIFO_EN_SAMPLE           0xF8  // TEMP, XG, YG, ZG, ACCEL: 14-byte frames
+#define USER_CTRL_FIFO_EN        0x40
+#define USER_CTRL_FIFO_RESET     0x04
+
+// Interrupts
+#define INT_DATA_RDY_EN          0x01
 
 // Scale modifiers
 #define GRAVITY_MS2              9.80665f
@@ -62,57 +89,106 @@
 #define FILTER_BW_5               0x06
 
 typedef struct {
-    int i2c_fd;
+    i2c_bus_t *bus;        // shared I2C bus
+    // Configuration as last written; reads never touch config registers.
+    uint8_t accel_range;   // ACCEL_RANGE_*
+    uint8_t gyro_range;    // GYRO_RANGE_*
+    uint8_t dlpf;          // FILTER_BW_*
+    uint8_t smplrt_div;    // sample rate = gyro output rate / (1 + div)
+    float accel_scale;     // g per LSB
+    float gyro_scale;      // °/s per LSB
 } mpu6050_t;
 
+/* One coherent accel + temperature + gyro sample */
+typedef struct {
+    int16_t accel_raw[3];
+    int16_t temp_raw;
+    int16_t gyro_raw[3];
+    float accel[3];        // g
+    float temp;            // °C
+    float gyro[3];         // °/s
+    uint64_t t_us;         // piMicros64() at the DATA_RDY edge, 0 if polled
+} mpu6050_sample_t;
+
+/**
+ * Initialize MPU-6050 on an already open shared bus.
+ * Returns 0 on success, -1 on error.
+ */
+int mpu6050_init_on_bus(i2c_bus_t *bus, mpu6050_t *mpu) {
+    mpu->bus = bus;
+    // Wake up sensor (clear sleep bit) :contentReference[oaicite:10]{index=10}
+    uint8_t wm = 0x00;
+    if (i2c_bus_write(mpu->bus, MPU6050_ADDR, PWR_MGMT_1, &wm, 1) != 0)
+        return -1;
+    /*
+     * The config registers keep their values across a reset of the host, so
+     * write the defaults rather than assume them. SMPLRT_DIV, CONFIG,
+     * GYRO_CONFIG and ACCEL_CONFIG are consecutive: one block write.
+     */
+    uint8_t cfg[4] = { 0, FILTER_BW_256, GYRO_RANGE_250, ACCEL_RANGE_2G };
+    if (i2c_bus_write(mpu->bus, MPU6050_ADDR, SMPLRT_DIV, cfg, sizeof cfg) != 0)
+        return -1;
+    mpu->accel_range = ACCEL_RANGE_2G;
+    mpu->gyro_range = GYRO_RANGE_250;
+    mpu->dlpf = FILTER_BW_256;
+    mpu->smplrt_div = 0;
+    mpu->accel_scale = 1.0f / ACCEL_SF_2G;
+    mpu->gyro_scale = 1.0f / GYRO_SF_250;
+    return 0;
+}
+
 /**
  * Initialize MPU-6050 on given I2C bus (e.g. "/dev/i2c-1").
  * Returns 0 on success, -1 on error. :contentReference[oaicite:9]{index=9}
  */
 int mpu6050_init(const char *i2c_bus, mpu6050_t *mpu) {
-    if ((mpu->i2c_fd = open(i2c_bus, O_RDWR)) < 0) {
-        perror("Opening I2C bus");
+    i2c_bus_t *bus = i2c_bus_open_private(i2c_bus);
+    if (!bus)
         return -1;
-    }
-    if (ioctl(mpu->i2c_fd, I2C_SLAVE, MPU6050_ADDR) < 0) {
-        perror("Setting slave address");
-        close(mpu->i2c_fd);
-        return -1;
-    }
-    // Wake up sensor (clear sleep bit) :contentReference[oaicite:10]{index=10}
-    uint8_t wm = 0x00;
-    if (write(mpu->i2c_fd, (uint8_t[]){PWR_MGMT_1, wm}, 2) != 2) {
-        perror("Wake-up write");
+    if (mpu6050_init_on_bus(bus, mpu) != 0) {
+        i2c_bus_close_private(bus);
         return -1;
     }
     return 0;
 }
 
+/* Release the bus opened by mpu6050_init(); not for a shared bus */
+void mpu6050_close(mpu6050_t *mpu) {
+    i2c_bus_close_private(mpu->bus);
+    mpu->bus = NULL;
+}
+
+/**
+ * Read `len` consecutive registers with a repeated start, so the register
+ * select and the data read are a single ioctl and a single bus transaction.
+ * Returns 0 on success, -1 on error.
+ */
+int mpu6050_read_bytes(mpu6050_t *mpu, uint8_t reg, uint8_t *buf, uint16_t len) {
+    return i2c_bus_read(mpu->bus, MPU6050_ADDR, reg, buf, len);
+}
+
+static inline int16_t mpu6050_be16(const uint8_t *buf) {
+    return (int16_t)((buf[0] << 8) | buf[1]);
+}
+
 /**
  * Read two bytes and return signed 16-bit. :contentReference[oaicite:11]{index=11}
  */
 int16_t mpu6050_read_word(mpu6050_t *mpu, uint8_t reg) {
     uint8_t buf[I2C_BUFFER_MAX];
-    if (write(mpu->i2c_fd, &reg, 1) != 1) {
-        perror("Register select");
-        return 0;
-    }
-    if (read(mpu->i2c_fd, buf, 2) != 2) {
-        perror("Data read");
+    I2C_STATS_BEGIN(t0);
+    int err = mpu6050_read_bytes(mpu, reg, buf, 2);
+    I2C_STATS_END(I2C_STAT_MPU_READ_WORD, t0);
+    if (err != 0)
         return 0;
-    }
-    int16_t val = (buf[0] << 8) | buf[1];
-    return (val >= 0x8000) ? -((int16_t)((~val + 1) & 0xFFFF)) : val;
+    return mpu6050_be16(buf);
 }
 
 /**
  * Write single byte to a register. :contentReference[oaicite:12]{index=12}
  */
 void mpu6050_write_byte(mpu6050_t *mpu, uint8_t reg, uint8_t val) {
-    uint8_t buf[2] = { reg, val };
-    if (write(mpu->i2c_fd, buf, 2) != 2) {
-        perror("Register write");
-    }
+    i2c_bus_write(mpu->bus, MPU6050_ADDR, reg, &val, 1);
 }
 
 /* Temperature in °C */
@@ -121,57 +197,280 @@ float mpu6050_get_temp(mpu6050_t *mpu) {
     return (raw / 340.0f) + 36.53f;  /* Datasheet formula */ 
 }
 
+/* LSB per g / per °/s for a range register value */
+static inline float mpu6050_accel_sf(uint8_t range) {
+    return range == ACCEL_RANGE_4G  ? ACCEL_SF_4G :
+           range == ACCEL_RANGE_8G  ? ACCEL_SF_8G :
+           range == ACCEL_RANGE_16G ? ACCEL_SF_16G :
+                                      ACCEL_SF_2G;
+}
+
+static inline float mpu6050_gyro_sf(uint8_t range) {
+    return range == GYRO_RANGE_500  ? GYRO_SF_500 :
+           range == GYRO_RANGE_1000 ? GYRO_SF_1000 :
+           range == GYRO_RANGE_2000 ? GYRO_SF_2000 :
+                                      GYRO_SF_250;
+}
+
 /* Accelerometer range setter */
 void mpu6050_set_accel_range(mpu6050_t *mpu, uint8_t range) {
     mpu6050_write_byte(mpu, ACCEL_CONFIG, range);  /* 0x00 then range */ 
+    mpu->accel_range = range & 0x18;
+    mpu->accel_scale = 1.0f / mpu6050_accel_sf(mpu->accel_range);
 }
 
 /* Read back accel range (raw register) */
 uint8_t mpu6050_get_accel_range_raw(mpu6050_t *mpu) {
-    uint8_t reg = ACCEL_CONFIG;
-    if (write(mpu->i2c_fd, &reg, 1) != 1) { perror("Select ACCEL_CONFIG"); }
-    uint8_t val;
-    if (read(mpu->i2c_fd, &val, 1) != 1)  { perror("Read ACCEL_CONFIG"); }
+    uint8_t val = 0;
+    mpu6050_read_bytes(mpu, ACCEL_CONFIG, &val, 1);
     return val;
 }
 
-/* Get acceleration in m/s² or g */
-void mpu6050_get_accel(mpu6050_t *mpu, float *ax, float *ay, float *az, int in_g) {
-    int16_t rx = mpu6050_read_word(mpu, ACCEL_XOUT_H);
-    int16_t ry = mpu6050_read_word(mpu, ACCEL_YOUT_H);
-    int16_t rz = mpu6050_read_word(mpu, ACCEL_ZOUT_H);
-
-    uint8_t araw = mpu6050_get_accel_range_raw(mpu) & 0x18;
-    float sf = (araw == ACCEL_RANGE_4G ? ACCEL_SF_4G :
-                araw == ACCEL_RANGE_8G ? ACCEL_SF_8G :
-                araw == ACCEL_RANGE_16G? ACCEL_SF_16G:
-                                         ACCEL_SF_2G);
-    /* Scale to g */                              
-    *ax = rx / sf;  *ay = ry / sf;  *az = rz / sf;
+/**
+ * Get acceleration in m/s² or g.
+ * Returns 0 on success, -1 on error with the outputs left untouched.
+ */
+int mpu6050_get_accel(mpu6050_t *mpu, float *ax, float *ay, float *az, int in_g) {
+    uint8_t raw[6];
+    if (mpu6050_read_bytes(mpu, ACCEL_XOUT_H, raw, sizeof raw) != 0)
+        return -1;
 
-    if (!in_g) {
-        *ax *= GRAVITY_MS2;  *ay *= GRAVITY_MS2;  *az *= GRAVITY_MS2;
-    }
+    float sf = mpu->accel_scale;
+    if (!in_g) sf *= GRAVITY_MS2;
+    *ax = mpu6050_be16(raw) * sf;
+    *ay = mpu6050_be16(raw + 2) * sf;
+    *az = mpu6050_be16(raw + 4) * sf;
+    return 0;
 }
 
 /* Gyro range setter */
 void mpu6050_set_gyro_range(mpu6050_t *mpu, uint8_t range) {
     mpu6050_write_byte(mpu, GYRO_CONFIG, range); 
+    mpu->gyro_range = range & 0x18;
+    mpu->gyro_scale = 1.0f / mpu6050_gyro_sf(mpu->gyro_range);
+}
+
+/* Digital low-pass filter setter (FILTER_BW_*), EXT_SYNC left disabled */
+void mpu6050_set_dlpf(mpu6050_t *mpu, uint8_t bw) {
+    mpu6050_write_byte(mpu, MPU_CONFIG, bw & 0x07);
+    mpu->dlpf = bw & 0x07;
 }
 
-/* Read gyro data in °/s */
-void mpu6050_get_gyro(mpu6050_t *mpu, float *gx, float *gy, float *gz) {
-    int16_t gx_raw = mpu6050_read_word(mpu, GYRO_XOUT_H);
-    int16_t gy_raw = mpu6050_read_word(mpu, GYRO_YOUT_H);
-    int16_t gz_raw = mpu6050_read_word(mpu, GYRO_ZOUT_H);
+/* Sample rate divider setter */
+void mpu6050_set_sample_rate_div(mpu6050_t *mpu, uint8_t div) {
+    mpu6050_write_byte(mpu, SMPLRT_DIV, div);
+    mpu->smplrt_div = div;
+}
+
+/* Output data rate in Hz for the cached DLPF / divider settings */
+unsigned mpu6050_sample_rate_hz(const mpu6050_t *mpu) {
+    unsigned gyro_rate = (mpu->dlpf == FILTER_BW_256 || mpu->dlpf == 0x07) ? 8000 : 1000;
+    return gyro_rate / (1u + mpu->smplrt_div);
+}
+
+/**
+ * Read gyro data in °/s.
+ * Returns 0 on success, -1 on error with the outputs left untouched.
+ */
+int mpu6050_get_gyro(mpu6050_t *mpu, float *gx, float *gy, float *gz) {
+    uint8_t raw[6];
+    if (mpu6050_read_bytes(mpu, GYRO_XOUT_H, raw, sizeof raw) != 0)
+        return -1;
 
-    uint8_t graw = 0;
-    /* Re-read GYRO_CONFIG register */               
-    mpu6050_write_byte(mpu, MPU_CONFIG, 0); // keep ext_sync, set DLPF=0xff
-    // For brevity, assume default ±250°/s
-    float sf = GYRO_SF_250;
+    *gx = mpu6050_be16(raw) * mpu->gyro_scale;
+    *gy = mpu6050_be16(raw + 2) * mpu->gyro_scale;
+    *gz = mpu6050_be16(raw + 4) * mpu->gyro_scale;
+    return 0;
+}
 
-    *gx = gx_raw / sf;
-    *gy = gy_raw / sf;
-    *gz = gz_raw / sf;
+/* Scale one raw 14-byte ACCEL_XOUT_H..GYRO_ZOUT_L block into a sample */
+void mpu6050_decode_sample(const mpu6050_t *mpu, const uint8_t raw[MPU6050_SAMPLE_LEN],
+                           mpu6050_sample_t *out) {
+    for (int i = 0; i < 3; i++) {
+        out->accel_raw[i] = mpu6050_be16(raw + 2 * i);
+        out->gyro_raw[i] = mpu6050_be16(raw + 8 + 2 * i);
+        out->accel[i] = out->accel_raw[i] * mpu->accel_scale;
+        out->gyro[i] = out->gyro_raw[i] * mpu->gyro_scale;
+    }
+    out->temp_raw = mpu6050_be16(raw + 6);
+    out->temp = (out->temp_raw / 340.0f) + 36.53f;
+}
+
+/**
+ * Queue the 14-byte sample read on the shared bus; decode `raw` with
+ * mpu6050_decode_sample() after i2c_bus_flush(). Returns 0, or -1 if the
+ * batch is full.
+ */
+int mpu6050_queue_read_all(mpu6050_t *mpu, uint8_t raw[MPU6050_SAMPLE_LEN]) {
+    return i2c_bus_queue_read(mpu->bus, MPU6050_ADDR, ACCEL_XOUT_H, raw, MPU6050_SAMPLE_LEN);
 }
+
+/**
+ * Read accel, temperature and gyro in one repeated-start transaction. All
+ * seven values come from the same internal sample.
+ * Returns 0 on success, -1 on error.
+ */
+int mpu6050_read_all(mpu6050_t *mpu, mpu6050_sample_t *out) {
+    uint8_t raw[MPU6050_SAMPLE_LEN];
+    I2C_STATS_BEGIN(t0);
+    int err = mpu6050_read_bytes(mpu, ACCEL_XOUT_H, raw, sizeof raw);
+    I2C_STATS_END(I2C_STAT_MPU_READ_ALL, t0);
+    if (err != 0)
+        return -1;
+    mpu6050_decode_sample(mpu, raw, out);
+    out->t_us = 0;
+    return 0;
+}
+
+/**
+ * Start streaming accel + temp + gyro frames into the on-chip FIFO at
+ * mpu6050_sample_rate_hz() for the given divider. The FIFO holds 73 frames,
+ * so drain it at least that often.
+ */
+void mpu6050_fifo_start(mpu6050_t *mpu, uint8_t smplrt_div) {
+    mpu6050_write_byte(mpu, USER_CTRL, 0);
+    mpu6050_set_sample_rate_div(mpu, smplrt_div);
+    mpu6050_write_byte(mpu, FIFO_EN, FIFO_EN_SAMPLE);
+    mpu6050_write_byte(mpu, USER_CTRL, USER_CTRL_FIFO_RESET);
+    mpu6050_write_byte(mpu, USER_CTRL, USER_CTRL_FIFO_EN);
+}
+
+void mpu6050_fifo_stop(mpu6050_t *mpu) {
+    mpu6050_write_byte(mpu, USER_CTRL, 0);
+    mpu6050_write_byte(mpu, FIFO_EN, 0);
+}
+
+static int mpu6050_fifo_read(mpu6050_t *mpu, mpu6050_sample_t *out, int max, int *overflow) {
+    uint8_t cnt[2];
+    *overflow = 0;
+    if (mpu6050_read_bytes(mpu, FIFO_COUNTH, cnt, 2) != 0)
+        return -1;
+    int count = (cnt[0] << 8) | cnt[1];
+    if (count >= MPU6050_FIFO_SIZE) {
+        *overflow = 1;
+        mpu6050_write_byte(mpu, USER_CTRL, USER_CTRL_FIFO_RESET | USER_CTRL_FIFO_EN);
+        return 0;
+    }
+
+    int frames = count / MPU6050_SAMPLE_LEN;
+    if (frames > max) frames = max;
+    if (frames == 0) return 0;
+
+    uint8_t buf[MPU6050_FIFO_SIZE];
+    if (mpu6050_read_bytes(mpu, FIFO_R_W, buf, frames * MPU6050_SAMPLE_LEN) != 0)
+        return -1;
+    for (int i = 0; i < frames; i++) {
+        mpu6050_decode_sample(mpu, buf + i * MPU6050_SAMPLE_LEN, &out[i]);
+        out[i].t_us = 0;
+    }
+    return frames;
+}
+
+/**
+ * Move up to `max` complete frames from the FIFO into `out`, oldest first,
+ * using one FIFO_COUNT read and one burst read. If the FIFO overflowed the
+ * frame alignment is lost, so it is reset, *overflow is set and nothing is
+ * returned. Returns the number of samples read, or -1 on error.
+ */
+int mpu6050_fifo_drain(mpu6050_t *mpu, mpu6050_sample_t *out, int max, int *overflow) {
+    I2C_STATS_BEGIN(t0);
+    int frames = mpu6050_fifo_read(mpu, out, max, overflow);
+    I2C_STATS_END(I2C_STAT_MPU_FIFO_DRAIN, t0);
+    return frames;
+}
+
+/*
+ * DATA_RDY interrupt sampling. The handler runs on wiringPi's interrupt
+ * thread, which does not own the bus, so it only stamps the edge and wakes
+ * the sampling thread; that thread does the read itself (or submits it to
+ * the bus worker). wiringPiISR handlers take no arguments, so only one IMU
+ * per process can be driven this way.
+ */
+static sem_t mpu6050_isr_edge;
+static _Atomic uint64_t mpu6050_isr_t_us;   // piMicros64() at the latest edge
+static atomic_ulong mpu6050_isr_missed;     // edges no wait picked up
+
+static void mpu6050_isr(void) {
+    atomic_store(&mpu6050_isr_t_us, piMicros64());
+    // Binary wake-up: a sampling thread that fell behind reads the latest
+    // sample once rather than the same registers several times.
+    int pending = 0;
+    sem_getvalue(&mpu6050_isr_edge, &pending);
+    if (pending > 0) atomic_fetch_add(&mpu6050_isr_missed, 1);
+    else sem_post(&mpu6050_isr_edge);
+}
+
+/**
+ * Pulse the INT pin on every new sample. `pin` uses the wiringPi numbering
+ * chosen at setup. Collect samples with mpu6050_wait_data_ready(), or
+ * mpu6050_wait_edge() when the bus belongs to an i2c_worker.
+ * Returns 0 on success, -1 on error.
+ */
+int mpu6050_enable_data_ready(mpu6050_t *mpu, int pin) {
+    if (sem_init(&mpu6050_isr_edge, 0, 0) != 0) {
+        perror("sem_init");
+        return -1;
+    }
+    atomic_store(&mpu6050_isr_missed, 0);
+    /* Active high, push-pull, 50 us pulse: no status read needed to re-arm */
+    mpu6050_write_byte(mpu, INT_PIN_CFG, 0x00);
+    mpu6050_write_byte(mpu, INT_ENABLE, INT_DATA_RDY_EN);
+    if (wiringPiISR(pin, INT_EDGE_RISING, mpu6050_isr) < 0) {
+        perror("wiringPiISR");
+        mpu6050_write_byte(mpu, INT_ENABLE, 0);
+        sem_destroy(&mpu6050_isr_edge);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sleep until the next DATA_RDY edge, or return at once if one came since
+ * the last call, and hand out its piMicros64() stamp. Returns 0, or -1 if
+ * `timeout_ms` (0: forever) passed without an edge.
+ */
+int mpu6050_wait_edge(unsigned timeout_ms, uint64_t *t_us) {
+    int err;
+    if (timeout_ms) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        while ((err = sem_timedwait(&mpu6050_isr_edge, &ts)) != 0 && errno == EINTR) {}
+    } else {
+        while ((err = sem_wait(&mpu6050_isr_edge)) != 0 && errno == EINTR) {}
+    }
+    if (err != 0)
+        return -1;
+    *t_us = atomic_load(&mpu6050_isr_t_us);
+    return 0;
+}
+
+/**
+ * Wait for the next sample like mpu6050_wait_edge() and read it on the
+ * calling thread, which has to own the bus. `out->t_us` is the edge time.
+ * Returns 0 on success, -1 on a timeout or a bus error.
+ */
+int mpu6050_wait_data_ready(mpu6050_t *mpu, unsigned timeout_ms, mpu6050_sample_t *out) {
+    uint64_t t_us;
+    if (mpu6050_wait_edge(timeout_ms, &t_us) != 0 || mpu6050_read_all(mpu, out) != 0)
+        return -1;
+    out->t_us = t_us;
+    return 0;
+}
+
+/* Edges that came while the previous one was still waiting to be read */
+unsigned long mpu6050_data_ready_missed(void) { return atomic_load(&mpu6050_isr_missed); }
+
+/* Call once the sampling thread no longer waits */
+void mpu6050_disable_data_ready(mpu6050_t *mpu, int pin) {
+    wiringPiISRStop(pin);
+    mpu6050_write_byte(mpu, INT_ENABLE, 0);
+    sem_destroy(&mpu6050_isr_edge);
+}
+
+#endif
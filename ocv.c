@@ -1,163 +1,523 @@
+// Camera pipeline: capture -> YUYV->RGB / gray -> per-frame processing.
+//
+// The camera runs at --width x --height (640x480 by default, or the
+// nearest it offers) in YUYV or MJPEG, whichever is faster there, or the
+// one --format names; --formats lists what it offers. MJPEG frames are
+// decoded straight into what the processor takes (see mjpeg.h).
+//
+// The default build shows the frames in a raylib window. Built with
+// -DOCV_HEADLESS (make ocv-headless) there is no display and no raylib:
+// the loop blocks on the capture mailbox and processes every frame as it
+// arrives, can drop a PPM preview every so often, and reports frames/s and
+// per-stage timings to stdout or a stats file.
+//
+// --record FILE saves the raw frames as they come; --replay FILE feeds a
+// recording through the same pipeline instead of the camera, at recorded
+// pace scaled by --replay-speed, or 0 for as fast as the pipeline goes.
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/ioctl.h>
-#include <sys/mman.h>
-#include <linux/videodev2.h>
+#include <time.h>
+#ifndef OCV_HEADLESS
 #include "raylib.h"
+#endif
+#include "capture.h"
+#include "yuyv.h"
+#include "stripe_pool.h"
+#include "blob.h"
+#include "framerec.h"
+#include "mjpeg.h"
 
 #define DEVICE      "/dev/video0"
-#define WIDTH       640
-#define HEIGHT      480
-#define PIXEL_FORMAT V4L2_PIX_FMT_YUYV
 
+#define STATS_INTERVAL_MS   1000
+#define WAIT_TIMEOUT_MS     100     // how often a blocked headless loop checks for a signal
+
+// What a processor gets besides the raw frame: the region (--roi) as gray
+// or RGB, scaled down, packed at width * format bytes per row.
+typedef struct {
+    const unsigned char *data;
+    unsigned width;
+    unsigned height;
+    yuyv_format_t format;
+} FrameImage;
+
+/* Per-frame processing; `image` is NULL if the processor asked for none */
+typedef void (*frame_proc_fn)(void *ctx, const capture_frame_t *frame, const FrameImage *image);
+
+typedef struct {
+    const char *name;
+    frame_proc_fn fn;
+    int format;             // yuyv_format_t, or 0 for the raw frame only
+    unsigned scale;         // 1, 2 or 4
+    void *ctx;
+    void (*report)(void *ctx, FILE *out);   // appends to the stats line, optional
+} FrameProc;
+
+static void process_none(void *ctx, const capture_frame_t *frame, const FrameImage *image) {
+    (void)ctx; (void)frame; (void)image;
+}
+
+#define BLOB_TRACK_MAX 8
+
+// Color targets, found on the raw frame; the largest blobs of the last frame.
 typedef struct {
-    void   *start;
-    size_t length;
-} Buffer;
-
-static int  fd = -1;
-static Buffer buffers[4];
-
-// Simple YUYV → RGB888 converter
-static void yuyv_to_rgb(const unsigned char *yuyv, unsigned char *rgb) {
-    for (int i = 0; i < WIDTH * HEIGHT * 2; i += 4) {
-        int y0 = yuyv[i + 0], u = yuyv[i + 1], y1 = yuyv[i + 2], v = yuyv[i + 3];
-        int c0 = y0 - 16, c1 = y1 - 16, d = u - 128, e = v - 128;
-        // Pixel 0
-        int r = (298 * c0 + 409 * e + 128) >> 8;
-        int g = (298 * c0 - 100 * d - 208 * e + 128) >> 8;
-        int b = (298 * c0 + 516 * d + 128) >> 8;
-        rgb[0] = (unsigned char) (r < 0 ? 0 : r > 255 ? 255 : r);
-        rgb[1] = (unsigned char) (g < 0 ? 0 : g > 255 ? 255 : g);
-        rgb[2] = (unsigned char) (b < 0 ? 0 : b > 255 ? 255 : b);
-        // Pixel 1
-        r = (298 * c1 + 409 * e + 128) >> 8;
-        g = (298 * c1 - 100 * d - 208 * e + 128) >> 8;
-        b = (298 * c1 + 516 * d + 128) >> 8;
-        rgb[3] = (unsigned char) (r < 0 ? 0 : r > 255 ? 255 : r);
-        rgb[4] = (unsigned char) (g < 0 ? 0 : g > 255 ? 255 : g);
-        rgb[5] = (unsigned char) (b < 0 ? 0 : b > 255 ? 255 : b);
-        rgb += 6;
+    blob_finder_t finder;
+    blob_range_t range;
+    unsigned min_area;
+    blob_t blobs[BLOB_TRACK_MAX];
+    int nblobs;
+} BlobTrack;
+
+// Default range: saturated red (high V, low U).
+static BlobTrack blob_track = { .range = { 30, 235, 0, 115, 165, 255 }, .min_area = 50 };
+
+static void process_blob(void *ctx, const capture_frame_t *frame, const FrameImage *image) {
+    (void)image;
+    BlobTrack *t = ctx;
+    if (!t->finder.bits && blob_finder_init(&t->finder, frame->width, frame->height, 0) != 0) return;
+    t->nblobs = blob_find(&t->finder, frame->data, frame->stride, &t->range, t->min_area, t->blobs, BLOB_TRACK_MAX);
+}
+
+static void report_blob(void *ctx, FILE *out) {
+    BlobTrack *t = ctx;
+    fprintf(out, " | %d blobs", t->nblobs);
+    if (t->nblobs) fprintf(out, ", largest %u px at %.1f,%.1f", t->blobs[0].area, t->blobs[0].cx, t->blobs[0].cy);
+}
+
+// Selected with --process NAME; the first entry is the default. The no-op
+// entries only extract their input, to measure that on its own.
+static const FrameProc processors[] = {
+    { "none",   process_none, 0, 1, NULL, NULL },
+    { "rgb",    process_none, YUYV_RGB, 1, NULL, NULL },
+    { "rgb/2",  process_none, YUYV_RGB, 2, NULL, NULL },
+    { "rgb/4",  process_none, YUYV_RGB, 4, NULL, NULL },
+    { "gray",   process_none, YUYV_GRAY, 1, NULL, NULL },
+    { "gray/2", process_none, YUYV_GRAY, 2, NULL, NULL },
+    { "gray/4", process_none, YUYV_GRAY, 4, NULL, NULL },
+    { "blob",   process_blob, 0, 1, &blob_track, report_blob },
+};
+#define NPROCESSORS (sizeof processors / sizeof processors[0])
+
+typedef struct {
+    const capture_frame_t *frame;
+    mjpeg_decoder_t *jpeg;  // decodes MJPEG frames straight to the output, or NULL for YUYV
+    yuyv_rect_t rect;
+    unsigned scale;
+    yuyv_format_t format;
+    unsigned char *out;
+    int rows;               // output rows
+    int stripe_rows;
+} Convert;
+
+static void convert_rows(void *ctx, int first, int count) {
+    Convert *c = ctx;
+    yuyv_extract_rows(c->frame->data, c->frame->stride, &c->rect, c->scale, c->format, c->out, first, count);
+}
+
+static void convert_setup(Convert *c, const stripe_pool_t *pool, yuyv_rect_t rect, unsigned scale,
+                          yuyv_format_t format, unsigned char *out, mjpeg_decoder_t *jpeg) {
+    c->jpeg = jpeg;
+    c->rect = rect;
+    c->scale = scale;
+    c->format = format;
+    c->out = out;
+    c->rows = rect.height / scale;
+    // Rows read plus rows written, per output row.
+    c->stripe_rows = stripe_pool_rows_for(pool, c->rows, (size_t)rect.width * scale * 2 + rect.width / scale * format);
+}
+
+/* Returns 0, or -1 if an MJPEG frame did not decode */
+static int convert(Convert *c, stripe_pool_t *pool, const capture_frame_t *frame) {
+    if (c->jpeg) {
+        return mjpeg_decode(c->jpeg, frame->data, frame->bytes, frame->width, frame->height, &c->rect, c->scale,
+                            c->format, c->out);
     }
+    c->frame = frame;
+    stripe_pool_run(pool, c->rows, c->stripe_rows, convert_rows, c);
+    return 0;
 }
 
-int main(void) {
-    // 1. Open V4L2 device
-    fd = open(DEVICE, O_RDWR);
-    if (fd < 0) { perror("Open device"); return EXIT_FAILURE; }
+// The frame as processors that take the raw frame and the YUYV display
+// path read it: MJPEG is decoded to YUYV into `decoded` first. NULL if it
+// did not decode.
+static const capture_frame_t *raw_frame(Convert *unpack, capture_frame_t *decoded, stripe_pool_t *pool,
+                                        const capture_frame_t *frame) {
+    if (!unpack->jpeg) return frame;
+    if (convert(unpack, pool, frame) != 0) return NULL;
+    decoded->seq = frame->seq;
+    decoded->t_ns = frame->t_ns;
+    return decoded;
+}
 
-    // 2. Query capabilities
-    struct v4l2_capability cap = {0};
-    if (ioctl(fd, VIDIOC_QUERYCAP, &cap) == -1) {
-        perror("QueryCap");
-        return EXIT_FAILURE;
-    } // :contentReference[oaicite:5]{index=5}
-
-    // 3. Set image format
-    struct v4l2_format fmt = {0};
-    fmt.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmt.fmt.pix.width       = WIDTH;
-    fmt.fmt.pix.height      = HEIGHT;
-    fmt.fmt.pix.pixelformat = PIXEL_FORMAT;
-    fmt.fmt.pix.field       = V4L2_FIELD_NONE;
-    if (ioctl(fd, VIDIOC_S_FMT, &fmt) == -1) {
-        perror("SetFmt");
-        return EXIT_FAILURE;
-    } // :contentReference[oaicite:6]{index=6}
-
-    // 4. Request buffers
-    struct v4l2_requestbuffers req = {0};
-    req.count  = 4;
-    req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
-    if (ioctl(fd, VIDIOC_REQBUFS, &req) == -1) {
-        perror("ReqBufs");
-        return EXIT_FAILURE;
+// A YUYV frame the driver cut short is skipped; MJPEG ones fail to decode.
+static int frame_complete(const capture_t *cap, const capture_frame_t *f) {
+    if (cap->fourcc == V4L2_PIX_FMT_MJPEG) return f->bytes > 0;
+    return f->bytes >= (size_t)f->stride * f->height;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+enum { STAGE_WAIT, STAGE_CONVERT, STAGE_PROCESS, STAGE_PREVIEW, STAGE_LATENCY, NSTAGES };
+static const char *const stage_names[NSTAGES] = { "wait", "convert", "process", "preview", "latency" };
+
+// Accumulated over one report interval.
+typedef struct {
+    FILE *out;
+    uint64_t t0;
+    unsigned long frames;
+    unsigned long dropped0;
+    uint64_t sum_ns[NSTAGES];
+    uint64_t max_ns[NSTAGES];
+    unsigned long count[NSTAGES];
+} Stats;
+
+static void stats_add(Stats *s, int stage, uint64_t ns) {
+    s->sum_ns[stage] += ns;
+    if (ns > s->max_ns[stage]) s->max_ns[stage] = ns;
+    s->count[stage]++;
+}
+
+// One line per interval: frames/s, frames dropped in the mailbox, then
+// mean/max microseconds for every stage. Latency is from the driver's
+// timestamp to the end of processing.
+static void stats_report(Stats *s, const frame_mailbox_t *mb, const FrameProc *proc, uint64_t now) {
+    unsigned long dropped = atomic_load(&mb->dropped);
+    fprintf(s->out, "%6.1f fps %4lu dropped", s->frames * 1e9 / (now - s->t0), dropped - s->dropped0);
+    for (int i = 0; i < NSTAGES; i++) {
+        if (!s->count[i]) continue;
+        fprintf(s->out, " | %s %.0f/%.0f us", stage_names[i], s->sum_ns[i] / 1e3 / s->count[i], s->max_ns[i] / 1e3);
     }
+    if (proc->report) proc->report(proc->ctx, s->out);
+    fputc('\n', s->out);
+    fflush(s->out);
+    FILE *out = s->out;
+    memset(s, 0, sizeof *s);
+    s->out = out;
+    s->t0 = now;
+    s->dropped0 = dropped;
+}
 
-    // 5. Map buffers
-    for (int i = 0; i < req.count; ++i) {
-        struct v4l2_buffer buf = {0};
-        buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index  = i;
-        if (ioctl(fd, VIDIOC_QUERYBUF, &buf) == -1) {
-            perror("QueryBuf");
-            return EXIT_FAILURE;
+#ifdef OCV_HEADLESS
+// Written to a temporary name and renamed, so a viewer never sees half a frame.
+static void write_ppm(const char *path, const unsigned char *rgb, unsigned width, unsigned height) {
+    char tmp[4096];
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) { perror(tmp); return; }
+    fprintf(f, "P6\n%u %u\n255\n", width, height);
+    size_t n = fwrite(rgb, 1, (size_t)width * height * 3, f);
+    if (fclose(f) != 0 || n != (size_t)width * height * 3) {
+        perror(tmp);
+        remove(tmp);
+        return;
+    }
+    if (rename(tmp, path) != 0) perror(path);
+}
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+#endif
+
+int main(int argc, char **argv) {
+    // Camera and the size to ask it for; the frame size is whatever it gives.
+    const char *device = DEVICE;
+    unsigned width = 640, height = 480;
+    uint32_t fourcc = 0;            // 0: YUYV or MJPEG, whichever is faster
+    int list_formats = 0;
+    // Conversion threads, including this one; 0 = one per CPU, 1 = low-power.
+    int threads = 0;
+    // V4L2 queue depth and memory type (USERPTR: our own page-aligned pool).
+    int nbuffers = 0;
+    unsigned memory = V4L2_MEMORY_MMAP;
+    const FrameProc *proc = &processors[0];
+    // Part of the frame the processor gets; the whole frame by default.
+    yuyv_rect_t roi = {0};
+    // Raw frames to record to, or to replay instead of the camera.
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    double replay_speed = 1.0;
+    int replay_loop = 0;
+    // Throughput report; the headless build always reports, to stdout by default.
+    const char *stats_path = NULL;
+#ifdef OCV_HEADLESS
+    // PPM preview every preview_ms, and stop after max_frames (0: never).
+    const char *preview_path = NULL;
+    int preview_ms = 1000;
+    unsigned long max_frames = 0;
+#endif
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--device") == 0 && i + 1 < argc) device = argv[++i];
+        else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc) width = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--height") == 0 && i + 1 < argc) height = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--formats") == 0) list_formats = 1;
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            if (strcmp(name, "yuyv") == 0) fourcc = V4L2_PIX_FMT_YUYV;
+            else if (strcmp(name, "mjpeg") == 0) fourcc = V4L2_PIX_FMT_MJPEG;
+            else if (strcmp(name, "auto") == 0) fourcc = 0;
+            else {
+                fprintf(stderr, "--format takes yuyv, mjpeg or auto\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--buffers") == 0 && i + 1 < argc) nbuffers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--userptr") == 0) memory = V4L2_MEMORY_USERPTR;
+        else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) stats_path = argv[++i];
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) record_path = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) replay_path = argv[++i];
+        else if (strcmp(argv[i], "--replay-speed") == 0 && i + 1 < argc) replay_speed = atof(argv[++i]);
+        else if (strcmp(argv[i], "--replay-loop") == 0) replay_loop = 1;
+        else if (strcmp(argv[i], "--blob-range") == 0 && i + 1 < argc) {
+            blob_range_t *r = &blob_track.range;
+            if (sscanf(argv[++i], "%hhu,%hhu,%hhu,%hhu,%hhu,%hhu", &r->y_min, &r->y_max, &r->u_min, &r->u_max,
+                       &r->v_min, &r->v_max) != 6) {
+                fprintf(stderr, "--blob-range takes Ymin,Ymax,Umin,Umax,Vmin,Vmax\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--blob-min") == 0 && i + 1 < argc) blob_track.min_area = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--roi") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%u,%u,%u,%u", &roi.x, &roi.y, &roi.width, &roi.height) != 4) {
+                fprintf(stderr, "--roi takes X,Y,W,H\n");
+                return EXIT_FAILURE;
+            }
         }
-        buffers[i].length = buf.length;
-        buffers[i].start  = mmap(NULL, buf.length,
-                                 PROT_READ | PROT_WRITE,
-                                 MAP_SHARED, fd, buf.m.offset);
-        if (buffers[i].start == MAP_FAILED) {
-            perror("MMAP");
+#ifdef OCV_HEADLESS
+        else if (strcmp(argv[i], "--preview") == 0 && i + 1 < argc) preview_path = argv[++i];
+        else if (strcmp(argv[i], "--preview-ms") == 0 && i + 1 < argc) preview_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) max_frames = strtoul(argv[++i], NULL, 10);
+#endif
+        else if (strcmp(argv[i], "--process") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            proc = NULL;
+            for (size_t p = 0; p < NPROCESSORS; p++) {
+                if (strcmp(processors[p].name, name) == 0) proc = &processors[p];
+            }
+            if (!proc) {
+                fprintf(stderr, "Unknown processor '%s'\n", name);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    if (list_formats) return capture_list_modes(device, width, height, stdout) == 0 ? 0 : EXIT_FAILURE;
+
+    Stats stats = {0};
+    stats.out = stdout;
+    if (stats_path && !(stats.out = fopen(stats_path, "a"))) {
+        perror(stats_path);
+        return EXIT_FAILURE;
+    }
+
+    // 1. Open the camera (or a recording); a capture thread owns it from here on
+    capture_t cap;
+    framerec_reader_t reader = { .fd = -1 };
+    framerec_replay_t replay = { &reader, replay_speed, replay_loop, 0 };
+    if (replay_path) {
+        if (framerec_reader_open(&reader, replay_path) != 0) return EXIT_FAILURE;
+        if (framerec_replay_open(&cap, &replay, nbuffers) != 0) {
+            framerec_reader_close(&reader);
             return EXIT_FAILURE;
         }
-    } // :contentReference[oaicite:7]{index=7}
-
-    // 6. Queue buffers and start streaming
-    for (int i = 0; i < 4; ++i) {
-        struct v4l2_buffer buf = {0};
-        buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index  = i;
-        ioctl(fd, VIDIOC_QBUF, &buf);
+        printf("Replaying %zu frames from %s\n", reader.count, replay_path);
+    } else if (capture_open(&cap, device, width, height, fourcc, nbuffers, memory) != 0) {
+        return EXIT_FAILURE;
+    }
+    width = cap.width;
+    height = cap.height;
+    printf("Source: %.4s %ux%u", (const char *)&cap.fourcc, width, height);
+    if (cap.interval.numerator) printf(" at %.1f fps", (double)cap.interval.denominator / cap.interval.numerator);
+    putchar('\n');
+    if (!roi.width) roi = (yuyv_rect_t){ 0, 0, width, height };
+    frame_mailbox_t mailbox;
+#ifdef OCV_HEADLESS
+    int waitable = 1;
+#else
+    int waitable = 0;
+#endif
+    framerec_recorder_t recorder;
+    int recording = 0;  // recorder started; stop it on every way out
+    int ok = !proc->format || yuyv_extract_valid(&roi, width, height, proc->scale);
+    if (!ok) {
+        fprintf(stderr, "Region %ux%u at %u,%u does not fit the %ux%u frame at 1/%u scale\n", roi.width, roi.height,
+                roi.x, roi.y, width, height, proc->scale);
     }
-    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    ioctl(fd, VIDIOC_STREAMON, &type);
+    ok = ok && capture_add_consumer(&cap, &mailbox, waitable) == 0;
+    if (ok && record_path) {
+        recording = framerec_recorder_start(&recorder, &cap, record_path) == 0;
+        ok = recording;
+    }
+    if (!ok || capture_start(&cap) != 0) {
+        if (recording) framerec_recorder_stop(&recorder);
+        capture_close(&cap);
+        if (replay_path) framerec_reader_close(&reader);
+        return EXIT_FAILURE;
+    }
+
+    stripe_pool_t pool;
+    threads = stripe_pool_init(&pool, threads);
+
+    // MJPEG goes straight into the processor's format when it has one;
+    // otherwise processors and the display read a YUYV decode of the frame.
+    mjpeg_decoder_t jpeg;
+    mjpeg_init(&jpeg);
+    int mjpeg = cap.fourcc == V4L2_PIX_FMT_MJPEG;
+    mjpeg_decoder_t *direct = mjpeg && proc->format ? &jpeg : NULL;
+    yuyv_rect_t full = { 0, 0, width, height };
+    unsigned char *yuyvBuffer = NULL;
+    capture_frame_t decoded = { .width = width, .height = height, .stride = width * 2 };
+    Convert unpack = {0};
+    if (mjpeg && !proc->format) {
+        decoded.bytes = (size_t)width * height * 2;
+        yuyvBuffer = malloc(decoded.bytes);
+        decoded.data = yuyvBuffer;
+        convert_setup(&unpack, &pool, full, 1, YUYV_YUV, yuyvBuffer, &jpeg);
+    }
+
+    // Allocate CPU buffer for RGB data
+    unsigned char *rgbBuffer = malloc((size_t)width * height * 3);
+    Convert display;
+    convert_setup(&display, &pool, full, 1, YUYV_RGB, rgbBuffer, direct);
+    // The processor's input, unless it is the full RGB frame the display already has.
+    FrameImage image = { rgbBuffer, roi.width / proc->scale, roi.height / proc->scale, proc->format };
+    int shared = proc->format == YUYV_RGB && proc->scale == 1 && image.width == width && image.height == height;
+    unsigned char *procBuffer = NULL;
+    Convert input = {0};
+    if (proc->format && !shared) {
+        procBuffer = malloc((size_t)image.width * image.height * proc->format);
+        image.data = procBuffer;
+        convert_setup(&input, &pool, roi, proc->scale, proc->format, procBuffer, direct);
+    }
+    printf("YUYV conversion: %s, %d threads, %d-row stripes; processing: %s, %ux%u\n", yuyv_init(), threads,
+           display.stripe_rows, proc->name, image.width, image.height);
+    stats.t0 = now_ns();
 
-    // 7. Raylib initialization
-    InitWindow(WIDTH, HEIGHT, "V4L2 Camera → Raylib");     // :contentReference[oaicite:8]{index=8}
+#ifdef OCV_HEADLESS
+    // 2. No display: process every frame as soon as it is published
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    uint64_t next_preview = stats.t0;
+    unsigned long total = 0;
+    while (!stop && (!max_frames || total < max_frames)) {
+        uint64_t t = now_ns();
+        int ready = frame_mailbox_wait(&mailbox, WAIT_TIMEOUT_MS);
+        uint64_t t_wait = now_ns();
+        if (!ready && atomic_load(&cap.finished)) break;      // end of the replay, or the camera failed
+        const capture_frame_t *frame;
+        if (ready && frame_mailbox_take(&mailbox, &frame) && frame_complete(&cap, frame)) {
+            stats_add(&stats, STAGE_WAIT, t_wait - t);
+            t = t_wait;
+            const capture_frame_t *raw = raw_frame(&unpack, &decoded, &pool, frame);
+            int ok = raw && (!proc->format || convert(shared ? &display : &input, &pool, frame) == 0);
+            if (proc->format || mjpeg) {
+                t = now_ns();
+                stats_add(&stats, STAGE_CONVERT, t - t_wait);
+            }
+            if (!ok) {
+                frame_mailbox_release(&mailbox);
+                continue;
+            }
+            proc->fn(proc->ctx, raw, proc->format ? &image : NULL);
+            uint64_t t_done = now_ns();
+            stats_add(&stats, STAGE_PROCESS, t_done - t);
+            if (frame->t_ns && frame->t_ns < t_done) stats_add(&stats, STAGE_LATENCY, t_done - frame->t_ns);
+
+            if (preview_path && t_wait >= next_preview) {
+                if (shared || convert(&display, &pool, raw) == 0) write_ppm(preview_path, rgbBuffer, width, height);
+                next_preview = t_wait + (uint64_t)preview_ms * 1000000;
+                stats_add(&stats, STAGE_PREVIEW, now_ns() - t_done);
+            }
+            frame_mailbox_release(&mailbox);
+            stats.frames++;
+            total++;
+        }
+        uint64_t now = now_ns();
+        if (now - stats.t0 >= STATS_INTERVAL_MS * 1000000ull) stats_report(&stats, &mailbox, proc, now);
+    }
+    if (stats.frames) stats_report(&stats, &mailbox, proc, now_ns());
+    frame_mailbox_release(&mailbox);
+#else
+    // 2. Raylib initialization
+    InitWindow(width, height, "V4L2 Camera → Raylib");     // :contentReference[oaicite:8]{index=8}
     SetTargetFPS(60);                                       // :contentReference[oaicite:9]{index=9}
     // Texture2D camTex = LoadTextureFromImage(Image);         // placeholder
     // Image img = GenImageColor(WIDTH, HEIGHT, BLACK);
     Texture2D camTex;
 
-    // Allocate CPU buffer for RGB data
-    unsigned char *rgbBuffer = malloc(WIDTH * HEIGHT * 3);
-
     // Actually create the Raylib texture
-    camTex.width  = WIDTH;
-    camTex.height = HEIGHT;
+    camTex.width  = width;
+    camTex.height = height;
     camTex.mipmaps = 1;
     camTex.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8;                   // Raylib enum for RGB
     UpdateTexture(camTex, rgbBuffer);                       // dummy to init GPU texture :contentReference[oaicite:10]{index=10}
 
-    // 8. Main loop
+    // 3. Main loop: render the newest frame at the display rate
     while (!WindowShouldClose()) {
-        // Dequeue frame
-        struct v4l2_buffer buf = {0};
-        buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        if (ioctl(fd, VIDIOC_DQBUF, &buf) == -1) {
-            perror("DQBUF");
-            break;
+        const capture_frame_t *frame;
+        if (frame_mailbox_take(&mailbox, &frame) && frame_complete(&cap, frame)) {
+            // Convert YUYV→RGB straight out of the driver buffer and upload
+            uint64_t t = now_ns();
+            const capture_frame_t *raw = raw_frame(&unpack, &decoded, &pool, frame);
+            int ok = raw && convert(&display, &pool, raw) == 0;
+            if (ok && proc->format && !shared) ok = convert(&input, &pool, frame) == 0;
+            uint64_t t_conv = now_ns();
+            if (ok) proc->fn(proc->ctx, raw, proc->format ? &image : NULL);
+            uint64_t t_done = now_ns();
+            stats_add(&stats, STAGE_CONVERT, t_conv - t);
+            stats_add(&stats, STAGE_PROCESS, t_done - t_conv);
+            if (frame->t_ns && frame->t_ns < t_done) stats_add(&stats, STAGE_LATENCY, t_done - frame->t_ns);
+            stats.frames++;
+            if (ok) UpdateTexture(camTex, rgbBuffer);               // :contentReference[oaicite:11]{index=11}
         }
-
-        // Convert YUYV→RGB and upload
-        yuyv_to_rgb(buffers[buf.index].start, rgbBuffer);
-        UpdateTexture(camTex, rgbBuffer);                   // :contentReference[oaicite:11]{index=11}
-
-        // Re-queue buffer
-        ioctl(fd, VIDIOC_QBUF, &buf);
+        frame_mailbox_release(&mailbox);
+        uint64_t now = now_ns();
+        if (stats_path && now - stats.t0 >= STATS_INTERVAL_MS * 1000000ull) stats_report(&stats, &mailbox, proc, now);
 
         // Draw
         BeginDrawing();
           ClearBackground(BLACK);
           DrawTexture(camTex, 0, 0, WHITE);
+          if (proc->fn == process_blob) {
+              for (int i = 0; i < blob_track.nblobs; i++) {
+                  const blob_t *b = &blob_track.blobs[i];
+                  DrawRectangleLines(b->x0, b->y0, b->x1 - b->x0 + 1, b->y1 - b->y0 + 1, GREEN);
+                  DrawCircle((int)b->cx, (int)b->cy, 3, GREEN);
+              }
+          }
           DrawText(TextFormat("FPS: %02i", GetFPS()), 10, 10, 20, GRAY);
         EndDrawing();
     }
 
-    // 9. Cleanup
     CloseWindow();
-    ioctl(fd, VIDIOC_STREAMOFF, &type);
-    for (int i = 0; i < 4; ++i) munmap(buffers[i].start, buffers[i].length);
-    close(fd);
+#endif
+
+    // 4. Cleanup
+    if (recording) {
+        if (framerec_recorder_stop(&recorder) != 0) fprintf(stderr, "%s is incomplete\n", record_path);
+        printf("Recorded %lu frames (%.1f MB) to %s\n", recorder.frames, recorder.bytes / 1e6, record_path);
+    }
+    capture_close(&cap);
+    capture_print_stats(&cap, stdout);
+    if (mjpeg) mjpeg_print_stats(&jpeg, stdout);
+    if (replay_path) framerec_reader_close(&reader);
+    stripe_pool_destroy(&pool);
     free(rgbBuffer);
+    free(procBuffer);
+    free(yuyvBuffer);
+    mjpeg_free(&jpeg);
+    blob_finder_free(&blob_track.finder);
+    if (stats.out != stdout) fclose(stats.out);
 
     return 0;
 }
@@ -0,0 +1,206 @@
+/*
+ * Real-time sensor acquisition thread.
+ *
+ * Samples the AS5600 and MPU6050 at a fixed period on its own CPU-pinned
+ * SCHED_FIFO thread and publishes timestamped samples into SPSC rings, one
+ * per consumer (control loop, logger, ...), so that slow consumers never
+ * stall sensing or each other. Both sensors are read with a single ioctl.
+ *
+ * The thread either owns the bus outright or, when `worker` is set, submits
+ * its reads through the bus worker at I2C_PRIO_CONTROL so servo writes from
+ * other threads can share the bus.
+ */
+#ifndef SENSOR_ACQ_H
+#define SENSOR_ACQ_H
+
+// Build with -D_GNU_SOURCE for CPU_SET and pthread_attr_setaffinity_np.
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include "as5600.h"
+#include "mpu6050.h"
+#include "i2c_worker.h"
+#include "spsc_ring.h"
+
+#define SENSOR_ACQ_MAX_RINGS 4
+
+typedef struct {
+    uint64_t t_ns;              // CLOCK_MONOTONIC when the read completed
+    uint32_t seq;
+    int status;                 // 0, or -1 if the bus transfer failed
+    as5600_snapshot_t enc;
+    mpu6050_sample_t imu;
+} sensor_sample_t;
+
+typedef struct {
+    // Configuration, set before sensor_acq_start().
+    i2c_bus_t *bus;
+    i2c_worker_t *worker;       // optional, see above
+    as5600_t *enc;              // either sensor may be NULL
+    mpu6050_t *imu;
+    unsigned period_us;
+    int cpu;                    // -1: no pinning
+    int priority;               // SCHED_FIFO priority, 0: default policy
+
+    spsc_ring_t *rings[SENSOR_ACQ_MAX_RINGS];
+    int nrings;
+
+    pthread_t thread;
+    atomic_int running;
+    sem_t done;
+    atomic_ulong samples;
+    atomic_ulong overruns;      // periods skipped because a read ran long
+    atomic_ulong errors;
+} sensor_acq_t;
+
+void sensor_acq_init(sensor_acq_t *acq, i2c_bus_t *bus, as5600_t *enc, mpu6050_t *imu, unsigned period_us) {
+    memset(acq, 0, sizeof *acq);
+    acq->bus = bus;
+    acq->enc = enc;
+    acq->imu = imu;
+    acq->period_us = period_us;
+    acq->cpu = -1;
+}
+
+/* Register a consumer ring of sensor_sample_t. Returns 0, or -1 if full. */
+int sensor_acq_add_ring(sensor_acq_t *acq, spsc_ring_t *ring) {
+    if (acq->nrings == SENSOR_ACQ_MAX_RINGS) return -1;
+    acq->rings[acq->nrings++] = ring;
+    return 0;
+}
+
+static void sensor_acq_req_done(void *ctx, int status) {
+    (void)status;
+    sem_post(&((sensor_acq_t *)ctx)->done);
+}
+
+static int sensor_acq_read(sensor_acq_t *acq, uint8_t *enc_raw, uint8_t *imu_raw) {
+    if (!acq->worker) {
+        if (acq->enc && as5600_queue_snapshot(acq->enc, enc_raw) != 0) return -1;
+        if (acq->imu && mpu6050_queue_read_all(acq->imu, imu_raw) != 0) return -1;
+        return i2c_bus_flush(acq->bus);
+    }
+
+    atomic_int enc_flag = 1, imu_flag = 1;
+    int pending = 0;
+    i2c_req_t req = { .op = I2C_OP_READ, .done = sensor_acq_req_done, .ctx = acq };
+    if (acq->enc) {
+        req.addr = AS5600_DEFAULT_ADDRESS;
+        req.reg = STATUS;
+        req.buf = enc_raw;
+        req.len = AS5600_SNAPSHOT_LEN;
+        req.flag = &enc_flag;
+        if (i2c_worker_submit(acq->worker, I2C_PRIO_CONTROL, &req) != 0) return -1;
+        pending++;
+    }
+    if (acq->imu) {
+        req.addr = MPU6050_ADDR;
+        req.reg = ACCEL_XOUT_H;
+        req.buf = imu_raw;
+        req.len = MPU6050_SAMPLE_LEN;
+        req.flag = &imu_flag;
+        if (i2c_worker_submit(acq->worker, I2C_PRIO_CONTROL, &req) == 0) pending++;
+        else imu_flag = -1;
+    }
+    while (pending--) {
+        while (sem_wait(&acq->done) != 0 && errno == EINTR) {}
+    }
+    return atomic_load(&enc_flag) < 0 || atomic_load(&imu_flag) < 0 ? -1 : 0;
+}
+
+static void sensor_acq_timespec_add(struct timespec *ts, uint64_t ns) {
+    ns += ts->tv_nsec;
+    ts->tv_sec += ns / 1000000000ull;
+    ts->tv_nsec = ns % 1000000000ull;
+}
+
+static void *sensor_acq_main(void *arg) {
+    sensor_acq_t *acq = arg;
+    uint8_t enc_raw[AS5600_SNAPSHOT_LEN] = {0};
+    uint8_t imu_raw[MPU6050_SAMPLE_LEN] = {0};
+    sensor_sample_t sample = {0};
+    const uint64_t period_ns = (uint64_t)acq->period_us * 1000;
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (atomic_load_explicit(&acq->running, memory_order_acquire)) {
+        sample.status = sensor_acq_read(acq, enc_raw, imu_raw);
+        sample.t_ns = i2c_bus_now_ns();
+        if (sample.status == 0) {
+            if (acq->enc) as5600_decode_snapshot(enc_raw, &sample.enc);
+            if (acq->imu) {
+                mpu6050_decode_sample(acq->imu, imu_raw, &sample.imu);
+                sample.imu.t_us = 0;
+            }
+        } else {
+            atomic_fetch_add_explicit(&acq->errors, 1, memory_order_relaxed);
+        }
+        for (int i = 0; i < acq->nrings; i++) spsc_push(acq->rings[i], &sample);
+        sample.seq++;
+        atomic_fetch_add_explicit(&acq->samples, 1, memory_order_relaxed);
+
+        // Fixed-rate schedule; if a read overran whole periods, skip them
+        // instead of bursting to catch up.
+        sensor_acq_timespec_add(&next, period_ns);
+        uint64_t deadline = (uint64_t)next.tv_sec * 1000000000ull + next.tv_nsec;
+        uint64_t now = i2c_bus_now_ns();
+        if (now > deadline) {
+            uint64_t missed = (now - deadline) / period_ns + 1;
+            atomic_fetch_add_explicit(&acq->overruns, missed, memory_order_relaxed);
+            sensor_acq_timespec_add(&next, missed * period_ns);
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {}
+    }
+    return NULL;
+}
+
+/**
+ * Start sampling. Pinning and SCHED_FIFO need CAP_SYS_NICE; without it the
+ * thread falls back to the default policy with a warning.
+ * Returns 0 on success, -1 on failure.
+ */
+int sensor_acq_start(sensor_acq_t *acq) {
+    if (sem_init(&acq->done, 0, 0) != 0) {
+        perror("sem_init");
+        return -1;
+    }
+    atomic_store(&acq->running, 1);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (acq->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(acq->cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof set, &set);
+    }
+    if (acq->priority > 0) {
+        struct sched_param sp = { .sched_priority = acq->priority };
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &sp);
+    }
+    int err = pthread_create(&acq->thread, &attr, sensor_acq_main, acq);
+    if (err == EPERM) {
+        fprintf(stderr, "sensor_acq: no permission for SCHED_FIFO/affinity, using defaults\n");
+        pthread_attr_destroy(&attr);
+        pthread_attr_init(&attr);
+        err = pthread_create(&acq->thread, &attr, sensor_acq_main, acq);
+    }
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        perror("pthread_create");
+        sem_destroy(&acq->done);
+        return -1;
+    }
+    return 0;
+}
+
+void sensor_acq_stop(sensor_acq_t *acq) {
+    atomic_store(&acq->running, 0);
+    pthread_join(acq->thread, NULL);
+    sem_destroy(&acq->done);
+}
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Single-producer / single-consumer ring of fixed-size elements.
+ *
+ * Lock-free and allocation-free after spsc_init(). Producer and consumer
+ * indices live on separate cache lines, and each side keeps a cached copy of
+ * the other's index so the shared line is only touched when the cached view
+ * says full / empty. A push into a full ring is dropped and counted rather
+ * than blocking the producer.
+ */
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPSC_CACHE_LINE 64
+
+typedef struct {
+    alignas(SPSC_CACHE_LINE) atomic_size_t head;    // next slot to write
+    size_t tail_cache;                              // producer's view of tail
+    atomic_ulong dropped;                           // pushes into a full ring
+
+    alignas(SPSC_CACHE_LINE) atomic_size_t tail;    // next slot to read
+    size_t head_cache;                              // consumer's view of head
+
+    alignas(SPSC_CACHE_LINE) size_t mask;
+    size_t elem_size;
+    uint8_t *data;
+} spsc_ring_t;
+
+/**
+ * Allocate room for `capacity` elements (rounded up to a power of two).
+ * Returns 0 on success, -1 on failure.
+ */
+int spsc_init(spsc_ring_t *r, size_t capacity, size_t elem_size) {
+    size_t cap = 1;
+    while (cap < capacity) cap <<= 1;
+    memset(r, 0, sizeof *r);
+    r->mask = cap - 1;
+    r->elem_size = elem_size;
+    size_t bytes = (cap * elem_size + SPSC_CACHE_LINE - 1) & ~(size_t)(SPSC_CACHE_LINE - 1);
+    r->data = aligned_alloc(SPSC_CACHE_LINE, bytes);
+    if (!r->data) {
+        perror("spsc_init");
+        return -1;
+    }
+    return 0;
+}
+
+void spsc_free(spsc_ring_t *r) {
+    free(r->data);
+    r->data = NULL;
+}
+
+/* Producer side. Returns 0, or -1 (and counts a drop) if the ring is full. */
+int spsc_push(spsc_ring_t *r, const void *elem) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - r->tail_cache > r->mask) {
+        r->tail_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (head - r->tail_cache > r->mask) {
+            atomic_store_explicit(&r->dropped, atomic_load_explicit(&r->dropped, memory_order_relaxed) + 1,
+                                  memory_order_relaxed);
+            return -1;
+        }
+    }
+    memcpy(r->data + (head & r->mask) * r->elem_size, elem, r->elem_size);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return 0;
+}
+
+/* Consumer side. Returns 0, or -1 if the ring is empty. */
+int spsc_pop(spsc_ring_t *r, void *elem) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (tail == r->head_cache) {
+        r->head_cache = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (tail == r->head_cache) return -1;
+    }
+    memcpy(elem, r->data + (tail & r->mask) * r->elem_size, r->elem_size);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+/* Elements waiting; exact on the consumer side, a snapshot elsewhere */
+size_t spsc_size(spsc_ring_t *r) {
+    return atomic_load_explicit(&r->head, memory_order_acquire) -
+           atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+unsigned long spsc_dropped(spsc_ring_t *r) {
+    return atomic_load_explicit(&r->dropped, memory_order_relaxed);
+}
+
+#endif
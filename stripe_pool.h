@@ -0,0 +1,149 @@
+/*
+ * Persistent worker pool for stripe-parallel image processing.
+ *
+ * The threads are created once. Each stripe_pool_run() splits `rows` into
+ * stripes that workers (and the calling thread) claim from an atomic
+ * counter until none are left, so faster cores simply take more stripes.
+ * The call returns only after every stripe is done, which makes it the
+ * barrier before the result is used. With one thread there are no workers
+ * and the job runs inline on the caller.
+ */
+#ifndef STRIPE_POOL_H
+#define STRIPE_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STRIPE_POOL_MAX_THREADS 16
+// Input + output bytes per stripe: small enough that a stripe stays in
+// cache while it is converted, large enough to amortize the claim.
+#define STRIPE_POOL_STRIPE_BYTES (64 * 1024)
+#define STRIPE_POOL_MIN_STRIPES_PER_THREAD 4
+
+/* Process rows [first, first + count) */
+typedef void (*stripe_fn)(void *ctx, int first, int count);
+
+typedef struct {
+    pthread_t threads[STRIPE_POOL_MAX_THREADS];
+    int nthreads;               // including the caller of stripe_pool_run()
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned gen;               // bumped for every job
+    int active;                 // workers not yet finished with the job
+    int stop;
+
+    // Current job.
+    stripe_fn fn;
+    void *ctx;
+    int rows;
+    int stripe_rows;
+    atomic_int next;            // next unclaimed row
+} stripe_pool_t;
+
+static void stripe_pool_work(stripe_pool_t *pool) {
+    for (;;) {
+        int first = atomic_fetch_add_explicit(&pool->next, pool->stripe_rows, memory_order_relaxed);
+        if (first >= pool->rows) return;
+        int count = pool->rows - first < pool->stripe_rows ? pool->rows - first : pool->stripe_rows;
+        pool->fn(pool->ctx, first, count);
+    }
+}
+
+static void *stripe_pool_main(void *arg) {
+    stripe_pool_t *pool = arg;
+    unsigned seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->gen == seen && !pool->stop) pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->stop) break;
+        seen = pool->gen;
+        pthread_mutex_unlock(&pool->lock);
+
+        stripe_pool_work(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/**
+ * Start `nthreads - 1` workers; 0 means one thread per online CPU. Fewer
+ * workers are kept if thread creation fails.
+ * Returns the number of threads in use, including the caller.
+ */
+int stripe_pool_init(stripe_pool_t *pool, int nthreads) {
+    memset(pool, 0, sizeof *pool);
+    if (nthreads <= 0) nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > STRIPE_POOL_MAX_THREADS) nthreads = STRIPE_POOL_MAX_THREADS;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->nthreads = 1;
+    while (pool->nthreads < nthreads) {
+        if (pthread_create(&pool->threads[pool->nthreads - 1], NULL, stripe_pool_main, pool) != 0) {
+            perror("stripe_pool: pthread_create");
+            break;
+        }
+        pool->nthreads++;
+    }
+    return pool->nthreads;
+}
+
+/**
+ * Stripe height for rows of `row_bytes` (input + output): about
+ * STRIPE_POOL_STRIPE_BYTES per stripe, but at least a few stripes per
+ * thread so uneven cores still balance out.
+ */
+int stripe_pool_rows_for(const stripe_pool_t *pool, int rows, size_t row_bytes) {
+    int stripe = row_bytes ? (int)(STRIPE_POOL_STRIPE_BYTES / row_bytes) : rows;
+    int balanced = rows / (pool->nthreads * STRIPE_POOL_MIN_STRIPES_PER_THREAD);
+    if (pool->nthreads > 1 && stripe > balanced) stripe = balanced;
+    return stripe < 1 ? 1 : stripe;
+}
+
+/* Run `fn` over rows [0, rows) in stripes of `stripe_rows` and wait for it */
+void stripe_pool_run(stripe_pool_t *pool, int rows, int stripe_rows, stripe_fn fn, void *ctx) {
+    if (stripe_rows < 1) stripe_rows = rows;
+    if (pool->nthreads == 1) {
+        fn(ctx, 0, rows);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->rows = rows;
+    pool->stripe_rows = stripe_rows;
+    atomic_store_explicit(&pool->next, 0, memory_order_relaxed);
+    pool->active = pool->nthreads - 1;
+    pool->gen++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    stripe_pool_work(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void stripe_pool_destroy(stripe_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nthreads - 1; i++) pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    pool->nthreads = 1;
+}
+
+#endif
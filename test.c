@@ -0,0 +1,818 @@
+// Driver tests on the simulated bus; runs on any Linux box.
+//
+//   make test
+//
+// Each test drives a driver against the register models in i2c_sim.h and
+// checks the chip state and the bus traffic it took to get there.
+#include "i2c_bus.h"
+#include "i2c_sim.h"
+#include "i2cp.h"
+#include "as5600.h"
+#include "mpu6050.h"
+#include "i2c_worker.h"
+#include "yuyv.h"
+#include "blob.h"
+#include "framerec.h"
+#include <stdint.h>
+
+// Host stand-ins for the wiringPi calls the drivers make.
+void delay(unsigned int ms) { usleep(ms * 1000); }
+unsigned long long piMicros64(void) { return i2c_bus_now_ns() / 1000; }
+static void (*isr_handler)(void);  // the edge handler a test fires by hand
+int wiringPiISR(int pin, int mode, void (*fn)(void)) {
+  (void)pin;
+  (void)mode;
+  isr_handler = fn;
+  return 0;
+}
+int wiringPiISRStop(int pin) { (void)pin; return 0; }
+int piHiPri(const int pri) { (void)pri; return 0; }
+
+static int failures;
+
+static void check(int ok, const char* test, const char* what) {
+  if (ok) return;
+  failures++;
+  fprintf(stderr, "%s: %s\n", test, what);
+}
+
+// A channel update is one auto-increment block write: ON_L, ON_H, OFF_L,
+// OFF_H land in LEDn in one transaction instead of four byte writes.
+static void test_pca_block_write(void) {
+  i2c_sim_t sim;
+  i2c_sim_pca9685_t sim_pca;
+  i2c_bus_t bus;
+  i2c_sim_init(&sim);
+  i2c_sim_pca9685_init(&sim_pca, 0x40);
+  i2c_sim_attach(&sim, &sim_pca.dev);
+  i2c_sim_open_bus(&bus, &sim, 0);
+  PCA9685 pca = pca_new_on_bus(&bus, 0x40);
+  check(sim_pca.dev.regs[MODE1] & AI, "pca block write", "MODE1.AI not set by init");
+
+  // Every byte differs from the zeroed outputs init leaves, so all four go out.
+  for (int channel = 0; channel < PCA_CHANNELS; channel++) {
+    uint16_t on = 0x101 + channel, off = 0x802 + 16 * channel;
+    unsigned long ioctls = bus.total.ioctls, xacts = sim.transactions, bytes = sim.bytes;
+    pca_set_pwm(&pca, channel, on, off);
+    const uint8_t* led = sim_pca.dev.regs + LED0_ON_L + 4 * channel;
+    check(led[0] == (on & 0xFF) && led[1] == on >> 8 && led[2] == (off & 0xFF) && led[3] == off >> 8,
+          "pca block write", "LEDn registers do not hold the value written");
+    check(bus.total.ioctls - ioctls == 1, "pca block write", "channel update took more than one ioctl");
+    check(sim.transactions - xacts == 1, "pca block write", "channel update took more than one transaction");
+    check(sim.bytes - bytes == 5, "pca block write", "channel update is not register + 4 data bytes");
+  }
+  // The neighbours of every channel kept their own values.
+  for (int channel = 0; channel < PCA_CHANNELS; channel++) {
+    uint16_t on, off;
+    i2c_sim_pca9685_channel(&sim_pca, channel, &on, &off);
+    check(on == 0x101 + channel && off == 0x802 + 16 * channel, "pca block write", "a channel was overwritten");
+  }
+
+  unsigned long ioctls = bus.total.ioctls;
+  pca_set_all_pwm(&pca, 0x12, 0x345);
+  check(bus.total.ioctls - ioctls == 1, "pca block write", "ALL_LED update took more than one ioctl");
+  for (int channel = 0; channel < PCA_CHANNELS; channel++) {
+    uint16_t on, off;
+    i2c_sim_pca9685_channel(&sim_pca, channel, &on, &off);
+    check(on == 0x12 && off == 0x345, "pca block write", "ALL_LED update missed a channel");
+  }
+}
+
+// Pulse widths in ms clamp to the channel's limits, however far out of
+// range, instead of overflowing the conversion to microseconds.
+static void test_pca_pwm_ms_clamp(void) {
+  i2c_sim_t sim;
+  i2c_sim_pca9685_t sim_pca;
+  i2c_bus_t bus;
+  i2c_sim_init(&sim);
+  i2c_sim_pca9685_init(&sim_pca, 0x40);
+  i2c_sim_attach(&sim, &sim_pca.dev);
+  i2c_sim_open_bus(&bus, &sim, 0);
+  PCA9685 pca = pca_new_on_bus(&bus, 0x40);
+  pca_set_pwm_freq(&pca, 50);
+  pca_set_servo_limits(&pca, 0, 500, 2500);
+
+  static const double huge[] = { 2.6, 1e7, 1e300, INFINITY };
+  for (size_t i = 0; i < sizeof huge / sizeof huge[0]; i++) {
+    uint16_t on, off;
+    pca_set_pwm_ms(&pca, 0, huge[i]);
+    i2c_sim_pca9685_channel(&sim_pca, 0, &on, &off);
+    check(off == pca.cal[0].max_ticks, "pca pwm ms clamp", "long pulse not clamped to max_us");
+  }
+  static const double tiny[] = { 0.1, 0, -1e300, NAN };
+  for (size_t i = 0; i < sizeof tiny / sizeof tiny[0]; i++) {
+    uint16_t on, off;
+    pca_set_pwm_ms(&pca, 0, tiny[i]);
+    i2c_sim_pca9685_channel(&sim_pca, 0, &on, &off);
+    check(off == pca.cal[0].min_ticks, "pca pwm ms clamp", "short or NaN pulse not clamped to min_us");
+  }
+}
+
+// Feeds a shaft turning at a constant `counts_per_s` from angle 0, one
+// sample a millisecond, and returns the tracker's velocity at the end.
+static int32_t tracker_run(as5600_tracker_t* trk, int counts_per_s, int samples, uint64_t* t_us) {
+  as5600_tracker_update(trk, 0, *t_us);
+  for (int i = 0; i < samples; i++) {
+    *t_us += 1000;
+    int64_t pos = (int64_t)counts_per_s * (int64_t)*t_us / 1000000;
+    as5600_tracker_update(trk, (uint16_t)(pos & (AS5600_MAX_ANGLE - 1)), *t_us);
+  }
+  return as5600_tracker_velocity(trk);
+}
+
+// Unwrapping across 0/4095 in both directions, the restart after a long
+// gap, and convergence on a constant velocity of either sign.
+static void test_as5600_tracker(void) {
+  as5600_tracker_t trk;
+  as5600_tracker_init(&trk, AS5600_TRACKER_ALPHA_Q16, AS5600_TRACKER_BETA_Q16);
+  static const uint16_t fwd[] = { 4090, 4095, 4, 10 };
+  for (int i = 0; i < 4; i++) as5600_tracker_update(&trk, fwd[i], 1000 * (i + 1));
+  check(as5600_tracker_position(&trk) == 4106, "as5600 tracker", "forward wrap not unwrapped");
+  static const uint16_t back[] = { 2, 4093, 4000 };
+  for (int i = 0; i < 3; i++) as5600_tracker_update(&trk, back[i], 1000 * (i + 5));
+  check(as5600_tracker_position(&trk) == 4000, "as5600 tracker", "backward wrap not unwrapped");
+
+  // After a gap longer than the filter window only the position survives.
+  as5600_tracker_update(&trk, 4010, 7000 + AS5600_TRACKER_MAX_DT_US + 1);
+  check(as5600_tracker_velocity(&trk) == 0 && trk.pos_q16 == as5600_tracker_position(&trk) * 65536,
+        "as5600 tracker", "long gap did not restart the filter");
+
+  // The fixed-point update rounds toward zero, so both directions settle
+  // on the same magnitude.
+  int32_t vel[2];
+  for (int i = 0; i < 2; i++) {
+    int sign = i ? -1 : 1;
+    uint64_t t_us = 0;
+    as5600_tracker_init(&trk, AS5600_TRACKER_ALPHA_Q16, AS5600_TRACKER_BETA_Q16);
+    vel[i] = tracker_run(&trk, sign * 5000, 2000, &t_us);
+    check(abs(vel[i] - sign * 5000) <= 2, "as5600 tracker", "velocity did not converge on a constant speed");
+    check(as5600_tracker_position(&trk) == sign * 10000, "as5600 tracker", "position drifted across wraps");
+  }
+  check(vel[0] == -vel[1], "as5600 tracker", "velocity is biased towards one direction");
+}
+
+// Init puts the config registers back to the defaults it caches, whatever
+// a previous run left in them; a failed read leaves the outputs alone.
+static void test_mpu_init(void) {
+  i2c_sim_t sim;
+  i2c_sim_mpu6050_t sim_mpu;
+  i2c_bus_t bus;
+  i2c_sim_init(&sim);
+  i2c_sim_mpu6050_init(&sim_mpu, MPU6050_ADDR);
+  i2c_sim_attach(&sim, &sim_mpu.dev);
+  i2c_sim_open_bus(&bus, &sim, 0);
+  const uint8_t stale[4] = { 9, FILTER_BW_42, GYRO_RANGE_2000, ACCEL_RANGE_16G };
+  memcpy(sim_mpu.dev.regs + SMPLRT_DIV, stale, sizeof stale);
+
+  mpu6050_t mpu;
+  check(mpu6050_init_on_bus(&bus, &mpu) == 0, "mpu init", "init failed");
+  const uint8_t* cfg = sim_mpu.dev.regs + SMPLRT_DIV;
+  check(cfg[0] == 0 && cfg[1] == FILTER_BW_256 && cfg[2] == GYRO_RANGE_250 && cfg[3] == ACCEL_RANGE_2G,
+        "mpu init", "config registers not reset to the defaults");
+  check(mpu.accel_range == ACCEL_RANGE_2G && mpu.gyro_range == GYRO_RANGE_250 && mpu.smplrt_div == 0,
+        "mpu init", "cached config does not match the chip");
+
+  // Nothing at this address: every transfer NACKs.
+  mpu6050_t absent = mpu;
+  i2c_bus_t empty;
+  i2c_sim_t nobody;
+  i2c_sim_init(&nobody);
+  i2c_sim_open_bus(&empty, &nobody, 0);
+  absent.bus = &empty;
+  float x = 1, y = 2, z = 3;
+  check(mpu6050_get_accel(&absent, &x, &y, &z, 1) == -1, "mpu init", "failed accel read reported success");
+  check(x == 1 && y == 2 && z == 3, "mpu init", "failed accel read changed the outputs");
+  check(mpu6050_get_gyro(&absent, &x, &y, &z) == -1, "mpu init", "failed gyro read reported success");
+  check(x == 1 && y == 2 && z == 3, "mpu init", "failed gyro read changed the outputs");
+}
+
+static void mpu_sim_push(i2c_sim_mpu6050_t* sim_mpu, int n, int16_t* next) {
+  for (int i = 0; i < n; i++, (*next)++) {
+    int16_t v[7] = { *next, (int16_t)-*next, 100, 200, (int16_t)(*next * 3), -7, 1 };
+    i2c_sim_mpu6050_sample(sim_mpu, v);
+  }
+}
+
+// FIFO frames come out whole and oldest first, across partial drains; a
+// full FIFO is reset and reported rather than returning misaligned frames.
+static void test_mpu_fifo(void) {
+  i2c_sim_t sim;
+  i2c_sim_mpu6050_t sim_mpu;
+  i2c_bus_t bus;
+  i2c_sim_init(&sim);
+  i2c_sim_mpu6050_init(&sim_mpu, MPU6050_ADDR);
+  i2c_sim_attach(&sim, &sim_mpu.dev);
+  i2c_sim_open_bus(&bus, &sim, 0);
+  mpu6050_t mpu;
+  mpu6050_init_on_bus(&bus, &mpu);
+  mpu6050_fifo_start(&mpu, 9);
+
+  int16_t next = 1, want = 1;
+  mpu6050_sample_t out[8];
+  int overflow;
+  mpu_sim_push(&sim_mpu, 5, &next);
+  int got = mpu6050_fifo_drain(&mpu, out, 3, &overflow);
+  check(got == 3 && !overflow, "mpu fifo", "partial drain returned the wrong count");
+  got += mpu6050_fifo_drain(&mpu, out + 3, 8, &overflow);
+  check(got == 5 && !overflow, "mpu fifo", "second drain did not return the rest");
+  for (int i = 0; i < got; i++, want++) {
+    check(out[i].accel_raw[0] == want && out[i].accel_raw[1] == -want && out[i].temp_raw == 200 &&
+              out[i].gyro_raw[0] == want * 3 && out[i].gyro_raw[2] == 1,
+          "mpu fifo", "frames out of order or misaligned");
+  }
+  check(mpu6050_fifo_drain(&mpu, out, 8, &overflow) == 0, "mpu fifo", "empty FIFO returned frames");
+
+  // 80 frames are 1120 bytes: the FIFO fills and drops partial frames.
+  mpu_sim_push(&sim_mpu, 80, &next);
+  check(mpu6050_fifo_drain(&mpu, out, 8, &overflow) == 0 && overflow, "mpu fifo", "overflow not reported");
+  check(sim_mpu.fifo_count == 0, "mpu fifo", "overflow did not reset the FIFO");
+  want = next;
+  mpu_sim_push(&sim_mpu, 2, &next);
+  got = mpu6050_fifo_drain(&mpu, out, 8, &overflow);
+  check(got == 2 && !overflow && out[0].accel_raw[0] == want && out[1].accel_raw[0] == want + 1, "mpu fifo",
+        "frames after the reset are misaligned");
+}
+
+// The DATA_RDY handler only stamps the edge; the read happens on the thread
+// that waits, and edges it had no time for are counted, not queued.
+static void test_mpu_data_ready(void) {
+  i2c_sim_t sim;
+  i2c_sim_mpu6050_t sim_mpu;
+  i2c_bus_t bus;
+  i2c_sim_init(&sim);
+  i2c_sim_mpu6050_init(&sim_mpu, MPU6050_ADDR);
+  i2c_sim_attach(&sim, &sim_mpu.dev);
+  i2c_sim_open_bus(&bus, &sim, 0);
+  mpu6050_t mpu;
+  mpu6050_init_on_bus(&bus, &mpu);
+  check(mpu6050_enable_data_ready(&mpu, 17) == 0 && isr_handler, "mpu data ready", "enable failed");
+  if (!isr_handler) return;
+
+  int16_t next = 42;
+  mpu_sim_push(&sim_mpu, 1, &next);
+  unsigned long ioctls = bus.total.ioctls;
+  isr_handler();
+  isr_handler();
+  check(bus.total.ioctls == ioctls, "mpu data ready", "the interrupt handler touched the bus");
+  check(mpu6050_data_ready_missed() == 1, "mpu data ready", "second edge not counted as missed");
+
+  mpu6050_sample_t sample;
+  check(mpu6050_wait_data_ready(&mpu, 100, &sample) == 0, "mpu data ready", "wait missed the edge");
+  check(sample.accel_raw[0] == 42 && sample.t_us != 0, "mpu data ready", "sample not read or not stamped");
+  check(mpu6050_wait_data_ready(&mpu, 10, &sample) == -1, "mpu data ready", "wait returned without an edge");
+  mpu6050_disable_data_ready(&mpu, 17);
+  isr_handler = NULL;
+}
+
+typedef struct {
+  i2c_worker_t* worker;
+  atomic_int started;
+  atomic_int release;         // 0: hold until the worker stops
+} hold_t;
+
+// Holds the worker inside its batch until released or stopped.
+static int hold_worker(i2c_bus_t* bus, void* ctx) {
+  (void)bus;
+  hold_t* hold = ctx;
+  atomic_store(&hold->started, 1);
+  while (atomic_load(&hold->worker->running) && !atomic_load(&hold->release)) usleep(100);
+  return 0;
+}
+
+// Every request completes: while the worker sleeps and wakes between
+// submits, and with an error for whatever is still queued at the stop.
+static void test_worker_completion(void) {
+  i2c_sim_t sim;
+  i2c_sim_mpu6050_t sim_mpu;
+  i2c_bus_t bus;
+  i2c_sim_init(&sim);
+  i2c_sim_mpu6050_init(&sim_mpu, MPU6050_ADDR);
+  i2c_sim_attach(&sim, &sim_mpu.dev);
+  i2c_sim_open_bus(&bus, &sim, 0);
+  i2c_worker_t w;
+  check(i2c_worker_start(&w, &bus) == 0, "worker completion", "start failed");
+
+  uint8_t pwr = 0;  // PWR_MGMT_1 after reset: asleep
+  atomic_int flag;
+  int lost = 0;
+  for (int i = 0; i < 2000 && !lost; i++) {
+    i2c_worker_read(&w, I2C_PRIO_CONTROL, MPU6050_ADDR, PWR_MGMT_1, &pwr, 1, &flag);
+    for (int spin = 0; atomic_load(&flag) == 0; spin++) {
+      if (spin == 100000) lost = 1;
+      if (lost) break;
+      usleep(10);
+    }
+  }
+  check(!lost, "worker completion", "a request submitted to an idle worker never completed");
+  check(pwr == 0x40, "worker completion", "read returned the wrong PWR_MGMT_1");
+
+  // The low-priority request is already in the batch when the two urgent
+  // ones arrive, so they are still queued when the worker stops.
+  hold_t hold = { .worker = &w };
+  atomic_int held, queued[2];
+  i2c_req_t req = { .op = I2C_OP_CUSTOM, .issue = hold_worker, .ctx = &hold, .flag = &held };
+  i2c_worker_submit(&w, I2C_PRIO_TELEMETRY, &req);
+  while (!atomic_load(&hold.started)) usleep(100);
+  i2c_worker_read(&w, I2C_PRIO_ACTUATION, MPU6050_ADDR, PWR_MGMT_1, &pwr, 1, &queued[0]);
+  i2c_worker_read(&w, I2C_PRIO_CONTROL, MPU6050_ADDR, PWR_MGMT_1, &pwr, 1, &queued[1]);
+  i2c_worker_stop(&w);
+  check(atomic_load(&held) == 1, "worker completion", "the batch in flight did not complete");
+  check(atomic_load(&queued[0]) == -1 && atomic_load(&queued[1]) == -1, "worker completion",
+        "requests queued at the stop did not fail");
+  check(i2c_worker_read(&w, I2C_PRIO_CONTROL, MPU6050_ADDR, PWR_MGMT_1, &pwr, 1, &flag) == -1,
+        "worker completion", "submit after the stop was accepted");
+}
+
+// Every kernel this CPU runs matches the scalar reference, at sizes that
+// hit the vector bodies, the scalar tails, and both.
+static void test_yuyv_kernels(void) {
+  static const size_t sizes[] = { 2, 16, 34, 1000, 4096 };
+  int ran = 0;
+  for (size_t k = 0; k < YUYV_NKERNELS; k++) {
+    const yuyv_kernel_t* kern = &yuyv_kernels[k];
+    if (!kern->supported()) continue;
+    ran++;
+    for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+      char what[64];
+      snprintf(what, sizeof what, "%s rgb differs at %zu pixels", kern->name, sizes[i]);
+      check(yuyv_check(kern->fn, 16, sizes[i]) == 0, "yuyv kernels", what);
+      snprintf(what, sizeof what, "%s gray/half differs at %zu pixels", kern->name, sizes[i]);
+      check(yuyv_check_extract(kern, 16, sizes[i]) == 0, "yuyv kernels", what);
+    }
+  }
+  check(ran > 0, "yuyv kernels", "no kernel is supported");
+}
+
+// Exact 4x4 box mean of Y around output pixel `i`, or of U (c = 1) or
+// V (c = 3) over the 16 source pairs under output pair `i / 2`.
+static int box4(const uint8_t* src, size_t stride, size_t i, int c) {
+  int sum = 0;
+  for (int row = 0; row < 4; row++) {
+    const uint8_t* r = src + row * stride;
+    for (int k = 0; k < 4; k++) sum += c ? r[(i / 2) * 16 + 4 * k + c] : r[i * 8 + 2 * k];
+  }
+  return (sum + 8) >> 4;
+}
+
+// The widest region at every scale and format, against the scalar kernels
+// applied by hand: straight conversions at scale 1, one yuyv_half per row at
+// scale 2, and an exact 4x4 box mean at scale 4.
+static void test_yuyv_extract_widest(void) {
+  enum { W = YUYV_MAX_WIDTH, H = 8, STRIDE = W * 2 };
+  uint8_t* src = malloc(STRIDE * H);
+  uint8_t* got = malloc(W * H * 3);
+  uint8_t* want = malloc(W * 3);
+  uint8_t* half = malloc(STRIDE);
+  uint8_t* yuv4 = malloc(W / 2 * H / 4);
+  uint32_t x = 0x1234567u;
+  for (size_t i = 0; i < STRIDE * H; i++) {
+    x = x * 1664525u + 1013904223u;
+    src[i] = x >> 24;
+  }
+  yuyv_init();
+  yuyv_rect_t rect = { 0, 0, W, H };
+  static const yuyv_format_t formats[] = { YUYV_GRAY, YUYV_YUV, YUYV_RGB };
+  for (unsigned scale = 1; scale <= 4; scale *= 2) {
+    check(yuyv_extract_valid(&rect, W, H, scale), "yuyv extract widest", "widest region rejected");
+    size_t out_w = W / scale;
+    for (size_t f = 0; f < 3; f++) {
+      yuyv_format_t format = formats[f];
+      yuyv_extract_rows(src, STRIDE, &rect, scale, format, got, 0, H / scale);
+      int same = 1, near = 1;
+      for (size_t y = 0; y < H / scale; y++) {
+        const uint8_t* row = src + y * scale * STRIDE;
+        const uint8_t* out = got + y * out_w * format;
+        if (scale == 1) {
+          if (format == YUYV_GRAY) yuyv_to_gray_scalar(row, want, out_w);
+          else if (format == YUYV_YUV) memcpy(want, row, STRIDE);
+          else yuyv_to_rgb_scalar(row, want, out_w);
+          same &= memcmp(out, want, out_w * format) == 0;
+        } else if (scale == 2) {
+          yuyv_half_scalar(row, row + STRIDE, half, out_w);
+          if (format == YUYV_GRAY) yuyv_half_gray_scalar(row, row + STRIDE, want, out_w);
+          else if (format == YUYV_YUV) memcpy(want, half, out_w * 2);
+          else yuyv_to_rgb_scalar(half, want, out_w);
+          same &= memcmp(out, want, out_w * format) == 0;
+        } else if (format == YUYV_RGB) {
+          // Converted from the YUYV this scale gives, which is checked below.
+          yuyv_extract_rows(src, STRIDE, &rect, scale, YUYV_YUV, yuv4, 0, H / scale);
+          yuyv_to_rgb_scalar(yuv4 + y * out_w * 2, want, out_w);
+          same &= memcmp(out, want, out_w * 3) == 0;
+        } else {
+          for (size_t i = 0; i < out_w; i++) {
+            int y_got = format == YUYV_GRAY ? out[i] : out[2 * i];
+            near &= abs(y_got - box4(row, STRIDE, i, 0)) <= 1;
+            if (format == YUYV_YUV) near &= abs(out[2 * i + 1] - box4(row, STRIDE, i, i % 2 ? 3 : 1)) <= 1;
+          }
+        }
+      }
+      char what[64];
+      snprintf(what, sizeof what, "scale %u format %d differs from the reference", scale, (int)format);
+      check(same && near, "yuyv extract widest", what);
+    }
+  }
+  free(src);
+  free(got);
+  free(want);
+  free(half);
+  free(yuv4);
+}
+
+enum { BLOB_MAX_W = 64, BLOB_MAX_H = 16, BLOB_MAX_OUT = BLOB_MAX_W * BLOB_MAX_H / 2 };
+
+typedef struct {
+  unsigned w, h;
+  size_t stride;
+  uint8_t yuyv[BLOB_MAX_H][BLOB_MAX_W * 2];
+  uint8_t on[BLOB_MAX_H][BLOB_MAX_W];
+} blob_frame_t;
+
+// Y is 255 on '#' and 0 elsewhere; chroma is neutral, and the range only
+// looks at Y. A row of odd width is padded to a whole pair.
+static void blob_frame(blob_frame_t* f, const char* const* rows, unsigned h) {
+  memset(f, 0, sizeof *f);
+  f->w = strlen(rows[0]);
+  f->h = h;
+  f->stride = (f->w + 1) / 2 * 4;
+  for (unsigned y = 0; y < h; y++) {
+    for (unsigned x = 0; x < (f->w + 1) / 2 * 2; x++) {
+      f->on[y][x] = x < f->w && rows[y][x] == '#';
+      f->yuyv[y][2 * x] = f->on[y][x] ? 255 : 0;
+      f->yuyv[y][2 * x + 1] = 128;
+    }
+  }
+}
+
+// Flood fill over the same mask, blobs in raster order of their first
+// pixel, then stably sorted by area: the order blob_find promises. The last
+// column of an odd width has no chroma pair and is never thresholded.
+static int blob_reference(const blob_frame_t* f, unsigned min_area, blob_t* out) {
+  static int seen[BLOB_MAX_H][BLOB_MAX_W], stack[BLOB_MAX_H * BLOB_MAX_W];
+  unsigned w = f->w & ~1u;
+  int n = 0;
+  memset(seen, 0, sizeof seen);
+  for (unsigned y0 = 0; y0 < f->h; y0++) {
+    for (unsigned x0 = 0; x0 < w; x0++) {
+      if (!f->on[y0][x0] || seen[y0][x0]) continue;
+      blob_t b = { 0, 0, 0, x0, y0, x0, y0 };
+      double sx = 0, sy = 0;
+      int top = 0;
+      stack[top++] = y0 * BLOB_MAX_W + x0;
+      seen[y0][x0] = 1;
+      while (top) {
+        unsigned y = stack[--top] / BLOB_MAX_W, x = stack[top] % BLOB_MAX_W;
+        b.area++;
+        sx += x;
+        sy += y;
+        if (x < b.x0) b.x0 = x;
+        if (x > b.x1) b.x1 = x;
+        if (y > b.y1) b.y1 = y;
+        for (int dy = -1; dy <= 1; dy++) {
+          for (int dx = -1; dx <= 1; dx++) {
+            int nx = (int)x + dx, ny = (int)y + dy;
+            if (nx < 0 || ny < 0 || nx >= (int)w || ny >= (int)f->h) continue;
+            if (!f->on[ny][nx] || seen[ny][nx]) continue;
+            seen[ny][nx] = 1;
+            stack[top++] = ny * BLOB_MAX_W + nx;
+          }
+        }
+      }
+      if (b.area < min_area) continue;
+      b.cx = sx / b.area;
+      b.cy = sy / b.area;
+      int i = n++;
+      while (i > 0 && out[i - 1].area < b.area) {
+        out[i] = out[i - 1];
+        i--;
+      }
+      out[i] = b;
+    }
+  }
+  return n;
+}
+
+static int blob_same(const blob_t* a, const blob_t* b) {
+  return a->area == b->area && fabsf(a->cx - b->cx) < 1e-4f && fabsf(a->cy - b->cy) < 1e-4f && a->x0 == b->x0 &&
+         a->y0 == b->y0 && a->x1 == b->x1 && a->y1 == b->y1;
+}
+
+// Runs blob_find on `rows` and compares every blob with the flood fill.
+static void blob_expect(const char* what, const char* const* rows, unsigned h) {
+  static blob_frame_t f;
+  blob_frame(&f, rows, h);
+  blob_finder_t bf;
+  blob_range_t range = { 128, 255, 0, 255, 0, 255 };
+  static blob_t got[BLOB_MAX_OUT], want[BLOB_MAX_OUT];
+  check(blob_finder_init(&bf, f.w, f.h, 0) == 0, "blob find", "init failed");
+  int n = blob_find(&bf, f.yuyv[0], sizeof f.yuyv[0], &range, 1, got, BLOB_MAX_OUT);
+  int m = blob_reference(&f, 1, want);
+  int same = n == m;
+  for (int i = 0; same && i < n; i++) same = blob_same(&got[i], &want[i]);
+  char msg[96];
+  snprintf(msg, sizeof msg, "%s: %d blobs, %d expected, or they differ", what, n, m);
+  check(same, "blob find", msg);
+  blob_finder_free(&bf);
+}
+
+// Labeling, merging and ranking on frames small enough to check by hand.
+static void test_blob_find(void) {
+  // Two arms that only join on the last row.
+  static const char* const u_shape[] = {
+    "#...#.",
+    "#...#.",
+    "#...#.",
+    "#####.",
+  };
+  blob_expect("u shape", u_shape, 4);
+  {
+    static blob_frame_t f;
+    blob_frame(&f, u_shape, 4);
+    blob_finder_t bf;
+    blob_range_t range = { 128, 255, 0, 255, 0, 255 };
+    blob_t b;
+    blob_finder_init(&bf, f.w, f.h, 0);
+    int n = blob_find(&bf, f.yuyv[0], sizeof f.yuyv[0], &range, 1, &b, 1);
+    check(n == 1 && b.area == 11 && b.cx == 2.0f && fabsf(b.cy - 21.0f / 11) < 1e-5f && b.x0 == 0 &&
+              b.y0 == 0 && b.x1 == 4 && b.y1 == 3,
+          "blob find", "u shape area, centroid or box wrong");
+    blob_finder_free(&bf);
+  }
+  // Three arms whose labels merge in a different order than they started.
+  static const char* const comb[] = {
+    "#.#.#.#.",
+    "#.#.#.#.",
+    "..###.#.",
+    "#######.",
+  };
+  blob_expect("comb", comb, 4);
+  // Pixels that only touch at corners, both diagonals.
+  static const char* const diagonal[] = {
+    "#.....#.",
+    ".#...#..",
+    "..#.#...",
+    "...#....",
+    "..#.#...",
+  };
+  blob_expect("diagonal", diagonal, 5);
+  // Two blobs one column apart are not neighbours.
+  static const char* const apart[] = {
+    "#.#.",
+    "#.#.",
+  };
+  blob_expect("apart", apart, 2);
+  // Odd width: the unpaired last column is left out.
+  static const char* const odd[] = {
+    "..#####",
+    "......#",
+    "#.....#",
+  };
+  blob_expect("odd width", odd, 3);
+
+  // Random masks at an odd width, across word boundaries of the bitmap.
+  static const char* rows[BLOB_MAX_H];
+  static char text[BLOB_MAX_H][BLOB_MAX_W + 1];
+  uint32_t x = 0xB10Bu;
+  for (int frame = 0; frame < 200; frame++) {
+    for (int y = 0; y < BLOB_MAX_H; y++) {
+      for (int i = 0; i < BLOB_MAX_W - 1; i++) {
+        x = x * 1664525u + 1013904223u;
+        text[y][i] = (x >> 24) < (unsigned)(60 + frame % 80) ? '#' : '.';
+      }
+      text[y][BLOB_MAX_W - 1] = 0;
+      rows[y] = text[y];
+    }
+    blob_expect("random", rows, BLOB_MAX_H);
+  }
+}
+
+// Runs that find no free label are dropped and counted; the blobs that did
+// get labels are still found, without the dropped pixels.
+static void test_blob_overflow(void) {
+  static const char* const rows[] = {
+    "#.#.#.#.#.",
+    "#########.",
+  };
+  static blob_frame_t f;
+  blob_frame(&f, rows, 2);
+  blob_finder_t bf;
+  blob_range_t range = { 128, 255, 0, 255, 0, 255 };
+  blob_t out[4];
+  blob_finder_init(&bf, f.w, f.h, 3);
+  int n = blob_find(&bf, f.yuyv[0], sizeof f.yuyv[0], &range, 1, out, 4);
+  check(bf.overflows == 2, "blob overflow", "dropped runs not counted");
+  check(n == 1 && out[0].area == 12 && out[0].x0 == 0 && out[0].x1 == 8 && out[0].y0 == 0 && out[0].y1 == 1,
+        "blob overflow", "labeled part of the blob wrong");
+  blob_finder_free(&bf);
+}
+
+// Only the largest max_out blobs of at least min_area come back, largest
+// first, equal areas in raster order.
+static void test_blob_ranking(void) {
+  static const char* const rows[] = {
+    "#.##..###.####..",
+    "................",
+    "###.#....##.....",
+    "........#.......",
+  };
+  static blob_frame_t f;
+  blob_frame(&f, rows, 4);
+  blob_finder_t bf;
+  blob_range_t range = { 128, 255, 0, 255, 0, 255 };
+  blob_t out[8];
+  blob_finder_init(&bf, f.w, f.h, 0);
+  for (int max_out = 0; max_out <= 8; max_out++) {
+    static blob_t want[BLOB_MAX_OUT];
+    int m = blob_reference(&f, 2, want);
+    if (m > max_out) m = max_out;
+    int n = blob_find(&bf, f.yuyv[0], sizeof f.yuyv[0], &range, 2, out, max_out);
+    int same = n == m;
+    for (int i = 0; same && i < n; i++) same = blob_same(&out[i], &want[i]);
+    check(same, "blob ranking", "wrong blobs or order after truncation");
+  }
+  // Areas 4, 3, 3, 3 (raster order: x = 6, the row-2 run, the pair with
+  // its diagonal), 2; the single pixels fall under min_area.
+  int n = blob_find(&bf, f.yuyv[0], sizeof f.yuyv[0], &range, 2, out, 3);
+  check(n == 3 && out[0].area == 4 && out[0].x0 == 10 && out[1].area == 3 && out[1].x0 == 6 && out[2].area == 3 &&
+            out[2].x0 == 0 && out[2].y0 == 2,
+        "blob ranking", "top three by area wrong");
+  blob_finder_free(&bf);
+}
+
+typedef struct {
+  PCA9685* pca;
+  uint16_t on[PCA_CHANNELS], off[PCA_CHANNELS];
+  uint16_t mask;
+} frame_t;
+
+static int issue_frame(i2c_bus_t* bus, void* ctx) {
+  (void)bus;
+  frame_t* frame = ctx;
+  return pca_queue_frame(frame->pca, frame->on, frame->off, frame->mask);
+}
+
+// Queues a message and then reports no room: the worker has to take it back.
+static int issue_broken(i2c_bus_t* bus, void* ctx) {
+  static const uint8_t junk = 0x77;
+  (void)ctx;
+  i2c_bus_queue_write(bus, 0x40, LED0_ON_L + 4 + 2, &junk, 1);  // channel 1 OFF_L
+  return -1;
+}
+
+static int recorded_msgs[16], recorded;
+
+static int recording_transfer(void* ctx, struct i2c_msg* msgs, int nmsgs) {
+  if (recorded < 16) recorded_msgs[recorded++] = nmsgs;
+  return i2c_sim_transfer(ctx, msgs, nmsgs);
+}
+
+// A custom request that does not fit the message table goes out in the
+// next batch instead of flushing the current one from inside the worker.
+static void test_worker_custom_budget(void) {
+  i2c_sim_t sim;
+  i2c_sim_pca9685_t sim_pca;
+  i2c_sim_mpu6050_t sim_mpu;
+  i2c_bus_t bus;
+  i2c_sim_init(&sim);
+  i2c_sim_pca9685_init(&sim_pca, 0x40);
+  i2c_sim_mpu6050_init(&sim_mpu, MPU6050_ADDR);
+  i2c_sim_attach(&sim, &sim_pca.dev);
+  i2c_sim_attach(&sim, &sim_mpu.dev);
+  i2c_bus_open_backend(&bus, recording_transfer, &sim, 0);
+  PCA9685 pca = pca_new_on_bus(&bus, 0x40);
+  i2c_worker_t w;
+  i2c_worker_start(&w, &bus);
+
+  // Everything below is queued behind the hold, so it forms one batch.
+  hold_t hold = { .worker = &w };
+  atomic_int held, reads[20], framed, broken;
+  i2c_req_t req = { .op = I2C_OP_CUSTOM, .issue = hold_worker, .ctx = &hold, .flag = &held };
+  i2c_worker_submit(&w, I2C_PRIO_TELEMETRY, &req);
+  while (!atomic_load(&hold.started)) usleep(100);
+  recorded = 0;
+
+  uint8_t pwr[20];
+  for (int i = 0; i < 20; i++) i2c_worker_read(&w, I2C_PRIO_CONTROL, MPU6050_ADDR, PWR_MGMT_1, &pwr[i], 1, &reads[i]);
+  // Every other channel: eight bursts, more than the table has left.
+  frame_t frame = { .pca = &pca, .mask = 0x5555 };
+  for (int channel = 0; channel < PCA_CHANNELS; channel++) frame.off[channel] = 0x100 + channel;
+  req = (i2c_req_t){ .op = I2C_OP_CUSTOM, .issue = issue_frame, .ctx = &frame, .flag = &framed,
+                     .msgs = PCA_FRAME_MAX_MSGS, .len = PCA_FRAME_MAX_BYTES };
+  i2c_worker_submit(&w, I2C_PRIO_CONTROL, &req);
+  req = (i2c_req_t){ .op = I2C_OP_CUSTOM, .issue = issue_broken, .flag = &broken };
+  i2c_worker_submit(&w, I2C_PRIO_CONTROL, &req);
+  atomic_store(&hold.release, 1);
+  while (!atomic_load(&broken)) usleep(100);
+  i2c_worker_stop(&w);
+
+  int ok = 1;
+  for (int i = 0; i < 20; i++) ok &= atomic_load(&reads[i]) == 1;
+  check(ok && atomic_load(&framed) == 1, "worker custom budget", "a request did not complete");
+  check(atomic_load(&broken) == -1, "worker custom budget", "failed custom issue not reported");
+  check(recorded == 2 && recorded_msgs[0] == 40 && recorded_msgs[1] == 8, "worker custom budget",
+        "frame was split across batches or flushed mid-batch");
+  for (int channel = 0; channel < PCA_CHANNELS; channel++) {
+    uint16_t on, off;
+    i2c_sim_pca9685_channel(&sim_pca, channel, &on, &off);
+    if (frame.mask & (1u << channel)) check(off == 0x100 + channel, "worker custom budget", "frame not written");
+    else check(off == 0, "worker custom budget", "rolled-back write reached the chip");
+  }
+}
+
+// Frame i of the recording test: a size that walks through the padding,
+// one frame bigger than the staging buffer, and bytes derived from i.
+static size_t rec_bytes(int i) {
+  return i == 5 ? FRAMEREC_WRITE_BYTES + 100 : (size_t)(i * 37 % 200);
+}
+
+static uint8_t rec_byte(int i, size_t k) {
+  return (uint8_t)(i * 31 + k * 7);
+}
+
+static int rec_frames_ok(const framerec_reader_t* r, int n) {
+  if ((int)r->count != n) return 0;
+  for (int i = 0; i < n; i++) {
+    const framerec_index_t* e = &r->index[i];
+    if (e->seq != (uint32_t)(1000 + i) || e->t_ns != 5000000000ull + i * 33333333ull || e->bytes != rec_bytes(i))
+      return 0;
+    const uint8_t* data = framerec_reader_frame(r, i);
+    for (size_t k = 0; k < e->bytes; k++) {
+      if (data[k] != rec_byte(i, k)) return 0;
+    }
+  }
+  return 1;
+}
+
+// A recording reads back as written, through its index and, with the
+// index and trailer cut off, through the rebuilt one.
+static void test_framerec_roundtrip(void) {
+  enum { N = 24 };
+  char path[] = "/tmp/framerec_testXXXXXX";
+  int fd = mkstemp(path);
+  check(fd >= 0, "framerec", "mkstemp failed");
+  if (fd < 0) return;
+  close(fd);
+
+  framerec_writer_t w;
+  check(framerec_writer_open(&w, path, V4L2_PIX_FMT_YUYV, 64, 48, 128) == 0, "framerec", "open for writing failed");
+  uint8_t* frame = malloc(rec_bytes(5));
+  for (int i = 0; i < N; i++) {
+    for (size_t k = 0; k < rec_bytes(i); k++) frame[k] = rec_byte(i, k);
+    check(framerec_writer_add(&w, frame, rec_bytes(i), 1000 + i, 5000000000ull + i * 33333333ull) == 0,
+          "framerec", "add failed");
+  }
+  free(frame);
+  check(framerec_writer_close(&w) == 0, "framerec", "close failed");
+
+  framerec_reader_t r;
+  check(framerec_reader_open(&r, path) == 0, "framerec", "reopen failed");
+  check(r.rebuilt == NULL, "framerec", "closed file was scanned instead of using its index");
+  check(r.header.fourcc == V4L2_PIX_FMT_YUYV && r.header.width == 64 && r.header.height == 48 &&
+            r.header.stride == 128,
+        "framerec", "header changed");
+  check(rec_frames_ok(&r, N), "framerec", "frames differ from what was written");
+  static framerec_index_t index[N];
+  memcpy(index, r.index, sizeof index);
+  framerec_trailer_t t;
+  memcpy(&t, r.map + r.size - sizeof t, sizeof t);
+  framerec_reader_close(&r);
+
+  // As if the recorder was killed before writing the index.
+  check(truncate(path, t.index_offset) == 0, "framerec", "truncate failed");
+  check(framerec_reader_open(&r, path) == 0, "framerec", "reopen without index failed");
+  check(r.rebuilt != NULL && memcmp(r.index, index, sizeof index) == 0 && rec_frames_ok(&r, N), "framerec",
+        "scan rebuilt a different index");
+  framerec_reader_close(&r);
+
+  // Killed halfway through the last frame: it is left out.
+  check(truncate(path, index[N - 1].offset + sizeof(framerec_frame_t) + rec_bytes(N - 1) / 2) == 0, "framerec",
+        "truncate failed");
+  check(framerec_reader_open(&r, path) == 0, "framerec", "reopen of a torn file failed");
+  check(memcmp(r.index, index, (N - 1) * sizeof *index) == 0 && rec_frames_ok(&r, N - 1), "framerec",
+        "scan of a torn file went wrong");
+  framerec_reader_close(&r);
+  unlink(path);
+}
+
+int main(void) {
+  test_pca_block_write();
+  test_pca_pwm_ms_clamp();
+  test_as5600_tracker();
+  test_mpu_init();
+  test_mpu_fifo();
+  test_mpu_data_ready();
+  test_worker_completion();
+  test_worker_custom_budget();
+  test_yuyv_kernels();
+  test_yuyv_extract_widest();
+  test_blob_find();
+  test_blob_overflow();
+  test_blob_ranking();
+  test_framerec_roundtrip();
+
+  if (failures) {
+    fprintf(stderr, "%d failures\n", failures);
+    return 1;
+  }
+  printf("all tests passed\n");
+  return 0;
+}
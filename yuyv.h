@@ -0,0 +1,616 @@
+/*
+ * YUYV (YUV 4:2:2) → RGB888 conversion.
+ *
+ * BT.601 studio-swing integer math:
+ *   r = (298c + 409e + 128) >> 8
+ *   g = (298c - 100d - 208e + 128) >> 8
+ *   b = (298c + 516d + 128) >> 8
+ * with c = Y - 16, d = U - 128, e = V - 128, clamped to 0..255.
+ *
+ * The scalar kernel is the reference. The SIMD kernels (SSE2 and AVX2 on
+ * x86, NEON on ARM) compute the same sums in 32 bits and clamp them with
+ * saturating packs, so every kernel is bit-exact with the scalar one.
+ * yuyv_init() picks the fastest kernel the CPU supports and first checks
+ * each candidate against the reference on random input.
+ *
+ * Consumers that need less than a full RGB frame skip the conversion:
+ * each kernel set also extracts the Y plane (gray) and halves two YUYV
+ * rows with a 2x2 box filter, either to gray or to a YUYV row of half the
+ * width. yuyv_extract_rows() builds gray or RGB output, full size or
+ * scaled down 2x or 4x, for any region of the frame from these.
+ */
+#ifndef YUYV_H
+#define YUYV_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define YUYV_X86 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define YUYV_NEON 1
+#endif
+
+/* Converts `pixels` pixels (an even count); `rgb` gets 3 * pixels bytes */
+typedef void (*yuyv_to_rgb_fn)(const uint8_t *yuyv, uint8_t *rgb, size_t pixels);
+
+static inline uint8_t yuyv_clamp(int x) {
+    return (uint8_t)(x < 0 ? 0 : x > 255 ? 255 : x);
+}
+
+void yuyv_to_rgb_scalar(const uint8_t *yuyv, uint8_t *rgb, size_t pixels) {
+    for (size_t i = 0; i < pixels * 2; i += 4) {
+        int y0 = yuyv[i + 0], u = yuyv[i + 1], y1 = yuyv[i + 2], v = yuyv[i + 3];
+        int c0 = y0 - 16, c1 = y1 - 16, d = u - 128, e = v - 128;
+        int cr = 409 * e + 128, cg = -100 * d - 208 * e + 128, cb = 516 * d + 128;
+        rgb[0] = yuyv_clamp((298 * c0 + cr) >> 8);
+        rgb[1] = yuyv_clamp((298 * c0 + cg) >> 8);
+        rgb[2] = yuyv_clamp((298 * c0 + cb) >> 8);
+        rgb[3] = yuyv_clamp((298 * c1 + cr) >> 8);
+        rgb[4] = yuyv_clamp((298 * c1 + cg) >> 8);
+        rgb[5] = yuyv_clamp((298 * c1 + cb) >> 8);
+        rgb += 6;
+    }
+}
+
+/* Copies the Y of `pixels` pixels */
+typedef void (*yuyv_to_gray_fn)(const uint8_t *yuyv, uint8_t *gray, size_t pixels);
+/* 2x2 box of rows r0 and r1 → `pixels` output pixels (an even count for YUYV output) */
+typedef void (*yuyv_half_fn)(const uint8_t *r0, const uint8_t *r1, uint8_t *out, size_t pixels);
+
+void yuyv_to_gray_scalar(const uint8_t *yuyv, uint8_t *gray, size_t pixels) {
+    for (size_t i = 0; i < pixels; i++) gray[i] = yuyv[2 * i];
+}
+
+/* Output pixel i averages Y of source pixels 2i, 2i + 1 in both rows */
+void yuyv_half_gray_scalar(const uint8_t *r0, const uint8_t *r1, uint8_t *gray, size_t pixels) {
+    for (size_t i = 0; i < pixels; i++, r0 += 4, r1 += 4) gray[i] = (r0[0] + r0[2] + r1[0] + r1[2] + 2) >> 2;
+}
+
+/*
+ * Output is YUYV again: each output pair averages the two source pairs
+ * under it, Y per pixel and U, V shared, so every byte is a mean of four.
+ */
+void yuyv_half_scalar(const uint8_t *r0, const uint8_t *r1, uint8_t *out, size_t pixels) {
+    for (size_t i = 0; i < pixels * 2; i += 4, r0 += 8, r1 += 8) {
+        out[i + 0] = (r0[0] + r0[2] + r1[0] + r1[2] + 2) >> 2;
+        out[i + 1] = (r0[1] + r0[5] + r1[1] + r1[5] + 2) >> 2;
+        out[i + 2] = (r0[4] + r0[6] + r1[4] + r1[6] + 2) >> 2;
+        out[i + 3] = (r0[3] + r0[7] + r1[3] + r1[7] + 2) >> 2;
+    }
+}
+
+#ifdef YUYV_X86
+// Two int16 coefficients for _mm_madd_epi16: `lo` multiplies the even lane.
+#define YUYV_PAIR(lo, hi) ((int)((uint32_t)(uint16_t)(hi) << 16 | (uint16_t)(lo)))
+
+/*
+ * 8 pixels of YUYV → r, g, b as int16. Each 32-bit lane holds one pixel as
+ * the pairs (c, 1) and (d, e), so one madd gives 298c + 128 and one madd per
+ * channel adds the chroma term.
+ */
+__attribute__((target("sse2")))
+static inline void yuyv_rgb16_sse2(__m128i px, __m128i *r, __m128i *g, __m128i *b) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ymask = _mm_set1_epi32(0xFFFF);
+    const __m128i ybias = _mm_set1_epi32(YUYV_PAIR(-16, 1));
+    const __m128i ky = _mm_set1_epi32(YUYV_PAIR(298, 128));
+    const __m128i kr = _mm_set1_epi32(YUYV_PAIR(0, 409));
+    const __m128i kg = _mm_set1_epi32(YUYV_PAIR(-100, -208));
+    const __m128i kb = _mm_set1_epi32(YUYV_PAIR(516, 0));
+
+    __m128i lo = _mm_unpacklo_epi8(px, zero), hi = _mm_unpackhi_epi8(px, zero);
+    __m128i yl = _mm_madd_epi16(_mm_add_epi16(_mm_and_si128(lo, ymask), ybias), ky);
+    __m128i yh = _mm_madd_epi16(_mm_add_epi16(_mm_and_si128(hi, ymask), ybias), ky);
+    __m128i uv = _mm_packs_epi32(_mm_srli_epi32(lo, 16), _mm_srli_epi32(hi, 16));
+    uv = _mm_sub_epi16(uv, _mm_set1_epi16(128));
+    __m128i del = _mm_unpacklo_epi32(uv, uv), deh = _mm_unpackhi_epi32(uv, uv);
+
+#define YUYV_CHANNEL_SSE2(k)                                                         \
+    _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(yl, _mm_madd_epi16(del, k)), 8), \
+                    _mm_srai_epi32(_mm_add_epi32(yh, _mm_madd_epi16(deh, k)), 8))
+    *r = YUYV_CHANNEL_SSE2(kr);
+    *g = YUYV_CHANNEL_SSE2(kg);
+    *b = YUYV_CHANNEL_SSE2(kb);
+#undef YUYV_CHANNEL_SSE2
+}
+
+/*
+ * 8 pixels per iteration. RGB0 dwords are squeezed to 6 bytes per 64-bit
+ * lane and written with overlapping 8-byte stores; the two spare bytes land
+ * on the next pixel, so the last block is left to the scalar tail.
+ */
+__attribute__((target("sse2")))
+void yuyv_to_rgb_sse2(const uint8_t *yuyv, uint8_t *rgb, size_t pixels) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lo_dw = _mm_set_epi32(0, -1, 0, -1);
+    size_t i = 0;
+    for (; i + 8 < pixels; i += 8) {
+        __m128i r, g, b;
+        yuyv_rgb16_sse2(_mm_loadu_si128((const __m128i *)(yuyv + 2 * i)), &r, &g, &b);
+        __m128i rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_packus_epi16(g, g));
+        __m128i bz = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), zero);
+        __m128i p[2] = { _mm_unpacklo_epi16(rg, bz), _mm_unpackhi_epi16(rg, bz) };
+        uint8_t *out = rgb + 3 * i;
+        for (int k = 0; k < 2; k++) {
+            __m128i v = _mm_or_si128(_mm_and_si128(p[k], lo_dw), _mm_slli_epi64(_mm_srli_epi64(p[k], 32), 24));
+            _mm_storel_epi64((__m128i *)(out + 12 * k), v);
+            _mm_storel_epi64((__m128i *)(out + 12 * k + 6), _mm_srli_si128(v, 8));
+        }
+    }
+    yuyv_to_rgb_scalar(yuyv + 2 * i, rgb + 3 * i, pixels - i);
+}
+
+/* Same math as the SSE2 kernel on both 128-bit lanes, 16 pixels per iteration */
+__attribute__((target("avx2")))
+void yuyv_to_rgb_avx2(const uint8_t *yuyv, uint8_t *rgb, size_t pixels) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ymask = _mm256_set1_epi32(0xFFFF);
+    const __m256i ybias = _mm256_set1_epi32(YUYV_PAIR(-16, 1));
+    const __m256i ky = _mm256_set1_epi32(YUYV_PAIR(298, 128));
+    const __m256i kr = _mm256_set1_epi32(YUYV_PAIR(0, 409));
+    const __m256i kg = _mm256_set1_epi32(YUYV_PAIR(-100, -208));
+    const __m256i kb = _mm256_set1_epi32(YUYV_PAIR(516, 0));
+    // RGB0 x4 → RGB x4 in the low 12 bytes of each lane.
+    const __m256i squeeze = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                             0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    size_t i = 0;
+    for (; i + 16 < pixels; i += 16) {
+        __m256i px = _mm256_loadu_si256((const __m256i *)(yuyv + 2 * i));
+        __m256i lo = _mm256_unpacklo_epi8(px, zero), hi = _mm256_unpackhi_epi8(px, zero);
+        __m256i yl = _mm256_madd_epi16(_mm256_add_epi16(_mm256_and_si256(lo, ymask), ybias), ky);
+        __m256i yh = _mm256_madd_epi16(_mm256_add_epi16(_mm256_and_si256(hi, ymask), ybias), ky);
+        __m256i uv = _mm256_packs_epi32(_mm256_srli_epi32(lo, 16), _mm256_srli_epi32(hi, 16));
+        uv = _mm256_sub_epi16(uv, _mm256_set1_epi16(128));
+        __m256i del = _mm256_unpacklo_epi32(uv, uv), deh = _mm256_unpackhi_epi32(uv, uv);
+
+#define YUYV_CHANNEL_AVX2(k)                                                                  \
+    _mm256_packs_epi32(_mm256_srai_epi32(_mm256_add_epi32(yl, _mm256_madd_epi16(del, k)), 8), \
+                       _mm256_srai_epi32(_mm256_add_epi32(yh, _mm256_madd_epi16(deh, k)), 8))
+        __m256i r = YUYV_CHANNEL_AVX2(kr), g = YUYV_CHANNEL_AVX2(kg), b = YUYV_CHANNEL_AVX2(kb);
+#undef YUYV_CHANNEL_AVX2
+
+        // Lane 0 holds pixels 0..7, lane 1 pixels 8..15.
+        __m256i rg = _mm256_unpacklo_epi8(_mm256_packus_epi16(r, r), _mm256_packus_epi16(g, g));
+        __m256i bz = _mm256_unpacklo_epi8(_mm256_packus_epi16(b, b), zero);
+        __m256i p03 = _mm256_shuffle_epi8(_mm256_unpacklo_epi16(rg, bz), squeeze);
+        __m256i p47 = _mm256_shuffle_epi8(_mm256_unpackhi_epi16(rg, bz), squeeze);
+        uint8_t *out = rgb + 3 * i;
+        _mm_storeu_si128((__m128i *)(out + 0), _mm256_castsi256_si128(p03));
+        _mm_storeu_si128((__m128i *)(out + 12), _mm256_castsi256_si128(p47));
+        _mm_storeu_si128((__m128i *)(out + 24), _mm256_extracti128_si256(p03, 1));
+        _mm_storeu_si128((__m128i *)(out + 36), _mm256_extracti128_si256(p47, 1));
+    }
+    yuyv_to_rgb_scalar(yuyv + 2 * i, rgb + 3 * i, pixels - i);
+}
+
+__attribute__((target("sse2")))
+void yuyv_to_gray_sse2(const uint8_t *yuyv, uint8_t *gray, size_t pixels) {
+    const __m128i ymask = _mm_set1_epi16(0x00FF);
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(yuyv + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(yuyv + 2 * i + 16));
+        _mm_storeu_si128((__m128i *)(gray + i), _mm_packus_epi16(_mm_and_si128(a, ymask), _mm_and_si128(b, ymask)));
+    }
+    yuyv_to_gray_scalar(yuyv + 2 * i, gray + i, pixels - i);
+}
+
+/* 16 source bytes of each row → the 4 averaged Ys as int32 */
+__attribute__((target("sse2")))
+static inline __m128i yuyv_half_y_sse2(__m128i a0, __m128i a1) {
+    const __m128i ymask = _mm_set1_epi16(0x00FF);
+    __m128i y = _mm_add_epi16(_mm_and_si128(a0, ymask), _mm_and_si128(a1, ymask));
+    y = _mm_madd_epi16(y, _mm_set1_epi16(1));
+    return _mm_srli_epi32(_mm_add_epi32(y, _mm_set1_epi32(2)), 2);
+}
+
+__attribute__((target("sse2")))
+void yuyv_half_gray_sse2(const uint8_t *r0, const uint8_t *r1, uint8_t *gray, size_t pixels) {
+    size_t i = 0;
+    for (; i + 8 <= pixels; i += 8, r0 += 32, r1 += 32) {
+        __m128i lo = yuyv_half_y_sse2(_mm_loadu_si128((const __m128i *)r0), _mm_loadu_si128((const __m128i *)r1));
+        __m128i hi = yuyv_half_y_sse2(_mm_loadu_si128((const __m128i *)(r0 + 16)),
+                                      _mm_loadu_si128((const __m128i *)(r1 + 16)));
+        __m128i w = _mm_packs_epi32(lo, hi);
+        _mm_storel_epi64((__m128i *)(gray + i), _mm_packus_epi16(w, w));
+    }
+    yuyv_half_gray_scalar(r0, r1, gray + i, pixels - i);
+}
+
+/*
+ * 16 source bytes of each row → one half-width YUYV pair per 8 bytes, as
+ * int16. Ys land in the even words (the high half of each madd sum is 0);
+ * the chroma sums are spread into the odd words.
+ */
+__attribute__((target("sse2")))
+static inline __m128i yuyv_half16_sse2(__m128i a0, __m128i a1) {
+    __m128i y = yuyv_half_y_sse2(a0, a1);
+    __m128i c = _mm_add_epi16(_mm_srli_epi16(a0, 8), _mm_srli_epi16(a1, 8));  // U0 V0 U1 V1 U2 V2 U3 V3
+    c = _mm_add_epi16(c, _mm_srli_si128(c, 4));
+    c = _mm_srli_epi16(_mm_add_epi16(c, _mm_set1_epi16(2)), 2);
+    c = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, _MM_SHUFFLE(1, 1, 0, 0)), _MM_SHUFFLE(1, 1, 0, 0));
+    return _mm_or_si128(y, _mm_and_si128(c, _mm_set1_epi32((int)0xFFFF0000)));
+}
+
+__attribute__((target("sse2")))
+void yuyv_half_sse2(const uint8_t *r0, const uint8_t *r1, uint8_t *out, size_t pixels) {
+    size_t i = 0;
+    for (; i + 8 <= pixels; i += 8, r0 += 32, r1 += 32) {
+        __m128i lo = yuyv_half16_sse2(_mm_loadu_si128((const __m128i *)r0), _mm_loadu_si128((const __m128i *)r1));
+        __m128i hi = yuyv_half16_sse2(_mm_loadu_si128((const __m128i *)(r0 + 16)),
+                                      _mm_loadu_si128((const __m128i *)(r1 + 16)));
+        _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_packus_epi16(lo, hi));
+    }
+    yuyv_half_scalar(r0, r1, out + 2 * i, pixels - i);
+}
+
+// The AVX2 versions run the SSE2 math per 128-bit lane; packs work per lane,
+// so the 64-bit quarters are put back in order with a permute.
+__attribute__((target("avx2")))
+void yuyv_to_gray_avx2(const uint8_t *yuyv, uint8_t *gray, size_t pixels) {
+    const __m256i ymask = _mm256_set1_epi16(0x00FF);
+    size_t i = 0;
+    for (; i + 32 <= pixels; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(yuyv + 2 * i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(yuyv + 2 * i + 32));
+        __m256i y = _mm256_packus_epi16(_mm256_and_si256(a, ymask), _mm256_and_si256(b, ymask));
+        _mm256_storeu_si256((__m256i *)(gray + i), _mm256_permute4x64_epi64(y, _MM_SHUFFLE(3, 1, 2, 0)));
+    }
+    yuyv_to_gray_scalar(yuyv + 2 * i, gray + i, pixels - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i yuyv_half_y_avx2(__m256i a0, __m256i a1) {
+    const __m256i ymask = _mm256_set1_epi16(0x00FF);
+    __m256i y = _mm256_add_epi16(_mm256_and_si256(a0, ymask), _mm256_and_si256(a1, ymask));
+    y = _mm256_madd_epi16(y, _mm256_set1_epi16(1));
+    return _mm256_srli_epi32(_mm256_add_epi32(y, _mm256_set1_epi32(2)), 2);
+}
+
+__attribute__((target("avx2")))
+void yuyv_half_gray_avx2(const uint8_t *r0, const uint8_t *r1, uint8_t *gray, size_t pixels) {
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16, r0 += 64, r1 += 64) {
+        __m256i lo = yuyv_half_y_avx2(_mm256_loadu_si256((const __m256i *)r0),
+                                      _mm256_loadu_si256((const __m256i *)r1));
+        __m256i hi = yuyv_half_y_avx2(_mm256_loadu_si256((const __m256i *)(r0 + 32)),
+                                      _mm256_loadu_si256((const __m256i *)(r1 + 32)));
+        __m256i w = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), _MM_SHUFFLE(3, 1, 2, 0));
+        w = _mm256_permute4x64_epi64(_mm256_packus_epi16(w, w), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i *)(gray + i), _mm256_castsi256_si128(w));
+    }
+    yuyv_half_gray_scalar(r0, r1, gray + i, pixels - i);
+}
+
+__attribute__((target("avx2")))
+void yuyv_half_avx2(const uint8_t *r0, const uint8_t *r1, uint8_t *out, size_t pixels) {
+    const __m256i two = _mm256_set1_epi16(2);
+    const __m256i cmask = _mm256_set1_epi32((int)0xFFFF0000);
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16, r0 += 64, r1 += 64) {
+        __m256i w[2];
+        for (int k = 0; k < 2; k++) {
+            __m256i a0 = _mm256_loadu_si256((const __m256i *)(r0 + 32 * k));
+            __m256i a1 = _mm256_loadu_si256((const __m256i *)(r1 + 32 * k));
+            __m256i c = _mm256_add_epi16(_mm256_srli_epi16(a0, 8), _mm256_srli_epi16(a1, 8));
+            c = _mm256_add_epi16(c, _mm256_srli_si256(c, 4));
+            c = _mm256_srli_epi16(_mm256_add_epi16(c, two), 2);
+            c = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c, _MM_SHUFFLE(1, 1, 0, 0)), _MM_SHUFFLE(1, 1, 0, 0));
+            w[k] = _mm256_or_si256(yuyv_half_y_avx2(a0, a1), _mm256_and_si256(c, cmask));
+        }
+        __m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi16(w[0], w[1]), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i *)(out + 2 * i), v);
+    }
+    yuyv_half_scalar(r0, r1, out + 2 * i, pixels - i);
+}
+
+static int yuyv_has_sse2(void) { return __builtin_cpu_supports("sse2"); }
+static int yuyv_has_avx2(void) { return __builtin_cpu_supports("avx2"); }
+#endif
+
+#ifdef YUYV_NEON
+/*
+ * 16 pixels per iteration: vld4 splits Y0/U/Y1/V, the sums are widened to
+ * 32 bits, and vqrshrn (+128, >> 8, saturate) then vqmovun clamp them.
+ */
+void yuyv_to_rgb_neon(const uint8_t *yuyv, uint8_t *rgb, size_t pixels) {
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        uint8x8x4_t px = vld4_u8(yuyv + 2 * i);
+        int16x8_t c[2] = {
+            vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(px.val[0])), vdupq_n_s16(16)),
+            vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(px.val[2])), vdupq_n_s16(16)),
+        };
+        int16x8_t d = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(px.val[1])), vdupq_n_s16(128));
+        int16x8_t e = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(px.val[3])), vdupq_n_s16(128));
+
+        int32x4_t cr[2] = { vmull_n_s16(vget_low_s16(e), 409), vmull_n_s16(vget_high_s16(e), 409) };
+        int32x4_t cg[2] = {
+            vmlal_n_s16(vmull_n_s16(vget_low_s16(d), -100), vget_low_s16(e), -208),
+            vmlal_n_s16(vmull_n_s16(vget_high_s16(d), -100), vget_high_s16(e), -208),
+        };
+        int32x4_t cb[2] = { vmull_n_s16(vget_low_s16(d), 516), vmull_n_s16(vget_high_s16(d), 516) };
+
+        uint8x8_t r[2], g[2], b[2];
+        for (int k = 0; k < 2; k++) {
+            int32x4_t yl = vmull_n_s16(vget_low_s16(c[k]), 298);
+            int32x4_t yh = vmull_n_s16(vget_high_s16(c[k]), 298);
+#define YUYV_CHANNEL_NEON(t) \
+    vqmovun_s16(vcombine_s16(vqrshrn_n_s32(vaddq_s32(yl, t[0]), 8), vqrshrn_n_s32(vaddq_s32(yh, t[1]), 8)))
+            r[k] = YUYV_CHANNEL_NEON(cr);
+            g[k] = YUYV_CHANNEL_NEON(cg);
+            b[k] = YUYV_CHANNEL_NEON(cb);
+#undef YUYV_CHANNEL_NEON
+        }
+        // Even and odd pixels back into order.
+        uint8x8x2_t rz = vzip_u8(r[0], r[1]), gz = vzip_u8(g[0], g[1]), bz = vzip_u8(b[0], b[1]);
+        uint8x16x3_t out = { {
+            vcombine_u8(rz.val[0], rz.val[1]),
+            vcombine_u8(gz.val[0], gz.val[1]),
+            vcombine_u8(bz.val[0], bz.val[1]),
+        } };
+        vst3q_u8(rgb + 3 * i, out);
+    }
+    yuyv_to_rgb_scalar(yuyv + 2 * i, rgb + 3 * i, pixels - i);
+}
+
+void yuyv_to_gray_neon(const uint8_t *yuyv, uint8_t *gray, size_t pixels) {
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) vst1q_u8(gray + i, vld2q_u8(yuyv + 2 * i).val[0]);
+    yuyv_to_gray_scalar(yuyv + 2 * i, gray + i, pixels - i);
+}
+
+/*
+ * The half kernels take 16 source pairs per vld4: one output pixel per
+ * pair, with Y0 + Y1 of both rows in a lane. vrshrn (+2, >> 2) rounds the
+ * same way as the scalar reference.
+ */
+static inline uint8x16_t yuyv_half_y_neon(uint8x16x4_t a, uint8x16x4_t b) {
+    uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(a.val[0]), vget_low_u8(a.val[2])),
+                              vaddl_u8(vget_low_u8(b.val[0]), vget_low_u8(b.val[2])));
+    uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(a.val[0]), vget_high_u8(a.val[2])),
+                              vaddl_u8(vget_high_u8(b.val[0]), vget_high_u8(b.val[2])));
+    return vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2));
+}
+
+void yuyv_half_gray_neon(const uint8_t *r0, const uint8_t *r1, uint8_t *gray, size_t pixels) {
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16, r0 += 64, r1 += 64) {
+        vst1q_u8(gray + i, yuyv_half_y_neon(vld4q_u8(r0), vld4q_u8(r1)));
+    }
+    yuyv_half_gray_scalar(r0, r1, gray + i, pixels - i);
+}
+
+/* U or V of both rows, adjacent source pairs summed: one value per output pair */
+static inline uint8x8_t yuyv_half_c_neon(uint8x16_t a, uint8x16_t b) {
+    uint16x8_t lo = vaddl_u8(vget_low_u8(a), vget_low_u8(b));
+    uint16x8_t hi = vaddl_u8(vget_high_u8(a), vget_high_u8(b));
+    return vrshrn_n_u16(vcombine_u16(vpadd_u16(vget_low_u16(lo), vget_high_u16(lo)),
+                                     vpadd_u16(vget_low_u16(hi), vget_high_u16(hi))), 2);
+}
+
+void yuyv_half_neon(const uint8_t *r0, const uint8_t *r1, uint8_t *out, size_t pixels) {
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16, r0 += 64, r1 += 64) {
+        uint8x16x4_t a = vld4q_u8(r0), b = vld4q_u8(r1);
+        uint8x16_t y = yuyv_half_y_neon(a, b);
+        uint8x8x2_t yz = vuzp_u8(vget_low_u8(y), vget_high_u8(y));
+        uint8x8x4_t px = { { yz.val[0], yuyv_half_c_neon(a.val[1], b.val[1]), yz.val[1],
+                             yuyv_half_c_neon(a.val[3], b.val[3]) } };
+        vst4_u8(out + 2 * i, px);
+    }
+    yuyv_half_scalar(r0, r1, out + 2 * i, pixels - i);
+}
+
+static int yuyv_has_neon(void) { return 1; }
+#endif
+
+static int yuyv_always(void) { return 1; }
+
+typedef struct {
+    const char *name;
+    yuyv_to_rgb_fn fn;
+    yuyv_to_gray_fn gray;
+    yuyv_half_fn half_gray;
+    yuyv_half_fn half;
+    int (*supported)(void);
+} yuyv_kernel_t;
+
+// Fastest first; the scalar reference always comes last.
+static const yuyv_kernel_t yuyv_kernels[] = {
+#ifdef YUYV_X86
+    { "avx2", yuyv_to_rgb_avx2, yuyv_to_gray_avx2, yuyv_half_gray_avx2, yuyv_half_avx2, yuyv_has_avx2 },
+    { "sse2", yuyv_to_rgb_sse2, yuyv_to_gray_sse2, yuyv_half_gray_sse2, yuyv_half_sse2, yuyv_has_sse2 },
+#endif
+#ifdef YUYV_NEON
+    { "neon", yuyv_to_rgb_neon, yuyv_to_gray_neon, yuyv_half_gray_neon, yuyv_half_neon, yuyv_has_neon },
+#endif
+    { "scalar", yuyv_to_rgb_scalar, yuyv_to_gray_scalar, yuyv_half_gray_scalar, yuyv_half_scalar, yuyv_always },
+};
+#define YUYV_NKERNELS (sizeof yuyv_kernels / sizeof yuyv_kernels[0])
+
+static const yuyv_kernel_t *yuyv_kernel;
+
+/**
+ * Compare `fn` with the scalar reference on `frames` random frames of
+ * up to `pixels` pixels; successive frames are trimmed by 0..14 pixels so
+ * the scalar tails get covered too. Returns 0 if every byte matches, -1
+ * otherwise.
+ */
+int yuyv_check(yuyv_to_rgb_fn fn, int frames, size_t pixels) {
+    uint8_t *src = malloc(pixels * 2), *want = malloc(pixels * 3), *got = malloc(pixels * 3);
+    int ret = src && want && got ? 0 : -1;
+    uint32_t x = 0x9E3779B9u;
+    for (int f = 0; ret == 0 && f < frames; f++) {
+        for (size_t i = 0; i < pixels * 2; i++) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            src[i] = x >> 24;
+        }
+        size_t n = pixels > 16 ? pixels - 2 * (f % 8) : pixels;
+        yuyv_to_rgb_scalar(src, want, n);
+        fn(src, got, n);
+        if (memcmp(want, got, n * 3) != 0) ret = -1;
+    }
+    free(src);
+    free(want);
+    free(got);
+    return ret;
+}
+
+/**
+ * Compare the gray and half kernels of `kern` with the scalar ones, like
+ * yuyv_check(). Returns 0 if every byte matches, -1 otherwise.
+ */
+int yuyv_check_extract(const yuyv_kernel_t *kern, int frames, size_t pixels) {
+    uint8_t *src = malloc(pixels * 4), *want = malloc(pixels * 2), *got = malloc(pixels * 2);
+    int ret = src && want && got ? 0 : -1;
+    uint32_t x = 0x2545F491u;
+    for (int f = 0; ret == 0 && f < frames; f++) {
+        for (size_t i = 0; i < pixels * 4; i++) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            src[i] = x >> 24;
+        }
+        size_t n = pixels > 32 ? pixels - 2 * (f % 16) : pixels;
+        const uint8_t *r1 = src + pixels * 2;
+        yuyv_to_gray_scalar(src, want, n);
+        kern->gray(src, got, n);
+        if (memcmp(want, got, n) != 0) ret = -1;
+        yuyv_half_gray_scalar(src, r1, want, n / 2);
+        kern->half_gray(src, r1, got, n / 2);
+        if (memcmp(want, got, n / 2) != 0) ret = -1;
+        size_t h = n / 2 & ~(size_t)1;
+        yuyv_half_scalar(src, r1, want, h);
+        kern->half(src, r1, got, h);
+        if (memcmp(want, got, h * 2) != 0) ret = -1;
+    }
+    free(src);
+    free(want);
+    free(got);
+    return ret;
+}
+
+/**
+ * Select the kernels used by yuyv_to_rgb() and friends: the fastest
+ * supported set that passes yuyv_check() and yuyv_check_extract(), or the
+ * one named by $YUYV_KERNEL. Falls back to the scalar reference.
+ * Returns the kernel's name.
+ */
+const char *yuyv_init(void) {
+    const char *want = getenv("YUYV_KERNEL");
+    const yuyv_kernel_t *chosen = &yuyv_kernels[YUYV_NKERNELS - 1];
+    for (size_t k = 0; k < YUYV_NKERNELS; k++) {
+        const yuyv_kernel_t *kern = &yuyv_kernels[k];
+        if (!kern->supported() || (want && strcmp(want, kern->name) != 0)) continue;
+        if (yuyv_check(kern->fn, 8, 4096) != 0 || yuyv_check_extract(kern, 8, 4096) != 0) {
+            fprintf(stderr, "yuyv: %s kernel does not match the reference, skipping it\n", kern->name);
+            continue;
+        }
+        chosen = kern;
+        break;
+    }
+    yuyv_kernel = chosen;
+    return chosen->name;
+}
+
+/* Call yuyv_init() first if the first conversions may run concurrently */
+void yuyv_to_rgb(const uint8_t *yuyv, uint8_t *rgb, size_t pixels) {
+    if (!yuyv_kernel) yuyv_init();
+    yuyv_kernel->fn(yuyv, rgb, pixels);
+}
+
+void yuyv_to_gray(const uint8_t *yuyv, uint8_t *gray, size_t pixels) {
+    if (!yuyv_kernel) yuyv_init();
+    yuyv_kernel->gray(yuyv, gray, pixels);
+}
+
+void yuyv_half_gray(const uint8_t *r0, const uint8_t *r1, uint8_t *gray, size_t pixels) {
+    if (!yuyv_kernel) yuyv_init();
+    yuyv_kernel->half_gray(r0, r1, gray, pixels);
+}
+
+void yuyv_half(const uint8_t *r0, const uint8_t *r1, uint8_t *out, size_t pixels) {
+    if (!yuyv_kernel) yuyv_init();
+    yuyv_kernel->half(r0, r1, out, pixels);
+}
+
+#define YUYV_MAX_WIDTH 4096     // widest region yuyv_extract_rows() takes
+
+typedef enum { YUYV_GRAY = 1, YUYV_YUV = 2, YUYV_RGB = 3 } yuyv_format_t;     // value: bytes per pixel
+
+typedef struct {
+    unsigned x, y, width, height;
+} yuyv_rect_t;
+
+/**
+ * Whether yuyv_extract_rows() can take `rect` of a width x height frame at
+ * `scale` (1, 2 or 4): x must be even (a whole YUYV pair), the width a
+ * multiple of 2 * scale and the height a multiple of scale.
+ */
+int yuyv_extract_valid(const yuyv_rect_t *rect, unsigned width, unsigned height, unsigned scale) {
+    if (scale != 1 && scale != 2 && scale != 4) return 0;
+    if (rect->x % 2 || rect->width % (2 * scale) || rect->height % scale || !rect->width) return 0;
+    if (rect->width > YUYV_MAX_WIDTH) return 0;
+    return rect->x + rect->width <= width && rect->y + rect->height <= height;
+}
+
+/**
+ * Write output rows [first, first + count) of `rect` (in a YUYV frame with
+ * `stride` bytes per row), box-filtered down by `scale`, as gray, RGB or
+ * YUYV again.
+ * `out` holds the whole output image, rect->width / scale pixels per row.
+ *
+ * Only the rows and pairs inside `rect` are read. Scaling by 4 halves
+ * twice and rounds at each step, so a value can be one off the rounded 4x4
+ * mean either way. Scaled RGB averages Y, U and V before converting, which
+ * is cheaper than averaging RGB; the two differ by a unit or two of
+ * rounding everywhere, and by more where the conversion clamps.
+ */
+void yuyv_extract_rows(const uint8_t *src, size_t stride, const yuyv_rect_t *rect, unsigned scale,
+                       yuyv_format_t format, uint8_t *out, int first, int count) {
+    size_t out_w = rect->width / scale;
+    size_t out_row = out_w * format;
+    const uint8_t *base = src + (size_t)rect->y * stride + (size_t)rect->x * 2;
+    out += first * out_row;
+    if (scale == 1 && format == YUYV_RGB && stride == out_w * 2) {
+        yuyv_to_rgb(base + first * stride, out, (size_t)count * out_w);
+        return;
+    }
+    // At scale 2 a scaled row is out_w YUYV pixels: rect->width bytes.
+    uint8_t half[2][YUYV_MAX_WIDTH], scaled[YUYV_MAX_WIDTH];
+    for (int y = first; y < first + count; y++, out += out_row) {
+        const uint8_t *row = base + (size_t)y * scale * stride;
+        const uint8_t *pair = row;      // the YUYV row, or the pair of rows, left to convert
+        const uint8_t *next = row + stride;
+        if (scale == 4) {
+            yuyv_half(row, row + stride, half[0], out_w * 2);
+            yuyv_half(row + 2 * stride, row + 3 * stride, half[1], out_w * 2);
+            pair = half[0];
+            next = half[1];
+        }
+        if (scale == 1) {
+            if (format == YUYV_GRAY) yuyv_to_gray(pair, out, out_w);
+            else if (format == YUYV_YUV) memcpy(out, pair, out_row);
+            else yuyv_to_rgb(pair, out, out_w);
+        } else if (format == YUYV_GRAY) {
+            yuyv_half_gray(pair, next, out, out_w);
+        } else if (format == YUYV_YUV) {
+            yuyv_half(pair, next, out, out_w);
+        } else {
+            yuyv_half(pair, next, scaled, out_w);
+            yuyv_to_rgb(scaled, out, out_w);
+        }
+    }
+}
+
+#endif